@@ -0,0 +1,600 @@
+/////////////////////////////////////////////////////////////
+// bench.c : Load generator and benchmark for miniweb
+//
+// Starts a miniweb server in a child process, serving the
+// same pages as main.c plus a POST echo, and drives it over
+// loopback. Prints throughput, latency percentiles, CPU per
+// request and memory use as a single line of JSON, so that
+// builds can be compared.
+//
+// Usage: miniweb_bench [-p port] [-c connections] [-d seconds]
+//                      [-k 0|1] [-P depth] [-i idle] [-b bytes]
+//                      [-m mix] [-t 0|1] [-x]
+/////////////////////////////////////////////////////////////
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "miniweb.h"
+
+#define MAX_DEPTH   64
+#define IN_BUFFER   65536
+
+// The requests that can be mixed, as given to -m
+struct request_type {
+    char *name;
+    char *method;
+    char *url;
+    int  weight;
+};
+static struct request_type request_types[] = {
+    {"index",    "GET",  "/index.html",  70},
+    {"root",     "GET",  "/",            0},
+    {"readme",   "GET",  "/README.md",   10},
+    {"favicon",  "GET",  "/favicon.ico", 0},
+    {"post",     "POST", "/echo",        20},
+    {"missing",  "GET",  "/missing",     0},
+};
+#define REQUEST_TYPES (int)(sizeof(request_types)/sizeof(request_types[0]))
+
+struct conn {
+    int    fd;
+    char   *out;                        // Room for 'depth' requests
+    size_t out_size;
+    size_t out_len;
+    size_t out_sent;
+    char   in[IN_BUFFER];
+    size_t in_used;
+    int    outstanding;                 // Requests sent, waiting for a reply
+    unsigned long long sent_at[MAX_DEPTH];
+    long   body_left;                   // Of the reply being read, or -1 when reading its headers
+    int    status;
+    int    closing;                     // The server said it will close after this reply
+};
+
+static int  port           = 8099;
+static int  connections    = 50;
+static int  seconds        = 5;
+static int  keep_alive     = 1;
+static int  depth          = 1;
+static int  idle_count     = 0;
+static int  post_bytes     = 512;
+static int  external       = 0;
+static int  tuned          = 1;
+static char *post_body;
+
+static unsigned *latencies;             // In us, for every reply
+static size_t latency_count;
+static size_t latency_alloc;
+static unsigned long long replies, errors, reconnects, bytes_received;
+static unsigned status_counts[6];       // By hundreds
+static unsigned random_state = 1;
+
+/////////////////////////////////////////////////////////////
+static unsigned long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/////////////////////////////////////////////////////////////
+// The server, run in the child process
+/////////////////////////////////////////////////////////////
+static struct miniweb_blob *index_html;
+
+static void page_GET_index_html(struct miniweb_session *session) {
+    struct miniweb_blob *blob = miniweb_blob_acquire(&index_html);
+    if(blob == NULL) {
+        miniweb_response(session, 404);
+        miniweb_write(session, "File not found\n",15);
+        return;
+    }
+    miniweb_response(session, 200);
+    miniweb_shared_blob(session, blob);
+    miniweb_blob_unref(blob);
+}
+
+static void page_GET_favicon_ico(struct miniweb_session *session) {
+    if(miniweb_shared_file(session, "favicon.ico") == 0) {
+        miniweb_response(session, 404);
+        miniweb_write(session, "File not found\n",15);
+    } else {
+        miniweb_response(session, 200);
+        miniweb_add_header(session, "Content-Type", "image/x-icon");
+    }
+}
+
+static void page_GET_README_md(struct miniweb_session *session) {
+    FILE *f = fopen("README.md","rb");
+    if(f == NULL) {
+        miniweb_response(session, 404);
+        miniweb_write(session, "File not found\n",15);
+    } else {
+        char buffer[1024];
+        int n;
+        miniweb_response(session, 200);
+        n = fread(buffer,1,1024,f);
+        while(n > 0) {
+            miniweb_write(session, buffer,n);
+            n = fread(buffer,1,1024,f);
+        }
+        fclose(f);
+    }
+}
+
+static void page_POST_echo(struct miniweb_session *session) {
+    miniweb_response(session, 200);
+    if(miniweb_content(session) != NULL)
+        miniweb_write(session, miniweb_content(session), miniweb_content_length(session));
+}
+
+static void load_index_html(void) {
+    static char fallback[] = "<HTML><BODY><H1>Welcome to Miniweb</H1></BODY></HTML>";
+    struct miniweb_blob *blob = NULL;
+    struct stat st;
+    FILE *f = fopen("index.html","rb");
+    if(f != NULL && fstat(fileno(f), &st) == 0 && (blob = miniweb_blob_new(st.st_size)) != NULL) {
+        if(fread(miniweb_blob_data(blob), 1, st.st_size, f) != (size_t)st.st_size) {
+            miniweb_blob_unref(blob);
+            blob = NULL;
+        }
+    }
+    if(f != NULL)
+        fclose(f);
+    if(blob == NULL && (blob = miniweb_blob_new(sizeof(fallback)-1)) != NULL)
+        memcpy(miniweb_blob_data(blob), fallback, sizeof(fallback)-1);
+    miniweb_blob_publish(&index_html, blob);
+}
+
+static void run_server(void) {
+    miniweb_set_port(port);
+    miniweb_set_keepalive(5, 0);
+    // TCP_NODELAY is on by default, and corking makes the headers and body share packets
+    if(tuned) {
+        miniweb_set_socket_option(MINIWEB_SOCKOPT_NODELAY, 1);
+        miniweb_set_socket_option(MINIWEB_SOCKOPT_CORK, 1);
+    }
+    miniweb_listen_header("Host");
+    miniweb_register_page("GET",  "/",             page_GET_index_html);
+    miniweb_register_page("GET",  "/index.html",   page_GET_index_html);
+    miniweb_register_page("GET",  "/favicon.ico",  page_GET_favicon_ico);
+    miniweb_register_page("GET",  "/README.md",    page_GET_README_md);
+    miniweb_register_page("POST", "/echo",         page_POST_echo);
+    load_index_html();
+    while(1)
+        miniweb_run(1000);
+}
+
+/////////////////////////////////////////////////////////////
+// The client
+/////////////////////////////////////////////////////////////
+static int parse_mix(char *mix) {
+    int i;
+    for(i = 0; i < REQUEST_TYPES; i++)
+        request_types[i].weight = 0;
+    while(*mix != '\0') {
+        char name[32];
+        int weight, n;
+        if(sscanf(mix, "%31[a-z]:%d%n", name, &weight, &n) != 2 || weight < 0)
+            return 0;
+        for(i = 0; i < REQUEST_TYPES && strcmp(request_types[i].name, name) != 0; i++)
+            ;
+        if(i == REQUEST_TYPES)
+            return 0;
+        request_types[i].weight = weight;
+        mix += n;
+        if(*mix == ',')
+            mix++;
+    }
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////
+static struct request_type *pick_request(void) {
+    int total = 0, i, r;
+    for(i = 0; i < REQUEST_TYPES; i++)
+        total += request_types[i].weight;
+    r = rand_r(&random_state) % total;
+    for(i = 0; r >= request_types[i].weight; i++)
+        r -= request_types[i].weight;
+    return &request_types[i];
+}
+
+/////////////////////////////////////////////////////////////
+static int connect_server(void) {
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    if(fd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+/////////////////////////////////////////////////////////////
+// Queue the next batch of 'depth' requests
+static void conn_send(struct conn *c) {
+    unsigned long long now = now_us();
+    int i;
+    c->out_len = c->out_sent = 0;
+    for(i = 0; i < depth; i++) {
+        struct request_type *rt = pick_request();
+        size_t room = c->out_size - c->out_len;
+        int n;
+        if(strcmp(rt->method, "POST") == 0)
+            n = snprintf(c->out + c->out_len, room,
+                         "POST %s HTTP/1.1\r\nHost: localhost\r\nContent-Length: %i\r\n%s\r\n",
+                         rt->url, post_bytes, keep_alive ? "" : "Connection: close\r\n");
+        else
+            n = snprintf(c->out + c->out_len, room, "%s %s HTTP/1.1\r\nHost: localhost\r\n%s\r\n",
+                         rt->method, rt->url, keep_alive ? "" : "Connection: close\r\n");
+        c->out_len += n;
+        if(strcmp(rt->method, "POST") == 0) {
+            memcpy(c->out + c->out_len, post_body, post_bytes);
+            c->out_len += post_bytes;
+        }
+        c->sent_at[c->outstanding++] = now;
+        // Without keep-alive there is only one request per connection
+        if(!keep_alive)
+            break;
+    }
+}
+
+/////////////////////////////////////////////////////////////
+static void conn_open(struct conn *c) {
+    c->fd = connect_server();
+    c->in_used = 0;
+    c->outstanding = 0;
+    c->body_left = -1;
+    c->closing = 0;
+    if(c->fd < 0)
+        errors++;
+    else
+        conn_send(c);
+}
+
+/////////////////////////////////////////////////////////////
+static void conn_reopen(struct conn *c, int measuring) {
+    if(c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+    reconnects++;
+    if(measuring)
+        conn_open(c);
+}
+
+/////////////////////////////////////////////////////////////
+static void record_latency(unsigned us) {
+    if(latency_count == latency_alloc) {
+        size_t new_alloc = latency_alloc ? latency_alloc*2 : 65536;
+        unsigned *n = realloc(latencies, new_alloc*sizeof(unsigned));
+        if(n == NULL)
+            return;
+        latencies = n;
+        latency_alloc = new_alloc;
+    }
+    latencies[latency_count++] = us;
+}
+
+/////////////////////////////////////////////////////////////
+// Take replies off the front of the input. Bodies are counted and thrown away as they
+// arrive, so they can be any size. Returns 0 if the input is nonsense.
+static int conn_replies(struct conn *c, int measuring) {
+    while(c->outstanding > 0 && c->in_used > 0) {
+        size_t take;
+        if(c->body_left < 0) {
+            char *end, *p;
+            size_t header_len;
+            c->in[c->in_used] = '\0';
+            end = strstr(c->in, "\r\n\r\n");
+            if(end == NULL)
+                return c->in_used < sizeof(c->in)-1;
+            header_len = end + 4 - c->in;
+            if(sscanf(c->in, "HTTP/%*d.%*d %d", &c->status) != 1)
+                return 0;
+            c->body_left = 0;
+            for(p = c->in; p != NULL && p < end; p = strstr(p, "\r\n")) {
+                p += 2;
+                if(strncasecmp(p, "Content-Length:", 15) == 0)
+                    c->body_left = atol(p+15);
+                else if(strncasecmp(p, "Connection: close", 17) == 0)
+                    c->closing = 1;
+            }
+            bytes_received += header_len;
+            memmove(c->in, c->in+header_len, c->in_used-header_len);
+            c->in_used -= header_len;
+        }
+        take = c->in_used < (size_t)c->body_left ? c->in_used : (size_t)c->body_left;
+        memmove(c->in, c->in+take, c->in_used-take);
+        c->in_used -= take;
+        c->body_left -= take;
+        bytes_received += take;
+        if(c->body_left > 0)
+            return 1;
+
+        // The whole reply is here
+        c->body_left = -1;
+        if(measuring) {
+            record_latency(now_us() - c->sent_at[0]);
+            replies++;
+            if(c->status >= 100 && c->status < 600)
+                status_counts[c->status/100]++;
+        }
+        memmove(c->sent_at, c->sent_at+1, (c->outstanding-1)*sizeof(c->sent_at[0]));
+        c->outstanding--;
+        if(c->closing)
+            break;
+    }
+    return 1;
+}
+
+/////////////////////////////////////////////////////////////
+static void run_client(void) {
+    struct conn *conns = calloc(connections, sizeof(struct conn));
+    struct pollfd *fds = calloc(connections, sizeof(struct pollfd));
+    int *idle_fds = calloc(idle_count ? idle_count : 1, sizeof(int));
+    unsigned long long end;
+    int i, open = 0;
+
+    if(conns == NULL || fds == NULL || idle_fds == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    // Idle connections just sit there, as browsers with nothing more to ask for do
+    for(i = 0; i < idle_count; i++)
+        idle_fds[i] = connect_server();
+
+    for(i = 0; i < connections; i++) {
+        conns[i].out_size = depth * (post_bytes + 256);
+        conns[i].out = malloc(conns[i].out_size);
+        if(conns[i].out == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        conn_open(&conns[i]);
+    }
+
+    end = now_us() + seconds * 1000000ULL;
+    while(1) {
+        int measuring = now_us() < end;
+        open = 0;
+        for(i = 0; i < connections; i++) {
+            struct conn *c = &conns[i];
+            fds[i].fd = c->fd;
+            fds[i].events = 0;
+            if(c->fd < 0)
+                continue;
+            open++;
+            fds[i].events = c->out_sent < c->out_len ? POLLOUT : POLLIN;
+        }
+        if(open == 0)
+            break;
+        if(poll(fds, connections, 100) < 0 && errno != EINTR)
+            break;
+        for(i = 0; i < connections; i++) {
+            struct conn *c = &conns[i];
+            ssize_t n;
+            if(c->fd < 0 || fds[i].revents == 0)
+                continue;
+            if(c->out_sent < c->out_len) {
+                n = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+                if(n < 0 && errno != EAGAIN && errno != EINTR) {
+                    errors++;
+                    conn_reopen(c, measuring);
+                } else if(n > 0) {
+                    c->out_sent += n;
+                }
+                continue;
+            }
+            n = read(c->fd, c->in + c->in_used, sizeof(c->in) - 1 - c->in_used);
+            if(n < 0 && (errno == EAGAIN || errno == EINTR))
+                continue;
+            if(n <= 0) {
+                // Closed by the server - only a problem if it didn't say it would
+                if(c->outstanding > 0 && !c->closing && measuring)
+                    errors++;
+                conn_reopen(c, measuring);
+                continue;
+            }
+            c->in_used += n;
+            if(!conn_replies(c, measuring)) {
+                errors++;
+                conn_reopen(c, measuring);
+            } else if(c->closing) {
+                conn_reopen(c, measuring);
+            } else if(c->outstanding == 0) {
+                if(!measuring) {
+                    close(c->fd);
+                    c->fd = -1;
+                } else {
+                    conn_send(c);
+                }
+            }
+        }
+    }
+    for(i = 0; i < idle_count; i++)
+        if(idle_fds[i] >= 0)
+            close(idle_fds[i]);
+    for(i = 0; i < connections; i++)
+        free(conns[i].out);
+    free(idle_fds);
+    free(fds);
+    free(conns);
+}
+
+/////////////////////////////////////////////////////////////
+static int compare_unsigned(const void *a, const void *b) {
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+static unsigned percentile(double p) {
+    size_t i;
+    if(latency_count == 0)
+        return 0;
+    i = (size_t)(p * latency_count);
+    if(i >= latency_count)
+        i = latency_count-1;
+    return latencies[i];
+}
+
+/////////////////////////////////////////////////////////////
+// The server's resident memory now, from /proc
+static long server_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    long rss = -1;
+    FILE *f;
+    snprintf(path, sizeof(path), "/proc/%i/status", (int)pid);
+    f = fopen(path, "r");
+    if(f == NULL)
+        return -1;
+    while(fgets(line, sizeof(line), f) != NULL)
+        if(sscanf(line, "VmRSS: %ld", &rss) == 1)
+            break;
+    fclose(f);
+    return rss;
+}
+
+/////////////////////////////////////////////////////////////
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: miniweb_bench [options]\n"
+        "  -p port     Port to use (default 8099)\n"
+        "  -c conns    Concurrent connections (default 50)\n"
+        "  -d seconds  How long to run (default 5)\n"
+        "  -k 0|1      Keep-alive (default 1)\n"
+        "  -P depth    Requests pipelined on each connection (default 1, max %i)\n"
+        "  -i idle     Extra connections left idle (default 0)\n"
+        "  -b bytes    POST body size (default 512)\n"
+        "  -m mix      Request mix, e.g. index:70,readme:10,post:20\n"
+        "              (from index, root, readme, favicon, post and missing)\n"
+        "  -t 0|1      Turn on TCP_NODELAY and TCP_CORK in the server (default 1)\n"
+        "  -x          Use a server that is already running, rather than starting one\n", MAX_DEPTH);
+    exit(1);
+}
+
+/////////////////////////////////////////////////////////////
+int main(int argc, char *argv[]) {
+    struct rusage client_start, client_end, server_usage;
+    unsigned long long started, elapsed;
+    double client_cpu, server_cpu = -1;
+    long rss = -1, max_rss = -1;
+    pid_t server = -1;
+    int opt, i;
+
+    while((opt = getopt(argc, argv, "p:c:d:k:P:i:b:m:t:x")) != -1) {
+        switch(opt) {
+            case 'p': port        = atoi(optarg); break;
+            case 'c': connections = atoi(optarg); break;
+            case 'd': seconds     = atoi(optarg); break;
+            case 'k': keep_alive  = atoi(optarg); break;
+            case 'P': depth       = atoi(optarg); break;
+            case 'i': idle_count  = atoi(optarg); break;
+            case 'b': post_bytes  = atoi(optarg); break;
+            case 'm': if(!parse_mix(optarg)) usage(); break;
+            case 't': tuned       = atoi(optarg); break;
+            case 'x': external    = 1; break;
+            default:  usage();
+        }
+    }
+    if(connections < 1 || seconds < 1 || depth < 1 || depth > MAX_DEPTH || idle_count < 0 ||
+       post_bytes < 0 || post_bytes > IN_BUFFER/2)
+        usage();
+    for(i = 0, opt = 0; i < REQUEST_TYPES; i++)
+        opt += request_types[i].weight;
+    if(opt == 0)
+        usage();
+    post_body = malloc(post_bytes+1);
+    if(post_body == NULL)
+        return 1;
+    memset(post_body, 'x', post_bytes);
+    signal(SIGPIPE, SIG_IGN);
+
+    if(!external) {
+        server = fork();
+        if(server < 0) {
+            perror("fork");
+            return 1;
+        }
+        if(server == 0) {
+            run_server();
+            return 0;
+        }
+    }
+    // Wait for the server to be listening
+    for(i = 0; i < 200; i++) {
+        int fd = connect_server();
+        if(fd >= 0) {
+            close(fd);
+            break;
+        }
+        usleep(10000);
+    }
+    if(i == 200) {
+        fprintf(stderr, "Unable to connect to port %i\n", port);
+        if(server > 0)
+            kill(server, SIGKILL);
+        return 1;
+    }
+
+    getrusage(RUSAGE_SELF, &client_start);
+    started = now_us();
+    run_client();
+    elapsed = now_us() - started;
+    getrusage(RUSAGE_SELF, &client_end);
+
+    if(server > 0) {
+        rss = server_rss_kb(server);
+        kill(server, SIGTERM);
+        if(wait4(server, NULL, 0, &server_usage) == server) {
+            server_cpu = server_usage.ru_utime.tv_sec * 1e6 + server_usage.ru_utime.tv_usec +
+                         server_usage.ru_stime.tv_sec * 1e6 + server_usage.ru_stime.tv_usec;
+            max_rss = server_usage.ru_maxrss;
+        }
+    }
+    client_cpu = (client_end.ru_utime.tv_sec - client_start.ru_utime.tv_sec) * 1e6 +
+                 (client_end.ru_utime.tv_usec - client_start.ru_utime.tv_usec) +
+                 (client_end.ru_stime.tv_sec - client_start.ru_stime.tv_sec) * 1e6 +
+                 (client_end.ru_stime.tv_usec - client_start.ru_stime.tv_usec);
+
+    qsort(latencies, latency_count, sizeof(unsigned), compare_unsigned);
+    printf("{\"connections\":%i,\"idle\":%i,\"keep_alive\":%i,\"depth\":%i,\"tuned\":%i,\"seconds\":%.3f,"
+           "\"requests\":%llu,\"errors\":%llu,\"reconnects\":%llu,\"bytes\":%llu,"
+           "\"status_2xx\":%u,\"status_4xx\":%u,\"status_5xx\":%u,"
+           "\"requests_per_sec\":%.1f,\"p50_us\":%u,\"p90_us\":%u,\"p99_us\":%u,\"p999_us\":%u,\"max_us\":%u,"
+           "\"server_cpu_us_per_request\":%.2f,\"client_cpu_us_per_request\":%.2f,"
+           "\"server_rss_kb\":%ld,\"server_max_rss_kb\":%ld}\n",
+           connections, idle_count, keep_alive, depth, tuned, elapsed / 1e6,
+           replies, errors, reconnects, bytes_received,
+           status_counts[2], status_counts[4], status_counts[5],
+           replies * 1e6 / elapsed, percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999),
+           latency_count ? latencies[latency_count-1] : 0,
+           replies && server_cpu >= 0 ? server_cpu / replies : -1.0, replies ? client_cpu / replies : -1.0,
+           rss, max_rss);
+    free(latencies);
+    free(post_body);
+    return errors != 0;
+}
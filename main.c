@@ -10,11 +10,13 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include "miniweb.h"
 #include "time.h"
 
-static char *index_html_buffer;
-static size_t index_html_size;
+// The current version of index.html - replaced whenever the file changes
+static struct miniweb_blob *index_html;
+static time_t index_html_mtime;
 
 #define ALLOW_EXIT_URL 0
 
@@ -23,57 +25,52 @@ void page_GET_exit(struct miniweb_session *session) {
     (void)session;
     // Allow the user to cause a clean tidyup for valgrind testing.
     miniweb_tidyup();
-    if(index_html_buffer)
-        free(index_html_buffer);
+    miniweb_blob_publish(&index_html, NULL);
     exit(1);
 }
 #endif
 
-void page_GET_index_html(struct miniweb_session *session) {
-    if(index_html_buffer == NULL) { 
-        FILE *f = fopen("index.html","rb");
-        if(f == NULL) {
-            miniweb_response(session, 404);
-            miniweb_write(session, "File not found\n",15);
+void load_index_html(void) {
+    struct stat st;
+    if(stat("index.html", &st) != 0 || st.st_mtime == index_html_mtime)
+        return;
+
+    FILE *f = fopen("index.html","rb");
+    if(f == NULL)
+        return;
+    struct miniweb_blob *blob = miniweb_blob_new(st.st_size);
+    if(blob != NULL) {
+        if(fread(miniweb_blob_data(blob), 1, st.st_size, f) == (size_t)st.st_size) {
+            // Any session still sending the old version keeps its own reference
+            miniweb_blob_publish(&index_html, blob);
+            index_html_mtime = st.st_mtime;
         } else {
-            // Work out how big the file is, and read it into the buffer
-            fseek(f, 0,SEEK_END);
-            size_t file_size = ftell(f);
-            fseek(f, 0,SEEK_SET);
-            // Still malloc something for a zero-length file
-            if(file_size == 0) 
-               file_size++;
-printf("Allocate file\n");
-            index_html_buffer = malloc(file_size);
-            if(index_html_buffer == NULL) {
-                miniweb_response(session, 404);
-                miniweb_write(session, "Out of memory\n",14);
-            } else {
-                index_html_size  = fread(index_html_buffer,1,file_size,f);
-            }
-            fclose(f);
+            miniweb_blob_unref(blob);
         }
     }
+    fclose(f);
+}
+
+void page_GET_index_html(struct miniweb_session *session) {
+    struct miniweb_blob *blob = miniweb_blob_acquire(&index_html);
+    if(blob == NULL) {
+        miniweb_response(session, 404);
+        miniweb_write(session, "File not found\n",15);
+        return;
+    }
     miniweb_response(session, 200);
-    miniweb_shared_data_buffer(session, index_html_buffer, index_html_size);
+    miniweb_shared_blob(session, blob);
+    miniweb_blob_unref(blob);
 }
 
 void page_GET_favicon_ico(struct miniweb_session *session) {
-     FILE *f = fopen("favicon.ico","rb");
-     if(f == NULL) {
+     // Sent straight from the file, and can be resumed with a Range request
+     if(miniweb_shared_file(session, "favicon.ico") == 0) {
          miniweb_response(session, 404);
          miniweb_write(session, "File not found\n",15);
      } else {
-         char buffer[1024];
-         int n;
          miniweb_response(session, 200);
          miniweb_add_header(session, "Content-Type", "image/x-icon");
-         n = fread(buffer,1,1024,f);
-         while(n > 0) {
-             miniweb_write(session, buffer,n);
-             n = fread(buffer,1,1024,f);
-         }
-         fclose(f);
      }
 }
 
@@ -129,6 +126,9 @@ int main(int argc, char *argv[]) {
     // Which headers are we interested in?
     miniweb_listen_header("Host");
 
+    // Compress larger generated pages for clients that accept gzip (needs a ZLIB=1 build)
+    miniweb_set_compression(6, 1024);
+
     // Register the web pages
     miniweb_register_page("GET", "/",             page_GET_index_html);
     miniweb_register_page("GET", "/index.html",   page_GET_index_html);
@@ -141,6 +141,7 @@ int main(int argc, char *argv[]) {
 
     // Start the web server
     while(1) {
+        load_index_html();
         miniweb_run(4000);
         time_t now = time(NULL);
         if(now > stats_time) {
@@ -149,7 +150,5 @@ int main(int argc, char *argv[]) {
         }
     }
     miniweb_tidyup();
-    if(index_html_buffer) {
-        free(index_html_buffer);
-    }
+    miniweb_blob_publish(&index_html, NULL);
 }
@@ -0,0 +1,442 @@
+/////////////////////////////////////////////////////////////
+// microbench.c : Microbenchmarks for miniweb's internals
+//
+// Includes miniweb.c directly, so the static functions on the
+// request path can be timed on their own - the parser, URL
+// matching, listened header lookup, reply header assembly and
+// reply buffer growth - over in-memory buffers and a socket
+// pair rather than the network. Prints ns, cycles (on x86) and
+// heap allocations for each operation.
+//
+// Usage: miniweb_microbench [-t ms] [name...]
+//   Only the benchmarks whose names start with one of the
+//   given names are run.
+/////////////////////////////////////////////////////////////
+// A static build needs room for the thousand pages registered below
+#ifndef MINIWEB_STATIC_CONFIG
+#define MINIWEB_STATIC_CONFIG (1 << 20)
+#endif
+#include "miniweb.c"
+
+static long min_ms = 300;               // Run each benchmark for at least this long
+static char **filters;
+static int  filter_count;
+
+/////////////////////////////////////////////////////////////
+static unsigned long long bench_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Everything miniweb takes from the heap goes through mem_alloc(), which counts it
+static unsigned long long allocs(void) {
+    unsigned long long n = 0;
+    for(int c = 0; c < MINIWEB_MEM_CATEGORIES; c++)
+        n += mem_allocs[c];
+    return n;
+}
+
+// The time stamp counter, where there is one. It ticks at a fixed rate, close to the
+// CPU's base clock.
+static unsigned long long bench_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/////////////////////////////////////////////////////////////
+// Call 'op' in growing batches until min_ms has passed, then report the averages
+static void bench(const char *name, void (*op)(void *), void *arg) {
+    unsigned long long ops = 0, batch = 1, start, elapsed, allocs_start, cycles;
+    int i;
+
+    if(filter_count > 0) {
+        for(i = 0; i < filter_count; i++) {
+            if(strncmp(name, filters[i], strlen(filters[i])) == 0)
+                break;
+        }
+        if(i == filter_count)
+            return;
+    }
+
+    op(arg);    // Warm up caches and the buffer pool
+    allocs_start = allocs();
+    start = bench_ns();
+    cycles = bench_cycles();
+    do {
+        for(unsigned long long n = 0; n < batch; n++)
+            op(arg);
+        ops += batch;
+        if(batch < 1000000)
+            batch *= 2;
+        elapsed = bench_ns() - start;
+    } while(elapsed < (unsigned long long)min_ms * 1000000ULL);
+
+    cycles = bench_cycles() - cycles;
+
+    printf("%-34s %12llu %12.1f %12.0f %10.2f\n", name, ops, (double)elapsed / ops,
+           (double)cycles / ops, (double)(allocs() - allocs_start) / ops);
+}
+
+/////////////////////////////////////////////////////////////
+// A session that isn't attached to anything, for driving internals directly
+static void bench_session(struct miniweb_session *s) {
+    session_init(s, -1);
+    s->protocol = "HTTP/1.1";
+    s->method   = "GET";
+}
+
+// Let session_empty() free what was allocated, but not the strings set above
+static void bench_session_empty(struct miniweb_session *s) {
+    char *in_buffer = s->in_buffer;
+    s->in_buffer = NULL;
+    s->method    = NULL;
+    s->protocol  = NULL;
+    s->full_url  = NULL;
+    session_empty(s);
+    s->in_buffer = in_buffer;
+}
+
+/////////////////////////////////////////////////////////////
+// Parsing - everything but the blank line that ends the request, so that nothing is run
+/////////////////////////////////////////////////////////////
+struct parse_arg {
+    struct miniweb_session s;
+    const char *request;
+    size_t len;
+};
+
+static void op_parse(void *arg) {
+    struct parse_arg *a = arg;
+    memcpy(a->s.in_buffer, a->request, a->len);
+    a->s.in_buffer_used    = a->len;
+    a->s.in_buffer_scanned = 0;
+    a->s.parser_state      = p_method;
+    session_parse(&a->s);
+    if(a->s.parser_state != p_start_header) {
+        fprintf(stderr, "Parse failed\n");
+        exit(1);
+    }
+    // Free what the parser allocated, but keep the input buffer
+    char *in_buffer = a->s.in_buffer;
+    a->s.in_buffer = NULL;
+    session_empty(&a->s);
+    a->s.in_buffer = in_buffer;
+}
+
+static void bench_parse(const char *name, const char *request) {
+    struct parse_arg a;
+    // The parser stops once a session has lost its socket, so give it one that isn't used
+    session_init(&a.s, open("/dev/null", O_RDONLY));
+    a.s.in_buffer      = pool_alloc(MAX_HEADER_SIZE);
+    a.s.in_buffer_size = MAX_HEADER_SIZE;
+    a.request = request;
+    a.len     = strlen(request);
+    bench(name, op_parse, &a);
+    close(a.s.socket);
+    a.s.socket = -1;
+    session_empty(&a.s);
+}
+
+/////////////////////////////////////////////////////////////
+// A whole request over a socket pair - read, parse, route, run, build and write the reply
+/////////////////////////////////////////////////////////////
+struct request_arg {
+    struct miniweb_session *s;
+    int peer;
+    const char *request;
+    size_t len;
+};
+
+static void page_hello(struct miniweb_session *session) {
+    miniweb_response(session, 200);
+    miniweb_write(session, "Hello\n", 6);
+}
+
+static void op_request(void *arg) {
+    struct request_arg *a = arg;
+    char reply[4096];
+    if(write(a->peer, a->request, a->len) != (ssize_t)a->len) {
+        perror("write");
+        exit(1);
+    }
+    session_read(a->s);
+    if(a->s->socket == -1 || read(a->peer, reply, sizeof(reply)) <= 0) {
+        fprintf(stderr, "Request failed\n");
+        exit(1);
+    }
+}
+
+static void bench_request(const char *name, const char *request) {
+    struct request_arg a;
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        perror("socketpair");
+        exit(1);
+    }
+    a.s       = session_new(sv[0]);
+    a.peer    = sv[1];
+    a.request = request;
+    a.len     = strlen(request);
+    bench(name, op_request, &a);
+    session_end(a.s);
+    close(a.peer);
+}
+
+/////////////////////////////////////////////////////////////
+// Routing
+/////////////////////////////////////////////////////////////
+static void op_route(void *arg) {
+    struct miniweb_session *s = arg;
+    session_find_target_url(s);
+    if(s->wildcard) {
+        mem_free(s->wildcard);
+        s->wildcard = NULL;
+    }
+}
+
+static void bench_route(const char *name, char *url) {
+    struct miniweb_session s;
+    bench_session(&s);
+    s.full_url = url;
+    bench(name, op_route, &s);
+    bench_session_empty(&s);
+}
+
+/////////////////////////////////////////////////////////////
+// Listened header lookup
+/////////////////////////////////////////////////////////////
+static void op_header_find(void *arg) {
+    char *header = arg;
+    header_find(header, strlen(header));
+}
+
+/////////////////////////////////////////////////////////////
+// Reply header assembly
+/////////////////////////////////////////////////////////////
+static void op_build_header(void *arg) {
+    struct miniweb_session *s = arg;
+    build_header_data(s);
+    pool_free(s->header_data, s->header_data_alloc);
+    s->header_data = NULL;
+}
+
+static void bench_build_header(const char *name, int headers) {
+    struct miniweb_session s;
+    char header[32];
+    bench_session(&s);
+    s.response_code = 200;
+    miniweb_add_header(&s, "Server", "Miniweb/0.0.1 (Linux)");
+    miniweb_add_header(&s, "Content-Type", "text/html");
+    miniweb_add_header(&s, "Content-Length", "78051");
+    for(int i = 3; i < headers; i++) {
+        sprintf(header, "X-Bench-%i", i);
+        miniweb_add_header(&s, header, "some value or other");
+    }
+    bench(name, op_build_header, &s);
+    bench_session_empty(&s);
+}
+
+/////////////////////////////////////////////////////////////
+// Reply buffer growth through miniweb_write()
+/////////////////////////////////////////////////////////////
+struct write_arg {
+    struct miniweb_session s;
+    size_t total;
+    size_t chunk;
+};
+
+static void op_write(void *arg) {
+    static char data[65536];
+    struct write_arg *a = arg;
+    for(size_t done = 0; done < a->total; done += a->chunk)
+        miniweb_write(&a->s, data, a->chunk);
+    pool_free(a->s.data, a->s.data_size);
+    a->s.data = NULL;
+    a->s.data_size = 0;
+    a->s.data_used = 0;
+}
+
+static void bench_write(const char *name, size_t total, size_t chunk, struct url_reg *url) {
+    struct write_arg a;
+    bench_session(&a.s);
+    a.s.url = url;
+    a.total = total;
+    a.chunk = chunk;
+    bench(name, op_write, &a);
+    bench_session_empty(&a.s);
+}
+
+/////////////////////////////////////////////////////////////
+// A table row rendered from a template, against the snprintf() and miniweb_write() way
+/////////////////////////////////////////////////////////////
+#define TEMPLATE_ROWS 20
+static const char *row_names[] = { "alpha", "beta & gamma", "<delta>", "epsilon" };
+
+static void op_template(void *arg) {
+    struct miniweb_template *t = arg;
+    struct miniweb_session s;
+    union miniweb_template_value v[3];
+    bench_session(&s);
+    for(int i = 0; i < TEMPLATE_ROWS; i++) {
+        v[0].number = i;
+        v[1].text   = (char *)row_names[i%4];
+        v[2].number = i*1000;
+        miniweb_template_render(&s, t, v, 0);
+    }
+    bench_session_empty(&s);
+}
+
+static void op_snprintf(void *arg) {
+    struct miniweb_session s;
+    char buffer[256], escaped[64];
+    (void)arg;
+    bench_session(&s);
+    for(int i = 0; i < TEMPLATE_ROWS; i++) {
+        // What a handler has to do by hand, escaping included
+        escaped[html_escape(escaped, row_names[i%4])] = '\0';
+        int len = snprintf(buffer, sizeof(buffer), "<tr><td>%i</td><td class=\"name\">%s</td><td>%i</td></tr>\n",
+                           i, escaped, i*1000);
+        miniweb_write(&s, buffer, len);
+    }
+    bench_session_empty(&s);
+}
+
+/////////////////////////////////////////////////////////////
+// The same rows as JSON, from the builder and from miniweb_printf()
+/////////////////////////////////////////////////////////////
+static void op_json(void *arg) {
+    struct miniweb_session s;
+    (void)arg;
+    bench_session(&s);
+    miniweb_json_array_start(&s);
+    for(int i = 0; i < TEMPLATE_ROWS; i++) {
+        miniweb_json_object_start(&s);
+        miniweb_json_key(&s, "id");
+        miniweb_json_int(&s, i);
+        miniweb_json_key(&s, "name");
+        miniweb_json_string(&s, (char *)row_names[i%4]);
+        miniweb_json_key(&s, "size");
+        miniweb_json_double(&s, i*1000.5);
+        miniweb_json_object_end(&s);
+    }
+    miniweb_json_array_end(&s);
+    bench_session_empty(&s);
+}
+
+static void op_printf(void *arg) {
+    struct miniweb_session s;
+    (void)arg;
+    bench_session(&s);
+    for(int i = 0; i < TEMPLATE_ROWS; i++)
+        miniweb_printf(&s, "%s{\"id\":%i,\"name\":\"%s\",\"size\":%g}", i ? "," : "[", i, row_names[i%4], i*1000.5);
+    miniweb_write(&s, "]", 1);
+    bench_session_empty(&s);
+}
+
+/////////////////////////////////////////////////////////////
+static void usage(void) {
+    fprintf(stderr,
+        "Usage: miniweb_microbench [-t ms] [name...]\n"
+        "  -t ms       Run each benchmark for at least this long (default 300)\n"
+        "  name        Only run benchmarks whose names start with this\n");
+    exit(1);
+}
+
+/////////////////////////////////////////////////////////////
+int main(int argc, char *argv[]) {
+    static const char *request =
+        "GET /index.html?lang=en HTTP/1.1\r\n"
+        "Host: localhost:8080\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 Firefox/120.0\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+        "Accept-Language: en-US,en;q=0.5\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Connection: keep-alive\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n";
+    static const char *small_request = "GET /hello HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    char name[64], url[32];
+    int opt, routes = 0, listened = 0;
+    static const int route_counts[] = {10, 100, 1000};
+    static const int header_counts[] = {10, 50, 200};
+
+    while((opt = getopt(argc, argv, "t:")) != -1) {
+        switch(opt) {
+            case 't': min_ms = atol(optarg); break;
+            default:  usage();
+        }
+    }
+    filters = argv+optind;
+    filter_count = argc-optind;
+
+#ifdef MINIWEB_STATIC
+    static_init();      // As miniweb_run() does first
+#endif
+    // What miniweb_run() listens for once it starts
+    miniweb_listen_header("Content-Length");
+    miniweb_listen_header("Connection");
+    miniweb_listen_header("Range");
+    miniweb_listen_header("If-Range");
+    miniweb_set_keepalive(5, 0);
+
+    printf("%-34s %12s %12s %12s %10s\n", "benchmark", "ops", "ns/op", "cycles/op", "allocs/op");
+    bench_parse("parse/request", request);
+    miniweb_register_page("GET", "/hello", page_hello);
+    bench_request("request/socketpair", small_request);
+
+    // Routes are searched newest first, so the first one registered is the worst case
+    for(int i = 0; i < (int)(sizeof(route_counts)/sizeof(route_counts[0])); i++) {
+        for(; routes < route_counts[i]; routes++) {
+            sprintf(url, "/route/%i", routes);
+            miniweb_register_page("GET", url, page_hello);
+        }
+        sprintf(name, "route/%i/first", routes);
+        bench_route(name, "/route/0");
+        sprintf(name, "route/%i/miss", routes);
+        bench_route(name, "/nothing/here");
+    }
+    miniweb_register_page("GET", "/files/*.txt", page_hello);
+    sprintf(name, "route/%i/wildcard", routes+1);
+    bench_route(name, "/files/readme.txt");
+
+    // Likewise for listened headers, where Content-Length was the first
+    for(int i = 0; i < (int)(sizeof(header_counts)/sizeof(header_counts[0])); i++) {
+        for(; listened < header_counts[i]; listened++) {
+            sprintf(url, "X-Listen-%i", listened);
+            miniweb_listen_header(url);
+        }
+        sprintf(name, "header_find/%i/first", listened+4);
+        bench(name, op_header_find, "content-length");
+        sprintf(name, "header_find/%i/miss", listened+4);
+        bench(name, op_header_find, "Accept-Language");
+    }
+    sprintf(name, "parse/request/%i_listened", listened+4);
+    bench_parse(name, request);
+
+    bench_build_header("build_header/3", 3);
+    bench_build_header("build_header/10", 10);
+    bench_build_header("build_header/30", 30);
+
+    bench_write("write/1k_in_16", 1024, 16, NULL);
+    bench_write("write/64k_in_64", 65536, 64, NULL);
+    bench_write("write/1m_in_4k", 1048576, 4096, NULL);
+    // With a history of large replies the first buffer is the right size
+    struct url_reg *ur = url_reg_find("GET", "/route/0");
+    for(int i = 0; i < 16; i++)
+        url_size_history_add(ur, 65536);
+    bench_write("write/64k_in_64/predicted", 65536, 64, ur);
+
+    struct miniweb_template *row = miniweb_template_compile(
+        "<tr><td>{{id:int}}</td><td class=\"name\">{{name}}</td><td>{{size:int}}</td></tr>\n");
+    bench("template/20_rows", op_template, row);
+    bench("template/20_rows/snprintf", op_snprintf, NULL);
+    miniweb_template_free(row);
+    bench("json/20_rows", op_json, NULL);
+    bench("printf/20_rows", op_printf, NULL);
+
+    miniweb_tidyup();
+    return 0;
+}
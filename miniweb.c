@@ -7,6 +7,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <float.h>
 #include <malloc.h>
 #include <time.h>
 #include <memory.h>
@@ -14,19 +19,157 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#ifdef MINIWEB_ZLIB
+#include <zlib.h>
+#endif
+#ifdef MINIWEB_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
 
 #include "miniweb.h"
 
+#ifdef MINIWEB_STATIC
+// Static allocation - sessions and buffers are reserved when the server starts, and all
+// memory comes from a fixed arena rather than the heap. Buffer sizes are powers of two.
+#ifndef MINIWEB_STATIC_SESSIONS
+#define MINIWEB_STATIC_SESSIONS  16      // Connections served at once, any more get a 503
+#endif
+#ifndef MINIWEB_STATIC_IN_BUFFER
+#define MINIWEB_STATIC_IN_BUFFER 4096    // Largest request line and headers
+#endif
+#ifndef MINIWEB_STATIC_REPLY
+#define MINIWEB_STATIC_REPLY     16384   // Largest reply built with miniweb_write()
+#endif
+#ifndef MINIWEB_STATIC_HEADERS
+#define MINIWEB_STATIC_HEADERS   16      // Request headers kept, and reply headers added, per request
+#endif
+#ifndef MINIWEB_STATIC_CONTENT
+#define MINIWEB_STATIC_CONTENT   4096    // Largest POST body
+#endif
+#ifndef MINIWEB_STATIC_CONFIG
+#define MINIWEB_STATIC_CONFIG    16384   // For registered pages, listened for headers and the like
+#endif
+#define STATIC_HEADER_BUFFER     1024    // The smallest buffer reserved, which reply headers go in
+#if (MINIWEB_STATIC_IN_BUFFER & (MINIWEB_STATIC_IN_BUFFER-1)) || MINIWEB_STATIC_IN_BUFFER < STATIC_HEADER_BUFFER || \
+    (MINIWEB_STATIC_REPLY & (MINIWEB_STATIC_REPLY-1)) || MINIWEB_STATIC_REPLY < STATIC_HEADER_BUFFER
+#error MINIWEB_STATIC_IN_BUFFER and MINIWEB_STATIC_REPLY must be powers of two, and at least 1024
+#endif
+// Each session can hold three of the smallest buffers, two input sized ones and one reply
+// sized one (buffers move up a size at a time as they grow). Strings copied out of the
+// request are no bigger than the input buffer, and header lists are limited in length.
+#define STATIC_SESSION_BUFFERS   (3*(STATIC_HEADER_BUFFER+64) + 2*(MINIWEB_STATIC_IN_BUFFER+64) + MINIWEB_STATIC_REPLY+64)
+#define STATIC_SESSION_OTHER     (sizeof(struct miniweb_session)+64 + 2*MINIWEB_STATIC_IN_BUFFER + \
+                                  MINIWEB_STATIC_CONTENT + MINIWEB_STATIC_HEADERS*256)
+#ifndef MINIWEB_STATIC_ARENA
+#define MINIWEB_STATIC_ARENA     (MINIWEB_STATIC_CONFIG + MINIWEB_STATIC_SESSIONS*(STATIC_SESSION_BUFFERS+STATIC_SESSION_OTHER))
+#endif
+#define MAX_HEADER_SIZE MINIWEB_STATIC_IN_BUFFER
+#else
 #define MAX_HEADER_SIZE 10240
+#endif
+#define READ_SCRATCH_SIZE 16384   // Reads land here first, shared by all sessions
+#define POOL_MIN_SHIFT  7         // Smallest pooled buffer is 128 bytes...
+#define POOL_CLASSES    14        // ...and the largest is 1MB
+// Build profiles (see the Makefile) turn these on and off. Anything they guard is tested
+// with a constant, so it compiles to nothing when it is off.
+#ifdef MINIWEB_DEBUG_FSM
+#define DEBUG_FSM 1               // Print every character as the parser sees it
+#else
 #define DEBUG_FSM 0
+#endif
+#ifdef MINIWEB_NO_STATS
+#define STATS_ENABLED 0           // No latency histograms or request tracing
+#else
+#define STATS_ENABLED 1
+#endif
+#define COMPRESS_POOL_MAX        4   // Idle deflate streams kept for reuse
+#ifndef MINIWEB_ZLIB_WINDOW_BITS
+#define MINIWEB_ZLIB_WINDOW_BITS 15  // Smaller values use less memory per stream
+#endif
+#ifndef MINIWEB_ZLIB_MEM_LEVEL
+#define MINIWEB_ZLIB_MEM_LEVEL   8
+#endif
+#define H2_FRAME_MAX      16384     // Largest HTTP/2 frame we accept (the protocol's minimum)
+#define H2_QUEUE_LIMIT    65536     // Stop making DATA frames while this much is queued to send
+#define H2_TABLE_MAX      4096      // HPACK dynamic table size (the protocol's default)
+#define H2_HEADER_BLOCK_MAX 65536
+#define H2_RECV_WINDOW    65535     // What a client may send before it is given more room (the default)
+#define WS_PING_SECS      30        // Ping idle WebSocket and SSE clients after this long
+#ifdef MINIWEB_NO_DEBUG
+#define debug_level MINIWEB_DEBUG_NONE   // Every debug message is dropped at compile time
+#else
 static int debug_level = MINIWEB_DEBUG_NONE;
-static int port_no = 80;
-static int listen_socket = -1;
+#endif
+static int port_no = 80;              // For the listener used when none are added
+
+// A socket that connections are accepted from
+struct listener {
+   struct listener *next;
+   char *address;                      // As it was added, to name it in stats and metrics
+   struct sockaddr_storage addr;
+   socklen_t addr_len;
+   int fd;
+   time_t retry_time;                  // When to try again to open it, if that failed
+   unsigned accepted;
+   unsigned rejected;                  // Turned away for want of a session, or by admission control
+   unsigned open;                      // Connections from it open now
+};
+static struct listener *first_listener;
+#ifndef MINIWEB_STATIC
 static int max_sessions = 500;      // Allow upto this many concurrent session (must be < 1000)
-static int timeout_secs = 5;        // Close sessions after 5 secs
 static int free_timeout_secs = 15;  // Close sessions after 5 secs
+#endif
+static int timeout_secs = 5;        // Close sessions after 5 secs
+static int keepalive_timeout_secs = 5;    // Idle time allowed between requests, 0 to disable keep-alive
+static int keepalive_max_requests = 1000; // Requests allowed per connection, 0 for no limit
+#ifdef MINIWEB_STATIC
+static int max_body_size = MINIWEB_STATIC_CONTENT;   // Bigger request bodies get a 413
+#else
+static int max_body_size = 1048576;
+#endif
+// Deadlines for each part of a request, by enum phase_e. Each phase must be over within its
+// seconds, plus a second for every min_rate bytes moved (0 seconds for no deadline).
+static int deadline_secs[]     = { 0, 0, 20, 20, 20 };
+static int deadline_min_rate[] = { 0, 0, 0, 500, 500 };
+static int compress_level = 0;      // gzip level for replies, 0 to disable
+// Socket options, applied when the listening socket is opened
+static int sockopt_reuseaddr    = 1;
+static int sockopt_backlog      = 100;
+static int sockopt_defer_accept = 0;   // Seconds to wait for the first data, 0 for off
+static int sockopt_fastopen     = 0;   // Queue length for TCP Fast Open, 0 for off
+static int sockopt_nodelay      = 1;   // Or replies on kept-alive connections wait on delayed ACKs
+static int sockopt_cork         = 0;   // Cork while writing the headers and body
+static int sockopt_sndbuf       = 0;   // 0 to leave at the system default
+static int sockopt_rcvbuf       = 0;
+static size_t compress_threshold = 1024;
+#ifdef MINIWEB_STATIC
+static int h2_max_streams = 0;      // Its frames need bigger buffers than are reserved
+#else
+static int h2_max_streams = 100;    // Concurrent streams per HTTP/2 connection, 0 to disable HTTP/2
+#endif
+static unsigned h2_connections;
+static unsigned h2_streams;
+static unsigned h2_refused;
+static size_t ws_max_message = 65536;   // Largest WebSocket message accepted
+static size_t ws_max_queue   = 262144;  // miniweb_ws_send() refuses to queue more than this per connection
+static unsigned ws_connections;
+static unsigned ws_messages_in;
+static unsigned ws_messages_out;
+static unsigned ws_refused;
+static int sse_max_queue = 64;          // Events queued to a subscriber before it counts as slow
+static int sse_slow_policy = MINIWEB_SSE_COALESCE;
+static unsigned sse_subscribers;
+static unsigned sse_events;
+static unsigned sse_coalesced;
+static unsigned sse_dropped;
 
 // What headers we will take note of
 struct listen_header {
@@ -58,7 +201,26 @@ enum parser_state_e { p_method, p_url,   p_protocol, p_lf,
                       p_end_lf,
                       p_content,
                       p_error};
-enum io_state_e { io_reading, io_writing_headers, io_writing_data, io_writing_shared_data};
+enum io_state_e { io_handshake, io_reading, io_writing_headers, io_writing_data, io_writing_shared_data,
+                  io_streaming };      // Reads at any time, and writes from the output queue
+enum io_want_e  { want_none, want_read, want_write };
+enum phase_e    { phase_stream, phase_idle, phase_header, phase_body, phase_write, PHASES };
+enum trace_phase_e { tp_accept, tp_first_byte, tp_headers, tp_handler_start, tp_handler_end,
+                     tp_first_write, tp_last_write, TRACE_PHASES };
+
+// How a session's bytes get to and from the socket - plain TCP, or a TLS library.
+// These behave like the system calls, returning -1 and setting errno to EWOULDBLOCK
+// when they need to be called again later.
+struct miniweb_session;
+struct transport {
+   ssize_t (*read)(struct miniweb_session *s, void *buf, size_t len);
+   ssize_t (*write)(struct miniweb_session *s, const void *buf, size_t len);
+   ssize_t (*sendfile)(struct miniweb_session *s, int fd, off_t offset, size_t len);
+   int     (*pending)(struct miniweb_session *s);    // Input buffered inside the transport
+   int     (*handshake)(struct miniweb_session *s);  // 1 when done, 0 to come back, -1 on error
+   const char *(*protocol)(struct miniweb_session *s); // The ALPN protocol agreed, if any
+   void    (*close)(struct miniweb_session *s);
+};
 
 
 // The https session state
@@ -68,10 +230,29 @@ struct miniweb_session {
    enum io_state_e     io_state;
 
    int socket;
+   struct sockaddr_storage peer;        // The client's address
+   struct listener *listener;           // What it connected to
+   int admit_slot;                      // Its admit_clients[] entry, or -1
+   const struct transport *transport;
+   void *tls;
+   enum io_want_e io_want;              // What the transport is waiting for, if not the obvious
    int response_code;
+   int requests_served;
+   char keep_alive;                     // Keep the connection open after this reply
+   char corked;
+   char admitted;                       // Counted as in flight, and against the route's cap
+   short refused;                       // Answered with this status without running the handler
    struct url_reg *url;
    struct timespec start_time;
    time_t last_action;
+   char phase;                          // What the deadline check last saw it doing...
+   int phase_request;                   // ...for which request...
+   time_t phase_start;                  // ...and since when
+   unsigned long long accept_ns;        // Only kept while tracing
+   char traced;                         // Timing the phases of this request for the trace
+   int  trace_pid;
+   int  trace_tid;
+   unsigned long long trace_times[TRACE_PHASES];
    struct listen_header *current_header;
 
    // Lists holding the headers
@@ -82,17 +263,39 @@ struct miniweb_session {
    char *in_buffer;
    int  in_buffer_size;
    int  in_buffer_used;
+   int  in_buffer_scanned;             // Bytes at the front already seen by the parser
 
    // For buffering the data before sending
    char   *header_data;
    size_t header_data_size;
+   size_t header_data_alloc;
    char   *data;
    size_t data_size;
    size_t data_used;
+   char   reply_failed;                // Some of the reply couldn't be stored, so it gets a 500
    char   *shared_data; 
    size_t shared_data_size;
+   struct miniweb_blob *shared_blob;   // Holds a reference while shared_data is in use
+   int    shared_fd;                   // Or the shared data comes from this file...
+   off_t  shared_file_offset;          // ...starting here
    char   last_line_term;
    size_t write_pointer;
+   int    compress_state;              // 0 = undecided, 1 = compressing, -1 = not for this reply,
+                                       // -2 = compressed output was lost, so the reply has failed
+   void   *zstream;
+   int    json_depth;                  // Objects and arrays open in the JSON being written...
+   unsigned long long json_items;      // ...a bit for each that has something in it already...
+   char   json_after_key;              // ...and whether a value is owed to a key
+
+   // Frames waiting to be sent, on connections in io_streaming
+   struct out_chunk *outq_head;
+   struct out_chunk *outq_tail;
+   size_t outq_bytes;
+   unsigned outq_chunks;
+   struct h2_conn *h2;                 // HTTP/2 connection state
+   struct ws_conn *ws;                 // WebSocket connection state
+   struct sse_topic *sse_topic;        // Server-Sent Events topic, once subscribed...
+   struct miniweb_session *sse_next;   // ...and the next subscriber to it
 
    // Details of the request
    char *method;
@@ -107,6 +310,35 @@ struct miniweb_session {
 static struct miniweb_session *first_session;
 static int session_count;
 static int sessions_timed_out;
+static unsigned phase_timeouts[PHASES];  // What those sessions were doing
+static const char *phase_names[PHASES] = { "stream", "idle", "header", "body", "write" };
+static unsigned sessions_accepted;
+static unsigned sessions_rejected;     // Turned away with a 503 for want of a session
+static char read_scratch[READ_SCRATCH_SIZE];  // Lent to whichever session is reading
+static unsigned reads_in_place;         // Reads fully parsed from read_scratch
+static unsigned reads_kept;             // Reads that left a partial request to hold on to
+static unsigned requests_unrouted;      // Requests that matched no URL
+static unsigned error_counts[MINIWEB_ERR_COUNT];   // By -MINIWEB_ERR_*
+
+struct resp_code {
+   int number;
+   char *text;
+} resp_codes[] = {
+   {101, " 101 Switching Protocols\r\n"},
+   {200, " 200 OK\r\n"},
+   {206, " 206 Partial Content\r\n"},
+   {400, " 400 Bad Request\r\n"},
+   {401, " 401 Not Authorized\r\n"},
+   {404, " 404 Not Found\r\n"},
+   {413, " 413 Content Too Large\r\n"},
+   {416, " 416 Range Not Satisfiable\r\n"},
+   {426, " 426 Upgrade Required\r\n"},
+   {429, " 429 Too Many Requests\r\n"},
+   {500, " 500 Server Error\r\n"},
+   {501, " 501 Not Implemented\r\n"},
+   {503, " 503 Service Unavailable\r\n"}
+};
+#define RESP_CODES (sizeof(resp_codes)/sizeof(resp_codes[0]))
 
 // URL Registrations
 struct url_reg { 
@@ -118,22 +350,25 @@ struct url_reg {
    size_t pattern_end_len; 
    unsigned data_sent_metric;
    unsigned request_count_metric;
+   unsigned size_history[POOL_CLASSES+1];  // Reply sizes seen, by pool class
+   unsigned size_history_total;
    unsigned request_count;
+   unsigned response_counts[RESP_CODES+1];  // By resp_codes[] index, and then any other code
+   unsigned long long bytes_sent;
    struct timespec request_time;
+   struct lat_hist *latency;           // Allocated on the first request
+   int no_compress;
    void (*callback)(struct miniweb_session *s);
+   char websocket;                     // Upgrade requests to WebSockets, using these callbacks
+   void (*ws_open)(struct miniweb_session *s);
+   void (*ws_message)(struct miniweb_session *s, int type, char *data, size_t len);
+   void (*ws_close)(struct miniweb_session *s);
+   struct sse_topic *sse_topic;        // Requests subscribe to this topic's events
+   unsigned max_active;                // Requests allowed in flight at once (0 = no limit)
+   unsigned active;
 };
 static struct url_reg *first_url_reg;
 
-struct resp_code {
-   int number;
-   char *text;
-} resp_codes[] = {
-   {200, " 200 OK\r\n"},
-   {400, " 400 Bad Request\r\n"},
-   {401, " 401 Not Authorized\\rn"},
-   {404, " 404 Not Found\r\n"},
-   {500, " 500 Server Error\r\n"}
-};
  
 /****************************************************************************************/
 static void debug_fsm(int pos, int c, char *msg) {
@@ -193,7 +428,11 @@ int miniweb_log_callback(void (*callback)(char *url, int response_code, unsigned
 /****************************************************************************************/
 int miniweb_set_debug_level(int level) {
     int t = debug_level;
+#ifdef MINIWEB_NO_DEBUG
+    (void)level;
+#else
     debug_level = level;
+#endif
     return t;
 }
 
@@ -215,12 +454,16 @@ char *miniweb_error_text(int error) {
     case MINIWEB_ERR_HDRTOBIG: return "header too big";
     case MINIWEB_ERR_SELECT:   return "select() too big";
     case MINIWEB_ERR_WRITE:    return "write() too big";
+    case MINIWEB_ERR_TLS:      return "TLS error";
+    case MINIWEB_ERR_PARSE:    return "Badly formed request";
     default:                   return "Unknown error";
   }
 }
 
 /****************************************************************************************/
 static int miniweb_log_error(int error_code) {
+    if(error_code < 0 && -error_code < (int)(sizeof(error_counts)/sizeof(error_counts[0])))
+        error_counts[-error_code]++;
     if(error_callback != NULL) 
        error_callback(error_code, NULL);
 
@@ -231,528 +474,630 @@ static int miniweb_log_error(int error_code) {
 }
 
 /****************************************************************************************/
-static struct listen_header *header_find(char *data, size_t len) {
-    struct listen_header *lh = first_listen_header;
-    while(lh != NULL) {
-       if(lh->len == len) {
-           if(memcmp(data,lh->header,len)==0)
-             return lh;
-       }
-       lh = lh->next;
-    }
-    if(debug_level >= MINIWEB_DEBUG_ALL) {
-        printf("Not listening for '");
-        for(size_t i = 0; i < len; i++) {
-            putchar(data[i]);
-        }
-        putchar('\'');
-        putchar('\n');
-    }
-    return NULL;
-}
+// Memory accounting. All of miniweb's heap use goes through mem_alloc() and mem_free(),
+// which keep the block's size and category in a header in front of it, and take memory
+// from the allocator given to miniweb_set_allocator().
 /****************************************************************************************/
-static void session_update_metrics(struct miniweb_session *session) {
-    struct timespec end_time;
-    struct timespec duration;
-    int time_us;
-    if(session->url == NULL)  // This for 404 pages
-        return;
-    clock_gettime(CLOCK_MONOTONIC, &end_time);
-    if(!lock_url()) {
-        usleep(100);
-        if(!lock_url()) {
-            return;
-        }
-    }
-    // Update total time spent
-    if(end_time.tv_nsec >= session->start_time.tv_nsec) {
-       duration.tv_nsec = end_time.tv_nsec - session->start_time.tv_nsec;
-       duration.tv_sec  = end_time.tv_sec  - session->start_time.tv_sec;
-    } else {
-       duration.tv_nsec = end_time.tv_nsec - session->start_time.tv_nsec+1000000000;
-       duration.tv_sec  = end_time.tv_sec  - session->start_time.tv_sec-1;
-    }
-
-    session->url->request_time.tv_nsec += duration.tv_nsec;
-    session->url->request_time.tv_sec  += duration.tv_sec; 
-    if(session->url->request_time.tv_nsec > 1000000000) {
-        session->url->request_time.tv_nsec -= 1000000000;
-        session->url->request_time.tv_sec  += 1; 
-    }
-
-    time_us = duration.tv_nsec / 1000 + duration.tv_sec * 1000000;
+union mem_header {
+   struct {
+      size_t size;               // Including this header
+      int    category;
+   } h;
+   long double align;            // Keeps the block after it aligned as malloc()'s would be
+};
 
-    if(session->url->request_time.tv_nsec >= 1000000000) {
-       session->url->request_time.tv_nsec -= 1000000000;
-       session->url->request_time.tv_sec  += 1;
-    }  
+#ifdef MINIWEB_STATIC
+// A first-fit allocator over a fixed arena, used in place of the heap. Free blocks are kept
+// in address order so that neighbours can be merged. Block sizes are multiples of the
+// mem_header size, which is never smaller than an arena_free, so the remainder of a split
+// block can always be put back on the free list.
+struct arena_free {
+   size_t size;
+   struct arena_free *next;
+};
+static union {
+   long double align;
+   char bytes[MINIWEB_STATIC_ARENA];
+} arena;
+static struct arena_free *arena_free_list;
+static int arena_ready;
 
-    session->url->request_count++;
-    session->url->request_count_metric++;
-    session->url->data_sent_metric += session->data_used;
-    if(session->url->request_count_metric > 0x40000000 || session->url->data_sent_metric > 0x40000000) {
-        session->url->request_count_metric >>= 1;
-        session->url->data_sent_metric     >>= 1;
-    }
-    unlock_url();
-    if(log_callback != NULL) {
-       log_callback(session->full_url, session->response_code, time_us);
-    }
+static size_t arena_round(size_t size) {
+   size_t unit = sizeof(union mem_header);
+   size = (size+unit-1)/unit*unit;
+   return size < sizeof(struct arena_free) ? sizeof(struct arena_free) : size;
 }
 
-/****************************************************************************************/
-static struct miniweb_session *session_new(int socket) {
-   struct miniweb_session *session;
-   if(socket == -1)
-       return NULL; 
-  
-   // Can we reused an existing session object? 
-   session = first_session;
-   while(session != NULL && session->socket != -1) {
-       session = session->next;
+static void *arena_alloc(size_t size) {
+   struct arena_free **link, *b;
+   if(!arena_ready) {
+      arena_free_list = (struct arena_free *)arena.bytes;
+      arena_free_list->size = sizeof(arena.bytes)/sizeof(union mem_header)*sizeof(union mem_header);
+      arena_free_list->next = NULL;
+      arena_ready = 1;
+   }
+   size = arena_round(size);
+   for(link = &arena_free_list; (b = *link) != NULL; link = &b->next) {
+      if(b->size < size)
+         continue;
+      if(b->size == size) {
+         *link = b->next;
+      } else {
+         struct arena_free *rest = (struct arena_free *)((char *)b+size);
+         rest->size = b->size-size;
+         rest->next = b->next;
+         *link = rest;
+      }
+      return b;
    }
+   return NULL;
+}
 
-   // Do we need a new session object
-   if(session == NULL) {
-       session = malloc(sizeof(struct miniweb_session));
-       if(session == NULL) {
-           miniweb_log_error(MINIWEB_ERR_NOMEM);
-           return NULL;
-       }
-       session->next = first_session;
-       first_session = session;
-       session_count++;
+// The size comes from the header mem_alloc() put at the start of the block
+static void arena_release(void *p) {
+   struct arena_free *b = p, *prev = NULL, **link = &arena_free_list;
+   b->size = arena_round(((union mem_header *)p)->h.size);
+   while(*link != NULL && *link < b) {
+      prev = *link;
+      link = &prev->next;
    }
-   session->io_state     = io_reading;
-   session->parser_state = p_method;
-   session->current_header = NULL;
-   session->socket = socket;
-   session->response_code = 500;
-   session->url = NULL;
-   session->first_request_header = NULL;
-   session->first_reply_header = NULL;
+   b->next = *link;
+   *link = b;
+   if(b->next != NULL && (char *)b+b->size == (char *)b->next) {
+      b->size += b->next->size;
+      b->next = b->next->next;
+   }
+   if(prev != NULL && (char *)prev+prev->size == (char *)b) {
+      prev->size += b->size;
+      prev->next = b->next;
+   }
+}
 
-   session->header_data = NULL;
-   session->header_data_size = 0;
-   session->data = NULL;
-   session->data_size = 0;
-   session->data_used = 0;
-   session->shared_data = NULL;
-   session->shared_data_size = 0;
-   session->write_pointer = 0;
+static void *(*mem_alloc_fn)(size_t size) = arena_alloc;
+static void  (*mem_release_fn)(void *p)   = arena_release;
+#else
+static void *(*mem_alloc_fn)(size_t size) = malloc;
+static void  (*mem_release_fn)(void *p)   = free;
+#endif
+static size_t        mem_bytes[MINIWEB_MEM_CATEGORIES];
+static size_t        mem_peak[MINIWEB_MEM_CATEGORIES];
+static unsigned long mem_allocs[MINIWEB_MEM_CATEGORIES];
+static unsigned long mem_frees[MINIWEB_MEM_CATEGORIES];
+static unsigned long mem_failures[MINIWEB_MEM_CATEGORIES];
+static size_t        mem_total;
+static size_t        mem_total_peak;
 
-   session->in_buffer = NULL;
-   session->in_buffer_size = 0;
-   session->in_buffer_used = 0;
+static void *mem_alloc(size_t size, int category) {
+   union mem_header *m = NULL;
+   size += sizeof(union mem_header);
+   if(size > sizeof(union mem_header))     // Not wrapped around
+      m = mem_alloc_fn(size);
+   if(m == NULL) {
+      mem_failures[category]++;
+      return NULL;
+   }
+   m->h.size     = size;
+   m->h.category = category;
+   mem_allocs[category]++;
+   mem_bytes[category] += size;
+   if(mem_peak[category] < mem_bytes[category])
+      mem_peak[category] = mem_bytes[category];
+   mem_total += size;
+   if(mem_total_peak < mem_total)
+      mem_total_peak = mem_total;
+   return m+1;
+}
 
-   session->last_line_term = 0;
-   session->method = NULL;
-   session->protocol = NULL;
-   session->full_url = NULL;
-   session->wildcard = NULL;
- 
-   session->content_length = -1;
-   session->content = NULL;
+static void mem_free(void *p) {
+   union mem_header *m;
+   if(p == NULL)
+      return;
+   m = (union mem_header *)p - 1;
+   mem_frees[m->h.category]++;
+   mem_bytes[m->h.category] -= m->h.size;
+   mem_total -= m->h.size;
+   mem_release_fn(m);
+}
 
-   return session;
+static void *mem_calloc(size_t size, int category) {
+   void *p = mem_alloc(size, category);
+   if(p != NULL)
+      memset(p, 0, size);
+   return p;
 }
 
+// Like realloc(). On failure the old block is left alone.
+static void *mem_realloc(void *p, size_t size, int category) {
+   size_t old_size;
+   void *n;
+   if(p == NULL)
+      return mem_alloc(size, category);
+   old_size = ((union mem_header *)p - 1)->h.size - sizeof(union mem_header);
+   n = mem_alloc(size, category);
+   if(n == NULL)
+      return NULL;
+   memcpy(n, p, old_size < size ? old_size : size);
+   mem_free(p);
+   return n;
+}
 
-/****************************************************************************************/
-char *miniweb_get_wildcard(struct miniweb_session *session) {
-   if(!session)
-       return NULL;
-   return session->wildcard;
+static char *mem_strdup(const char *s, int category) {
+   size_t len = strlen(s)+1;
+   char *p = mem_alloc(len, category);
+   if(p != NULL)
+      memcpy(p, s, len);
+   return p;
 }
+
 /****************************************************************************************/
-static int session_request_header_add(struct miniweb_session *session,char *header, char *value) {
-    struct request_header *rh;
+int miniweb_set_allocator(void *(*alloc)(size_t size), void (*release)(void *p)) {
+#ifdef MINIWEB_STATIC
+   (void)alloc;
+   (void)release;
+   return 0;    // Everything comes from the static arena
+#else
+   // Blocks already handed out must go back to the allocator they came from
+   if(mem_total != 0 || (alloc == NULL) != (release == NULL))
+      return 0;
+   mem_alloc_fn   = alloc   ? alloc   : malloc;
+   mem_release_fn = release ? release : free;
+   return 1;
+#endif
+}
 
-    if(debug_level >= MINIWEB_DEBUG_DATA) {
-       fprintf(stderr, "Adding header %s: %s\n", header, value);
-    }
-    rh = malloc(sizeof(struct request_header));
-    if(rh == NULL) 
-        return 0;
+/****************************************************************************************/
+int miniweb_memory_stats(struct miniweb_memory_stats *stats) {
+   if(stats == NULL)
+      return 0;
+   for(int c = 0; c < MINIWEB_MEM_CATEGORIES; c++) {
+      stats->bytes[c]    = mem_bytes[c];
+      stats->peak[c]     = mem_peak[c];
+      stats->allocs[c]   = mem_allocs[c];
+      stats->frees[c]    = mem_frees[c];
+      stats->failures[c] = mem_failures[c];
+   }
+   stats->total_bytes = mem_total;
+   stats->total_peak  = mem_total_peak;
+   return 1;
+}
 
-    rh->header = malloc(strlen(header)+1);
-    if(rh->header == NULL) {
-        free(rh);
-        return 0;
-    }
+/****************************************************************************************/
+// Buffer pool - power-of-two size classes, shared by the input, header and reply buffers.
+// Freed buffers are kept on a per-class free list (linked through their first bytes)
+// rather than returned to the heap. Buffers larger than the biggest class are not pooled.
+/****************************************************************************************/
+static void *pool_free_list[POOL_CLASSES];
+static size_t pool_limit;              // Ceiling on in-use plus cached bytes (0 = no limit)
+static size_t pool_bytes_in_use;
+static size_t pool_bytes_cached;
+static size_t pool_bytes_peak;
+static unsigned pool_hits;
+static unsigned pool_misses;
+static unsigned pool_resizes;
+static unsigned pool_failures;
 
-    rh->value = malloc(strlen(value)+1);
-    if(rh->value == NULL) {
-        free(rh->header);
-        free(rh);
-        return 0;
-    }
+static int pool_class(size_t size) {
+   int c = 0;
+   while(c < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT+c)) < size)
+      c++;
+   return c;   // POOL_CLASSES means "too big to pool"
+}
 
-    strcpy(rh->header, header);
-    strcpy(rh->value,  value);
+#ifdef MINIWEB_STATIC
+// Only the sizes reserved by static_init() can be had
+static const size_t static_buffer_sizes[] = {STATIC_HEADER_BUFFER, MINIWEB_STATIC_IN_BUFFER, MINIWEB_STATIC_REPLY};
+static const int    static_buffer_counts[] = {3, 2, 1};   // For each session
 
-    rh->next = session->first_request_header;
-    session->first_request_header = rh;
+static size_t pool_round(size_t size) {
+   size_t best = 0;
+   for(int i = 0; i < (int)(sizeof(static_buffer_sizes)/sizeof(static_buffer_sizes[0])); i++) {
+      if(static_buffer_sizes[i] >= size && (best == 0 || static_buffer_sizes[i] < best))
+         best = static_buffer_sizes[i];
+   }
+   return best ? best : size;
+}
+#else
+static size_t pool_round(size_t size) {
+   int c = pool_class(size);
+   if(c == POOL_CLASSES)
+      return size;
+   return (size_t)1 << (POOL_MIN_SHIFT+c);
+}
+#endif
 
-    return 1;
+static void pool_trim(void) {
+#ifdef MINIWEB_STATIC
+   return;      // The reserved buffers are kept for good
+#endif
+   for(int c = 0; c < POOL_CLASSES; c++) {
+      while(pool_free_list[c] != NULL) {
+         void *p = pool_free_list[c];
+         pool_free_list[c] = *(void **)p;
+         mem_free(p);
+      }
+   }
+   pool_bytes_cached = 0;
 }
 
-/****************************************************************************************/
-static int check_url_match(struct miniweb_session *session, struct url_reg *ur) {
-    // Find the ? that starts the get vars
-    size_t url_end, len = strlen(session->full_url);
-    for(url_end = 0; url_end < len; url_end++) {
-        if(session->full_url[url_end] == '?')
-            break;
-    }
+// Returns a buffer of at least pool_round(size) bytes
+static void *pool_alloc(size_t size) {
+   void *p;
+   int c;
+   size = pool_round(size);
+   c = pool_class(size);
 
-    // If there is no wildcard then check the full URL (excluding vars!)
-    if(ur->pattern_end == NULL) {
-        if(len != ur->pattern_start_len)
-            return 0;
-        if(memcmp(session->full_url, ur->pattern_start, ur->pattern_start_len) != 0)
-            return 0;
-        return 1;
-    }
+   if(c < POOL_CLASSES && pool_free_list[c] != NULL) {
+      p = pool_free_list[c];
+      pool_free_list[c] = *(void **)p;
+      pool_bytes_cached -= size;
+      pool_hits++;
+   } else {
+#ifdef MINIWEB_STATIC
+      // All that can be had were reserved at the start
+      pool_failures++;
+      return NULL;
+#endif
+      if(pool_limit && pool_bytes_in_use+pool_bytes_cached+size > pool_limit) {
+         // Give cached buffers of other sizes back to the heap and try again
+         pool_trim();
+         if(pool_bytes_in_use+size > pool_limit) {
+            pool_failures++;
+            return NULL;
+         }
+      }
+      p = mem_alloc(size, MINIWEB_MEM_BUFFER);
+      if(p == NULL) {
+         pool_failures++;
+         return NULL;
+      }
+      pool_misses++;
+   }
+   pool_bytes_in_use += size;
+   if(pool_bytes_peak < pool_bytes_in_use+pool_bytes_cached)
+      pool_bytes_peak = pool_bytes_in_use+pool_bytes_cached;
+   return p;
+}
 
-    // Not long enough to have the start and end patterns, and some wildcard chars?
-    if(url_end < ur->pattern_start_len+1+ur->pattern_end_len)
-        return 0;
+// 'size' must be the size that was asked for (or anything with the same pool_round())
+static void pool_free(void *p, size_t size) {
+   int c;
+   if(p == NULL)
+      return;
+   size = pool_round(size);
+   c = pool_class(size);
+   pool_bytes_in_use -= size;
+   if(c == POOL_CLASSES) {
+      mem_free(p);
+      return;
+   }
+   *(void **)p = pool_free_list[c];
+   pool_free_list[c] = p;
+   pool_bytes_cached += size;
+}
 
-    if(memcmp(session->full_url, ur->pattern_start,  ur->pattern_start_len) != 0)
-        return 0;
+// Move 'used' bytes into a buffer of the larger class, releasing the old one
+static void *pool_grow(void *p, size_t used, size_t old_size, size_t new_size) {
+   void *n = pool_alloc(new_size);
+   if(n == NULL)
+      return NULL;
+   if(used > 0)
+      memcpy(n, p, used);
+   pool_free(p, old_size);
+   pool_resizes++;
+   return n;
+}
 
-    if(memcmp(session->full_url+len-ur->pattern_end_len, ur->pattern_end,  ur->pattern_end_len) != 0)
-        return 0;
+#ifdef MINIWEB_STATIC
+/****************************************************************************************/
+// Allocate every session, and put all of their buffers in the pool, so nothing needs to be
+// allocated later
+static struct miniweb_session *static_sessions[MINIWEB_STATIC_SESSIONS];
 
-    int wildcard_len = len - ur->pattern_start_len - ur->pattern_end_len;
-    session->wildcard = malloc(wildcard_len+1);
-    if(session->wildcard == NULL)
-        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+static int static_init(void) {
+   static int done;      // 1 once done, -1 if the arena was too small
+   if(done)
+      return done > 0;
+   done = -1;
+   for(int i = 0; i < MINIWEB_STATIC_SESSIONS; i++) {
+      static_sessions[i] = mem_alloc(sizeof(struct miniweb_session), MINIWEB_MEM_SESSION);
+      if(static_sessions[i] == NULL)
+         return miniweb_log_error(MINIWEB_ERR_NOMEM);   // MINIWEB_STATIC_ARENA is too small
+      static_sessions[i]->socket = -1;
+   }
 
-    memcpy(session->wildcard, session->full_url+ur->pattern_start_len,  wildcard_len);
-    session->wildcard[wildcard_len] = '\0';
+   for(int i = 0; i < (int)(sizeof(static_buffer_sizes)/sizeof(static_buffer_sizes[0])); i++) {
+      size_t size = static_buffer_sizes[i];
+      int c = pool_class(size);
+      for(int n = 0; n < static_buffer_counts[i]*MINIWEB_STATIC_SESSIONS; n++) {
+         void *p = mem_alloc(size, MINIWEB_MEM_BUFFER);
+         if(p == NULL)
+            return miniweb_log_error(MINIWEB_ERR_NOMEM);
+         *(void **)p = pool_free_list[c];
+         pool_free_list[c] = p;
+         pool_bytes_cached += size;
+      }
+   }
+   pool_bytes_peak = pool_bytes_cached;
+   done = 1;
+   return 1;
+}
+#endif
 
-    return 1;
+/****************************************************************************************/
+int miniweb_set_pool_limit(size_t bytes) {
+#ifdef MINIWEB_STATIC
+   (void)bytes;
+   return 0;    // The pool is fixed
+#endif
+   pool_limit = bytes;
+   if(pool_limit && pool_bytes_in_use+pool_bytes_cached > pool_limit)
+      pool_trim();
+   return 1;
 }
+
 /****************************************************************************************/
-static int session_find_target_url(struct miniweb_session *session) {
-    struct url_reg *ur = first_url_reg;
-    if(debug_level == MINIWEB_DEBUG_ALL)
-        printf("Looking for %s %s %s\n", session->method, session->full_url, session->protocol);
-    while(ur) {
-        if(strcmp(session->protocol, "HTTP/1.1") == 0 || strcmp(session->protocol, "HTTP/1.0") == 0) {
-            if(strcmp(session->method,   ur->method) == 0) {
-                if(check_url_match(session,ur))
-                    break;
-            }
-        }
-        ur = ur->next;
-    }
-    if(debug_level == MINIWEB_DEBUG_ALL) {
-        if(ur == NULL) {
-            printf("Not found\n");
-        } else {
-            printf("Found\n");
-        }
-    }
-    session->url = ur;
-    return ur ? 1 : 0;
+int miniweb_pool_stats(struct miniweb_pool_stats *stats) {
+   if(stats == NULL)
+      return 0;
+   stats->hits         = pool_hits;
+   stats->misses       = pool_misses;
+   stats->resizes      = pool_resizes;
+   stats->failures     = pool_failures;
+   stats->bytes_in_use = pool_bytes_in_use;
+   stats->bytes_cached = pool_bytes_cached;
+   stats->bytes_peak   = pool_bytes_peak;
+   stats->limit        = pool_limit;
+   return 1;
 }
 
 /****************************************************************************************/
-static void session_empty(struct miniweb_session *session) {
-    // Clean up any POST content
-    session->content_length = -1;
-    if(session->content) {
-       free(session->content);
-       session->content = NULL;
-    }
-
-    // Clean up method, full_url and protocol
-    session->parser_state = p_method;
-    if(session->method) {
-       free(session->method);
-       session->method = NULL;
-    }
-    if(session->full_url) {
-       free(session->full_url);
-       session->full_url = NULL;
-    }
-    if(session->protocol) {
-       free(session->protocol);
-       session->protocol = NULL;
-    }
-    if(session->wildcard) {
-       free(session->wildcard);
-       session->wildcard = NULL;
-    }
-   
-    if(session->header_data != NULL) {
-        free(session->header_data);
-        session->header_data = NULL;
-    }
-    session->header_data_size = 0;
-    // Stop using shared data
-    session->shared_data = NULL;
-    session->shared_data_size = 0;
-
-    // Clean up reply data
-    if(session->data) {
-       free(session->data);
-       session->data = NULL;
-    }
+static void url_size_history_add(struct url_reg *ur, size_t size) {
+   ur->size_history[pool_class(size)]++;
+   ur->size_history_total++;
+   if(ur->size_history_total > 0x10000) {
+      ur->size_history_total = 0;
+      for(int c = 0; c <= POOL_CLASSES; c++) {
+         ur->size_history[c] >>= 1;
+         ur->size_history_total += ur->size_history[c];
+      }
+   }
+}
 
-    // Clean up header_data
-    if(session->in_buffer) {
-       free(session->in_buffer);
-       session->in_buffer = NULL; 
-    }
+// The smallest class that has held at least 15/16ths of this URL's recent replies
+static size_t url_size_predict(struct url_reg *ur) {
+   unsigned seen = 0;
+   if(ur == NULL || ur->size_history_total == 0)
+      return 0;
+   for(int c = 0; c < POOL_CLASSES; c++) {
+      seen += ur->size_history[c];
+      if(seen >= ur->size_history_total - ur->size_history_total/16)
+         return (size_t)1 << (POOL_MIN_SHIFT+c);
+   }
+   // Mostly huge replies - fall back to the average
+   return ur->data_sent_metric/ur->request_count_metric+64;
+}
 
-    // Clean up reply header
-    while(session->first_reply_header) {
-       struct reply_header *rh = session->first_reply_header;
-       session->first_reply_header = rh->next;
-       if(rh->header)
-         free(rh->header);
-       if(rh->value)
-         free(rh->value);
-       free(rh);  
-    }
+/****************************************************************************************/
+// Reference counted, immutable blobs for shared data. A session holds a reference until
+// the last byte is written, so the owner can drop or replace its copy at any time.
+/****************************************************************************************/
+struct miniweb_blob {
+   int    refs;
+   size_t size;
+   char   *data;
+   void   (*release)(void *data);
+};
+static char blob_slot_lock;
 
-    // Clean up request header
-    while(session->first_request_header) {
-       struct request_header *rh = session->first_request_header;
-       session->first_request_header = rh->next;
-       if(rh->header)
-         free(rh->header);
-       if(rh->value)
-         free(rh->value);
-       free(rh);  
-    }
+/****************************************************************************************/
+struct miniweb_blob *miniweb_blob_new(size_t len) {
+   // The data lives directly after the blob structure
+   struct miniweb_blob *blob = mem_alloc(sizeof(struct miniweb_blob)+len, MINIWEB_MEM_OTHER);
+   if(blob == NULL) {
+      miniweb_log_error(MINIWEB_ERR_NOMEM);
+      return NULL;
+   }
+   blob->refs    = 1;
+   blob->size    = len;
+   blob->data    = (char *)(blob+1);
+   blob->release = NULL;
+   return blob;
 }
 
 /****************************************************************************************/
-static void session_end(struct miniweb_session *session) {
-    if(session->socket != -1) {
-        while(close(session->socket) < 0 && errno == EINTR) {
-            miniweb_log_error(MINIWEB_ERR_CLOSE);
-        }
-        if(debug_level >= MINIWEB_DEBUG_ALL) 
-            fprintf(stderr,"SOCKET CLOSE\n");
-        session->socket = -1;
-    }
-    session_empty(session);
+struct miniweb_blob *miniweb_blob_wrap(void *data, size_t len, void (*release)(void *data)) {
+   struct miniweb_blob *blob = mem_alloc(sizeof(struct miniweb_blob), MINIWEB_MEM_OTHER);
+   if(blob == NULL) {
+      miniweb_log_error(MINIWEB_ERR_NOMEM);
+      return NULL;
+   }
+   blob->refs    = 1;
+   blob->size    = len;
+   blob->data    = data;
+   blob->release = release;
+   return blob;
 }
 
 /****************************************************************************************/
-static void build_header_data(struct miniweb_session *s) {
-    struct reply_header *rh;
-    int rc_index;
-    char rc_str[100];
-    size_t header_len;
-    //TODO: This is really bad code - esp the malloc.
-
-    // Send HTTP response code
- 
-    for(rc_index = sizeof(resp_codes)/sizeof(struct resp_code)-1; rc_index > 0;  rc_index--) {
-        if(resp_codes[rc_index].number == s->response_code) {
-           break;
-        }
-    }
-    header_len = strlen(s->protocol);
-    if(rc_index < 0) {
-       sprintf(rc_str, " %i Unknown\r\n", s->response_code); 
-       header_len += strlen(rc_str);
-    } else {
-       header_len += strlen(resp_codes[rc_index].text);
-    }
-
-    rh = s->first_reply_header;
-    while(rh != NULL) {
-        header_len += strlen(rh->header);
-        header_len += 2;
-        header_len += strlen(rh->value);
-        header_len += 2;
-        rh = rh->next;
-    }
-    header_len += 2;
-    header_len += 1; // For the termating null
-
-    // Allocate the space
-    s->header_data = malloc(header_len);
-    if(s->header_data == NULL) {
-        miniweb_log_error(MINIWEB_ERR_NOMEM);
-        session_end(s);
-        return;
-    }
-    s->header_data[0] = '\0';
-
-    // Now assemble the headers
-    strcpy(s->header_data, s->protocol);
-    if(rc_index < 0) {
-       strcat(s->header_data, rc_str);
-    } else {
-       strcat(s->header_data, resp_codes[rc_index].text);
-    }
-
-    rh = s->first_reply_header;
-    while(rh != NULL) {
-        strcat(s->header_data, rh->header);
-        strcat(s->header_data, ": ");
-        strcat(s->header_data, rh->value);
-        strcat(s->header_data, "\r\n");
-        rh = rh->next;
-    }
-    strcat(s->header_data, "\r\n");
-    s->header_data_size = strlen(s->header_data);
-    s->write_pointer = 0;
+void *miniweb_blob_data(struct miniweb_blob *blob) {
+   return blob ? blob->data : NULL;
 }
 
 /****************************************************************************************/
-static void session_send_reply(struct miniweb_session *session) {
-    // Set the default headers (can be overwritten)
-    miniweb_add_header(session, "Server","Miniweb/0.0.1 (Linux)");
-    miniweb_add_header(session, "Content-Type","text/html");
-    if(strcmp(session->protocol,"HTTP/1.1")==0)
-       miniweb_add_header(session, "Keep-Alive", "timeout=10, max=1000");
-
-    // Now process the request
-    if(session->url) {
-        session->response_code = 500;      // Default response code
-
-        // TODO Add date header 
-        // Date: Mon, 27 Jul 2009 12:28:53 GMT
-
-        // Do the user portion of the request
-        if(session->url->callback) {
-            session->url->callback(session);
-        }
-    } else {
-        session->response_code = 404;
-        miniweb_write(session,"Page not found\n",14);
-    }
-
-    // Add the content length header - overwrite any already queued to send
-    char buffer[11];
-    sprintf(buffer,"%zi",session->data_used + session->shared_data_size);
-    miniweb_add_header(session, "Content-Length",buffer);
+size_t miniweb_blob_size(struct miniweb_blob *blob) {
+   return blob ? blob->size : 0;
+}
 
-    build_header_data(session);
-    session->io_state = io_writing_headers;
+/****************************************************************************************/
+struct miniweb_blob *miniweb_blob_ref(struct miniweb_blob *blob) {
+   if(blob != NULL)
+      __atomic_add_fetch(&blob->refs, 1, __ATOMIC_RELAXED);
+   return blob;
 }
 
 /****************************************************************************************/
-int miniweb_register_page(char *method, char *url, void (*callback)(struct miniweb_session *)) {
-   struct url_reg *new_url;
-   int url_len = strlen(url);
+void miniweb_blob_unref(struct miniweb_blob *blob) {
+   if(blob == NULL)
+      return;
+   if(__atomic_sub_fetch(&blob->refs, 1, __ATOMIC_ACQ_REL) != 0)
+      return;
+   if(blob->release != NULL)
+      blob->release(blob->data);
+   mem_free(blob);
+}
 
-   // We need the Content-Length header to process POST commands
-   if(strcmp(method,"POST")==0) {
-      if(!miniweb_listen_header("Content-Length")) {
-         return 0;
-      }
+/****************************************************************************************/
+// Swap 'blob' into the slot, taking over the caller's reference, and drop the old
+// version. Sessions still sending the old version keep it alive until they finish.
+void miniweb_blob_publish(struct miniweb_blob **slot, struct miniweb_blob *blob) {
+   struct miniweb_blob *old;
+   while(__atomic_test_and_set(&blob_slot_lock, __ATOMIC_ACQUIRE)) {
    }
+   old = *slot;
+   *slot = blob;
+   __atomic_clear(&blob_slot_lock, __ATOMIC_RELEASE);
+   miniweb_blob_unref(old);
+}
 
-   // Allocate new
-   new_url = malloc(sizeof(struct url_reg));
-   if(new_url == NULL) {
-      return miniweb_log_error(MINIWEB_ERR_NOMEM);
+/****************************************************************************************/
+// Returns a new reference to the current version in the slot (or NULL)
+struct miniweb_blob *miniweb_blob_acquire(struct miniweb_blob **slot) {
+   struct miniweb_blob *blob;
+   while(__atomic_test_and_set(&blob_slot_lock, __ATOMIC_ACQUIRE)) {
    }
+   blob = miniweb_blob_ref(*slot);
+   __atomic_clear(&blob_slot_lock, __ATOMIC_RELEASE);
+   return blob;
+}
 
-   // Populate fields   
-   new_url->next = NULL;
-   new_url->method = malloc(strlen(method)+1);
-   if(new_url->method == NULL) {
-      free(new_url);
-      return miniweb_log_error(MINIWEB_ERR_NOMEM);
-   }
-   strcpy(new_url->method, method);
+/****************************************************************************************/
+// Output queue. Replies sent as a series of frames are queued on the connection as chunks.
+// A chunk either holds a copy of its data, or a reference on a blob, so the same data can be
+// queued to many connections without being copied.
+/****************************************************************************************/
+struct out_chunk {
+   struct out_chunk *next;
+   struct miniweb_blob *blob;          // Reference on the data, or NULL if it follows the chunk
+   char   *data;
+   size_t len;
+};
 
-   int start;
-   for(start = 0; start < url_len; start++) {
-     if(url[start] == '*')
-        break;
-   }
+static struct out_chunk *outq_chunk(size_t len) {
+    struct out_chunk *chunk = mem_alloc(sizeof(struct out_chunk)+len, MINIWEB_MEM_STREAM);
+    if(chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->blob = NULL;
+    chunk->data = (char *)(chunk+1);
+    chunk->len  = len;
+    return chunk;
+}
 
-   new_url->pattern_start = malloc(start+1);
-   if(new_url->pattern_start == NULL) {
-      free(new_url->method);
-      free(new_url);
-      return miniweb_log_error(MINIWEB_ERR_NOMEM);
-   }
-   if(start > 0) 
-     memcpy(new_url->pattern_start, url, start);
-   new_url->pattern_start[start] = '\0';
-   new_url->pattern_start_len = strlen(new_url->pattern_start);
+/****************************************************************************************/
+static void outq_add(struct miniweb_session *s, struct out_chunk *chunk) {
+    if(s->outq_tail == NULL)
+        s->outq_head = chunk;
+    else
+        s->outq_tail->next = chunk;
+    s->outq_tail = chunk;
+    s->outq_bytes += chunk->len;
+    s->outq_chunks++;
+}
 
-   if(start == url_len) {
-      new_url->pattern_end = NULL;
-      new_url->pattern_end_len = 0;
-   } else {
-      start++; // Skip the '*' before having the end pattern
-      new_url->pattern_end = malloc(url_len-start+1);
-      if(new_url->pattern_end==NULL)
-         return miniweb_log_error(MINIWEB_ERR_NOMEM);
+/****************************************************************************************/
+// A chunk that sends part of a blob, holding a reference on it until it has gone
+static struct out_chunk *outq_blob_chunk(struct miniweb_blob *blob, char *data, size_t len) {
+    struct out_chunk *chunk = mem_alloc(sizeof(struct out_chunk), MINIWEB_MEM_STREAM);
+    if(chunk == NULL)
+        return NULL;
+    chunk->next = NULL;
+    chunk->blob = miniweb_blob_ref(blob);
+    chunk->data = data;
+    chunk->len  = len;
+    return chunk;
+}
 
-      if(url_len-start > 0) 
-         memcpy(new_url->pattern_end, url+start, url_len-start);
-      new_url->pattern_end[url_len-start] = '\0';
-      new_url->pattern_end_len = strlen(new_url->pattern_end);
-   }
-   
-   new_url->data_sent_metric = 0;
-   new_url->request_count_metric = 0;
-   new_url->request_count = 0;
-   new_url->callback = callback;
-   new_url->request_time.tv_nsec = 0;
-   new_url->request_time.tv_sec = 0;
+/****************************************************************************************/
+static int outq_add_blob(struct miniweb_session *s, struct miniweb_blob *blob, char *data, size_t len) {
+    struct out_chunk *chunk = outq_blob_chunk(blob, data, len);
+    if(chunk == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    outq_add(s, chunk);
+    return 1;
+}
 
-   // TODO Add in correct order for filtering
-   new_url->next = first_url_reg;
-   first_url_reg = new_url;
-   return 1;
+/****************************************************************************************/
+static void outq_pop(struct miniweb_session *s) {
+    struct out_chunk *chunk = s->outq_head;
+    s->outq_head = chunk->next;
+    if(s->outq_head == NULL)
+        s->outq_tail = NULL;
+    s->outq_bytes -= chunk->len;
+    s->outq_chunks--;
+    if(chunk->blob)
+        miniweb_blob_unref(chunk->blob);
+    mem_free(chunk);
 }
+
 /****************************************************************************************/
-size_t miniweb_shared_data_buffer(struct miniweb_session *session, void *data, size_t len) {
-    // Overwrite any existing shared data with this one
-    session->shared_data      = data;
-    session->shared_data_size = len;
-    return len;
+static void outq_free(struct miniweb_session *s) {
+    while(s->outq_head != NULL)
+        outq_pop(s);
 }
 
 /****************************************************************************************/
-size_t miniweb_write(struct miniweb_session *session, void *data, size_t len) {
-    if(len == 0)
-       return 0;
+// Drop the chunks that haven't started to be sent, returning how many went
+static unsigned outq_drop_unsent(struct miniweb_session *s) {
+    struct out_chunk *keep = s->outq_head, *chunk;
+    unsigned dropped = s->outq_chunks;
+    if(keep == NULL || s->write_pointer == 0) {
+        outq_free(s);
+        return dropped;
+    }
+    // The head is partly sent, so it has to be finished
+    while((chunk = keep->next) != NULL) {
+        keep->next = chunk->next;
+        s->outq_bytes -= chunk->len;
+        s->outq_chunks--;
+        if(chunk->blob)
+            miniweb_blob_unref(chunk->blob);
+        mem_free(chunk);
+    }
+    s->outq_tail = keep;
+    return dropped-1;
+}
 
+/****************************************************************************************/
+// Make sure there is space for at least 'len' more bytes in the reply buffer
+static int session_data_reserve(struct miniweb_session *session, size_t len) {
     if(session->data == NULL) {
-        // Create new data buffer if one isn't there
-        size_t buff_size = 0;
-        if(session->url) {
-            if(session->url->request_count_metric > 0) {
-                buff_size = session->url->data_sent_metric/session->url->request_count_metric+64;
-            }
-        }
+        // Create new data buffer if one isn't there, sized from what this URL usually sends
+        size_t buff_size = url_size_predict(session->url);
         if(buff_size < 256) buff_size = 256;
         if(buff_size < len) buff_size = len;
+        buff_size = pool_round(buff_size);
 
         if(debug_level >= MINIWEB_DEBUG_ALL) {
             fprintf(stderr,"Allocating %zi for data\n",buff_size);
         }
-        session->data = malloc(buff_size);
+        session->data = pool_alloc(buff_size);
         if(session->data == NULL) {
+            session->reply_failed = 1;
             return miniweb_log_error(MINIWEB_ERR_NOMEM);
         }
         session->data_size = buff_size;
         session->data_used = 0;
     } else {
         if(session->data_used+len > session->data_size) {
-            // Resize if needed
-            size_t new_size = session->data_used+len+64;
+            // Resize if needed - at least double, so the next class up
+            size_t new_size = session->data_size*2;
             char *new_data;
-            new_data = realloc(session->data, new_size);
+            if(new_size < session->data_used+len)
+                new_size = session->data_used+len;
+            new_size = pool_round(new_size);
+            new_data = pool_grow(session->data, session->data_used, session->data_size, new_size);
             if(new_data == NULL) {
+                session->reply_failed = 1;
                 return miniweb_log_error(MINIWEB_ERR_NOMEM);
             }
             session->data = new_data;
@@ -762,311 +1107,5207 @@ size_t miniweb_write(struct miniweb_session *session, void *data, size_t len) {
             session->data_size = new_size;
         }
     }
-    memcpy(session->data+session->data_used, data, len);
-    session->data_used += len;
-    return len;
+    return 1;
 }
 
 /****************************************************************************************/
-int miniweb_add_header(struct miniweb_session *session, char *header, char *value) {
-    struct reply_header *rh;
-    rh = session->first_reply_header;
-    while(rh != NULL) {
-        if(strcmp(rh->header, header) == 0) {
-            // No change needed?
-            if(strcmp(rh->value,value)==0) 
-                return 1;
- 
-            // Replace value
-            char *v = malloc(strlen(value)+1);
-            if(v == NULL) 
-                return miniweb_log_error(MINIWEB_ERR_NOMEM);
-            free(rh->value);
+// On-the-fly gzip of replies. Once a reply built with miniweb_write() passes the threshold
+// (and the client accepts gzip) everything written so far, and everything after, is run
+// through a deflate stream taken from a small pool of idle streams.
+/****************************************************************************************/
+#ifdef MINIWEB_ZLIB
+static z_stream *compress_pool[COMPRESS_POOL_MAX];
+static int compress_pool_used;
+
+// So deflate's state is counted, and comes from the same heap as everything else
+static voidpf compress_zalloc(voidpf opaque, uInt items, uInt size) {
+    (void)opaque;
+    if(size != 0 && items > (size_t)-1/size)
+        return Z_NULL;
+    return mem_alloc((size_t)items*size, MINIWEB_MEM_COMPRESS);
+}
+
+static void compress_zfree(voidpf opaque, voidpf p) {
+    (void)opaque;
+    mem_free(p);
+}
+#endif
+
+static int client_accepts_gzip(struct miniweb_session *session) {
+    char *ae = miniweb_get_header(session, "Accept-Encoding");
+    char *p;
+    if(ae == NULL)
+        return 0;
+    p = strstr(ae, "gzip");
+    if(p == NULL)
+        return 0;
+    // Skip past the token to see if it has been refused with a zero quality
+    p += 4;
+    while(*p == ' ') p++;
+    if(*p == ';') {
+        p++;
+        while(*p == ' ') p++;
+        if(p[0] == 'q' && p[1] == '=' && atof(p+2) == 0.0)
+            return 0;
+    }
+    return 1;
+}
+
+#ifdef MINIWEB_ZLIB
+/****************************************************************************************/
+static size_t compress_write(struct miniweb_session *session, void *data, size_t len) {
+    z_stream *z = session->zstream;
+    if(session->compress_state != 1)
+        return 0;
+    z->next_in  = data;
+    z->avail_in = len;
+    while(z->avail_in > 0) {
+        if(session->data_used == session->data_size && !session_data_reserve(session, 1)) {
+            // The stream can't be continued without this input, so the reply is spoilt
+            z->avail_in = 0;
+            session->compress_state = -2;
+            return 0;
+        }
+        z->next_out  = (Bytef *)session->data+session->data_used;
+        z->avail_out = session->data_size-session->data_used;
+        deflate(z, Z_NO_FLUSH);
+        session->data_used = session->data_size-z->avail_out;
+    }
+    return len;
+}
+
+/****************************************************************************************/
+static void compress_start(struct miniweb_session *session) {
+    z_stream *z;
+    char *raw;
+    size_t raw_used, raw_size;
+
+    session->compress_state = -1;
+    if(session->url == NULL || session->url->no_compress)
+        return;
+    if(session->shared_data != NULL || session->shared_fd != -1)
+        return;
+    // From here whether it is compressed depends on the request, so caches must know that
+    miniweb_add_header(session, "Vary", "Accept-Encoding");
+    if(!client_accepts_gzip(session) || miniweb_get_header(session, "Range") != NULL)
+        return;
+
+    // Get a stream from the pool, or create one
+    if(compress_pool_used > 0) {
+        z = compress_pool[--compress_pool_used];
+        deflateReset(z);
+        deflateParams(z, compress_level, Z_DEFAULT_STRATEGY);
+    } else {
+        z = mem_alloc(sizeof(z_stream), MINIWEB_MEM_COMPRESS);
+        if(z == NULL) {
+            miniweb_log_error(MINIWEB_ERR_NOMEM);
+            return;
+        }
+        z->zalloc = compress_zalloc;
+        z->zfree  = compress_zfree;
+        z->opaque = Z_NULL;
+        // Adding 16 to the window bits asks for a gzip wrapper
+        if(deflateInit2(z, compress_level, Z_DEFLATED, MINIWEB_ZLIB_WINDOW_BITS+16,
+                        MINIWEB_ZLIB_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+            mem_free(z);
+            miniweb_log_error(MINIWEB_ERR_NOMEM);
+            return;
+        }
+    }
+    session->zstream = z;
+    session->compress_state = 1;
+
+    // Anything already written needs compressing into a fresh buffer
+    raw      = session->data;
+    raw_used = session->data_used;
+    raw_size = session->data_size;
+    session->data      = NULL;
+    session->data_size = 0;
+    session->data_used = 0;
+    if(raw != NULL) {
+        compress_write(session, raw, raw_used);
+        pool_free(raw, raw_size);
+    }
+}
+
+/****************************************************************************************/
+static void compress_release(struct miniweb_session *session) {
+    z_stream *z = session->zstream;
+    session->compress_state = 0;
+    if(z == NULL)
+        return;
+    session->zstream = NULL;
+    if(compress_pool_used < COMPRESS_POOL_MAX) {
+        compress_pool[compress_pool_used++] = z;
+    } else {
+        deflateEnd(z);
+        mem_free(z);
+    }
+}
+
+/****************************************************************************************/
+static void compress_finish(struct miniweb_session *session) {
+    z_stream *z = session->zstream;
+    int rtn = Z_OK;
+    if(session->compress_state != 1 && session->compress_state != -2)
+        return;
+
+    // Shared data can't go out as-is after a compressed body, so it goes through the stream too
+    if(session->shared_data != NULL) {
+        compress_write(session, session->shared_data, session->shared_data_size);
+        miniweb_shared_data_buffer(session, NULL, 0);
+    } else if(session->shared_fd != -1) {
+        char buffer[1024];
+        ssize_t n;
+        while((n = pread(session->shared_fd, buffer, sizeof(buffer), session->shared_file_offset)) > 0) {
+            if(compress_write(session, buffer, n) == 0)
+                break;
+            session->shared_file_offset += n;
+        }
+        miniweb_shared_data_buffer(session, NULL, 0);
+    }
+
+    if(session->compress_state == 1) {
+        z->next_in  = Z_NULL;
+        z->avail_in = 0;
+        while(rtn != Z_STREAM_END) {
+            if(session->data_used == session->data_size && !session_data_reserve(session, 1)) {
+                session->compress_state = -2;
+                break;
+            }
+            z->next_out  = (Bytef *)session->data+session->data_used;
+            z->avail_out = session->data_size-session->data_used;
+            rtn = deflate(z, Z_FINISH);
+            session->data_used = session->data_size-z->avail_out;
+        }
+    }
+
+    if(session->compress_state == -2) {
+        // Can't send a truncated gzip stream
+        session->data_used = 0;
+        session->response_code = 500;
+    } else {
+        miniweb_add_header(session, "Content-Encoding", "gzip");
+    }
+    compress_release(session);
+    session->compress_state = -1;
+}
+
+/****************************************************************************************/
+static void compress_tidyup(void) {
+    while(compress_pool_used > 0) {
+        z_stream *z = compress_pool[--compress_pool_used];
+        deflateEnd(z);
+        mem_free(z);
+    }
+}
+#else
+static size_t compress_write(struct miniweb_session *session, void *data, size_t len) {
+    (void)session;
+    (void)data;
+    return len;
+}
+
+static void compress_start(struct miniweb_session *session) {
+    (void)client_accepts_gzip;
+    session->compress_state = -1;
+}
+
+static void compress_release(struct miniweb_session *session) {
+    session->compress_state = 0;
+}
+
+static void compress_finish(struct miniweb_session *session) {
+    (void)session;
+}
+
+static void compress_tidyup(void) {
+}
+#endif
+
+/****************************************************************************************/
+int miniweb_set_compression(int level, size_t threshold) {
+#ifdef MINIWEB_ZLIB
+    if(level < 0 || level > 9)
+        return 0;
+    compress_level     = level;
+    compress_threshold = threshold;
+    if(level > 0)
+        return miniweb_listen_header("Accept-Encoding");
+    return 1;
+#else
+    (void)threshold;
+    return level == 0;
+#endif
+}
+
+/****************************************************************************************/
+int miniweb_no_compression(struct miniweb_session *session) {
+    if(session->compress_state == 1 || session->compress_state == -2)
+        return 0;  // Too late, it has already started
+    session->compress_state = -1;
+    return 1;
+}
+
+/****************************************************************************************/
+static struct listen_header *header_find(char *data, size_t len) {
+    struct listen_header *lh = first_listen_header;
+    while(lh != NULL) {
+       if(lh->len == len) {
+           // Header names are not case sensitive
+           if(strncasecmp(data,lh->header,len)==0)
+             return lh;
+       }
+       lh = lh->next;
+    }
+    if(debug_level >= MINIWEB_DEBUG_ALL) {
+        printf("Not listening for '");
+        for(size_t i = 0; i < len; i++) {
+            putchar(data[i]);
+        }
+        putchar('\'');
+        putchar('\n');
+    }
+    return NULL;
+}
+/****************************************************************************************/
+// Latency histograms. Buckets are log-linear: exact below 2*LAT_SUB_BUCKETS us, and then
+// LAT_SUB_BUCKETS to each power of two, so any value is within about 3% of its bucket.
+/****************************************************************************************/
+#define LAT_SUB_BITS     5
+#define LAT_SUB_BUCKETS  (1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS     27        // Anything over 2^27 us (about two minutes) goes in the last bucket
+#define LAT_BUCKETS      ((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB_BUCKETS)
+
+struct lat_hist {
+   unsigned counts[LAT_BUCKETS];
+   unsigned total;
+   unsigned max;
+   unsigned long long sum;
+};
+static struct lat_hist latency_all;
+
+static int lat_bucket(unsigned us) {
+    int shift;
+    if(us < 2*LAT_SUB_BUCKETS)
+        return us;
+    if(us >= 1u << LAT_MAX_BITS)
+        return LAT_BUCKETS-1;
+    shift = 31 - __builtin_clz(us) - LAT_SUB_BITS;
+    return (shift+1)*LAT_SUB_BUCKETS + (us >> shift) - LAT_SUB_BUCKETS;
+}
+
+// The highest value that lands in a bucket
+static unsigned lat_bucket_value(int bucket) {
+    int shift;
+    if(bucket < 2*LAT_SUB_BUCKETS)
+        return bucket;
+    shift = bucket / LAT_SUB_BUCKETS - 1;
+    return ((unsigned)(bucket % LAT_SUB_BUCKETS + LAT_SUB_BUCKETS) << shift) + (1u << shift) - 1;
+}
+
+/****************************************************************************************/
+static void lat_record(struct lat_hist *h, unsigned us) {
+    if(!STATS_ENABLED)
+        return;
+    h->counts[lat_bucket(us)]++;
+    h->total++;
+    h->sum += us;
+    if(us > h->max)
+        h->max = us;
+}
+
+/****************************************************************************************/
+// The value at or below which 'per_mille' thousandths of the samples fall
+static unsigned lat_percentile(struct lat_hist *h, unsigned per_mille) {
+    unsigned long long want = ((unsigned long long)h->total * per_mille + 999) / 1000;
+    unsigned long long seen = 0;
+    int i;
+    if(h->total == 0)
+        return 0;
+    for(i = 0; i < LAT_BUCKETS; i++) {
+        seen += h->counts[i];
+        if(seen >= want)
+            break;
+    }
+    // The bucket's top could be over the largest sample actually seen
+    return i < LAT_BUCKETS && lat_bucket_value(i) < h->max ? lat_bucket_value(i) : h->max;
+}
+
+/****************************************************************************************/
+// Request tracing. A sample of requests have the time of each phase recorded, and once the
+// reply has gone the times are copied into a ring, to be written out as Chrome trace events.
+/****************************************************************************************/
+struct trace_record {
+   unsigned long long times[TRACE_PHASES];   // ns, 0 for phases that didn't happen
+   int  response_code;
+   int  pid;                                  // The connection...
+   int  tid;                                  // ...and HTTP/2 stream
+   char name[64];
+};
+static struct trace_record *trace_ring;      // NULL when tracing is off
+static unsigned trace_size;
+static unsigned trace_next;
+static unsigned trace_used;
+static unsigned trace_sample_every;
+static unsigned trace_sample_count;
+
+static unsigned long long trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/****************************************************************************************/
+static void trace_mark(struct miniweb_session *s, int phase) {
+    if(STATS_ENABLED && s->traced && s->trace_times[phase] == 0)
+        s->trace_times[phase] = trace_now();
+}
+
+/****************************************************************************************/
+// A request has started - decide whether to trace it
+static void trace_start(struct miniweb_session *s, int pid, int tid) {
+    s->traced = 0;
+    if(!STATS_ENABLED || trace_ring == NULL || ++trace_sample_count < trace_sample_every)
+        return;
+    trace_sample_count = 0;
+    memset(s->trace_times, 0, sizeof(s->trace_times));
+    s->traced = 1;
+    s->trace_pid = pid;
+    s->trace_tid = tid;
+    // Only the first request on a connection waited after the accept
+    if(s->requests_served == 0)
+        s->trace_times[tp_accept] = s->accept_ns;
+    trace_mark(s, tp_first_byte);
+}
+
+/****************************************************************************************/
+static void trace_record(struct miniweb_session *s) {
+    struct trace_record *r;
+    if(!STATS_ENABLED || !s->traced || trace_ring == NULL)
+        return;
+    trace_mark(s, tp_last_write);
+    s->traced = 0;
+    r = &trace_ring[trace_next];
+    trace_next = (trace_next+1) % trace_size;
+    if(trace_used < trace_size)
+        trace_used++;
+    memcpy(r->times, s->trace_times, sizeof(r->times));
+    r->response_code = s->response_code;
+    r->pid = s->trace_pid;
+    r->tid = s->trace_tid;
+    snprintf(r->name, sizeof(r->name), "%s %s", s->method ? s->method : "-", s->full_url ? s->full_url : "-");
+}
+
+/****************************************************************************************/
+int miniweb_set_trace(int sample_every, int records) {
+    if(sample_every < 0 || records < 0 || (!STATS_ENABLED && sample_every > 0 && records > 0))
+        return 0;
+    mem_free(trace_ring);
+    trace_ring = NULL;
+    trace_size = trace_next = trace_used = 0;
+    if(sample_every == 0 || records == 0)
+        return 1;
+    trace_ring = mem_alloc(sizeof(struct trace_record)*records, MINIWEB_MEM_OTHER);
+    if(trace_ring == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    trace_size = records;
+    trace_sample_every = sample_every;
+    trace_sample_count = sample_every-1;   // Trace the first request
+    return 1;
+}
+
+/****************************************************************************************/
+// One "complete" event, if both ends of it were seen
+static void trace_event(FILE *f, struct trace_record *r, const char *name, int from, int to, int *first) {
+    unsigned long long start = r->times[from], end = r->times[to];
+    const char *p;
+    if(start == 0 || end == 0 || end < start)
+        return;
+    fprintf(f, "%s\n{\"name\":\"", *first ? "" : ",");
+    for(p = name; *p != '\0'; p++) {
+        if(*p == '"' || *p == '\\')
+            fprintf(f, "\\%c", *p);
+        else if((unsigned char)*p < ' ')
+            fprintf(f, "\\u%04x", *p);
+        else
+            fputc(*p, f);
+    }
+    fprintf(f, "\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%i,\"tid\":%i,\"args\":{\"status\":%i}}",
+            start/1000, start%1000, (end-start)/1000, (end-start)%1000, r->pid, r->tid, r->response_code);
+    *first = 0;
+}
+
+/****************************************************************************************/
+int miniweb_trace_dump(char *filename) {
+    FILE *f;
+    unsigned i;
+    int first = 1;
+    if(trace_ring == NULL || filename == NULL)
+        return 0;
+    f = fopen(filename, "w");
+    if(f == NULL)
+        return 0;
+    fprintf(f, "{\"traceEvents\":[");
+    // Oldest first
+    for(i = 0; i < trace_used; i++) {
+        struct trace_record *r = &trace_ring[(trace_next + trace_size - trace_used + i) % trace_size];
+        trace_event(f, r, r->name,          tp_first_byte,    tp_last_write,    &first);
+        trace_event(f, r, "queued",         tp_accept,        tp_first_byte,    &first);
+        trace_event(f, r, "read headers",   tp_first_byte,    tp_headers,       &first);
+        trace_event(f, r, "body and route", tp_headers,       tp_handler_start, &first);
+        trace_event(f, r, "handler",        tp_handler_start, tp_handler_end,   &first);
+        trace_event(f, r, "wait to write",  tp_handler_end,   tp_first_write,   &first);
+        trace_event(f, r, "write",          tp_first_write,   tp_last_write,    &first);
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return fclose(f) == 0;
+}
+
+/****************************************************************************************/
+// Access log. Finished requests are copied into a preallocated ring, and written out in
+// batches later, so a slow log file can't hold up replies. The ring has one producer (the
+// event loop) and one consumer at a time, so its indexes only need atomic loads and stores.
+/****************************************************************************************/
+struct access_entry {
+   struct miniweb_access_record record;
+   struct sockaddr_storage peer;      // Turned into text when the entry is written out
+};
+static struct access_entry *access_ring;
+static unsigned access_size;
+static unsigned access_head;          // Next to fill, only moved by the event loop
+static unsigned access_tail;          // Next to write out, only moved by the drain
+static unsigned access_dropped;
+static char access_draining;          // Keeps the drain to one caller at a time
+static FILE *access_file;
+static void (*access_callback)(struct miniweb_access_record *record);
+
+/****************************************************************************************/
+static void access_log_add(struct miniweb_session *s, unsigned us_taken) {
+    unsigned head = access_head;
+    struct miniweb_access_record *r;
+    struct request_header *rh;
+    size_t used = 0;
+
+    if(head - __atomic_load_n(&access_tail, __ATOMIC_ACQUIRE) >= access_size) {
+        access_dropped++;
+        return;
+    }
+    r = &access_ring[head % access_size].record;
+    memcpy(&access_ring[head % access_size].peer, &s->peer, sizeof(s->peer));
+    r->when     = time(NULL);
+    r->status   = s->response_code;
+    r->bytes    = s->data_used + s->shared_data_size;
+    r->us_taken = us_taken;
+    snprintf(r->method,   sizeof(r->method),   "%s", s->method   ? s->method   : "-");
+    snprintf(r->protocol, sizeof(r->protocol), "%s", s->protocol ? s->protocol : "-");
+    snprintf(r->url,      sizeof(r->url),      "%s", s->full_url ? s->full_url : "-");
+    r->headers[0] = '\0';
+    for(rh = s->first_request_header; rh != NULL && used < sizeof(r->headers); rh = rh->next) {
+        int n = snprintf(r->headers+used, sizeof(r->headers)-used, "%s%s: %s",
+                         used ? "\t" : "", rh->header, rh->value ? rh->value : "");
+        if(n > 0)
+            used += n;
+    }
+    __atomic_store_n(&access_head, head+1, __ATOMIC_RELEASE);
+}
+
+/****************************************************************************************/
+int miniweb_access_log_flush(void) {
+    unsigned tail, head;
+    int count = 0;
+
+    if(__atomic_exchange_n(&access_draining, 1, __ATOMIC_ACQUIRE))
+        return 0;
+    if(access_ring == NULL) {
+        __atomic_store_n(&access_draining, 0, __ATOMIC_RELEASE);
+        return 0;
+    }
+    tail = access_tail;
+    head = __atomic_load_n(&access_head, __ATOMIC_ACQUIRE);
+    for(; tail != head; tail++, count++) {
+        struct access_entry *e = &access_ring[tail % access_size];
+        struct miniweb_access_record *r = &e->record;
+        char when[32];
+
+        r->client[0] = '\0';
+        r->port = 0;
+        if(e->peer.ss_family == AF_INET) {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&e->peer;
+            inet_ntop(AF_INET, &sin->sin_addr, r->client, sizeof(r->client));
+            r->port = ntohs(sin->sin_port);
+        } else if(e->peer.ss_family == AF_INET6) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&e->peer;
+            inet_ntop(AF_INET6, &sin6->sin6_addr, r->client, sizeof(r->client));
+            r->port = ntohs(sin6->sin6_port);
+        }
+        if(access_file != NULL) {
+            struct tm tm;
+            gmtime_r(&r->when, &tm);
+            strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+            fprintf(access_file, "%s:%u [%s] \"%s %s %s\" %i %llu %u \"%s\"\n",
+                    r->client[0] ? r->client : "-", r->port, when, r->method, r->url, r->protocol,
+                    r->status, r->bytes, r->us_taken, r->headers);
+        }
+        if(access_callback != NULL)
+            access_callback(r);
+    }
+    __atomic_store_n(&access_tail, tail, __ATOMIC_RELEASE);
+    if(access_file != NULL && count > 0)
+        fflush(access_file);
+    __atomic_store_n(&access_draining, 0, __ATOMIC_RELEASE);
+    return count;
+}
+
+/****************************************************************************************/
+int miniweb_access_log(int records, char *filename, void (*callback)(struct miniweb_access_record *record)) {
+    if(records < 0)
+        return 0;
+    // Write out what the old log is holding first
+    miniweb_access_log_flush();
+    if(access_file != NULL) {
+        fclose(access_file);
+        access_file = NULL;
+    }
+    mem_free(access_ring);
+    access_ring = NULL;
+    access_size = access_head = access_tail = 0;
+    access_callback = NULL;
+    if(records == 0)
+        return 1;
+
+    if(filename != NULL && (access_file = fopen(filename, "a")) == NULL)
+        return 0;
+    access_ring = mem_alloc(sizeof(struct access_entry)*records, MINIWEB_MEM_OTHER);
+    if(access_ring == NULL) {
+        if(access_file != NULL) {
+            fclose(access_file);
+            access_file = NULL;
+        }
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    }
+    access_size = records;
+    access_callback = callback;
+    return 1;
+}
+
+/****************************************************************************************/
+static void admit_request_done(struct miniweb_session *s);
+
+static void session_update_metrics(struct miniweb_session *session) {
+    struct timespec end_time;
+    struct timespec duration;
+    int time_us;
+    unsigned rc;
+    admit_request_done(session);
+    trace_record(session);
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    if(end_time.tv_nsec >= session->start_time.tv_nsec) {
+       duration.tv_nsec = end_time.tv_nsec - session->start_time.tv_nsec;
+       duration.tv_sec  = end_time.tv_sec  - session->start_time.tv_sec;
+    } else {
+       duration.tv_nsec = end_time.tv_nsec - session->start_time.tv_nsec+1000000000;
+       duration.tv_sec  = end_time.tv_sec  - session->start_time.tv_sec-1;
+    }
+    time_us = duration.tv_nsec / 1000 + duration.tv_sec * 1000000;
+    if(access_ring != NULL)
+        access_log_add(session, time_us);
+
+    if(session->url == NULL) {  // This for 404 pages
+        requests_unrouted++;
+        return;
+    }
+    if(!lock_url()) {
+        usleep(100);
+        if(!lock_url()) {
+            return;
+        }
+    }
+    // Update total time spent
+
+    session->url->request_time.tv_nsec += duration.tv_nsec;
+    session->url->request_time.tv_sec  += duration.tv_sec; 
+    if(session->url->request_time.tv_nsec > 1000000000) {
+        session->url->request_time.tv_nsec -= 1000000000;
+        session->url->request_time.tv_sec  += 1; 
+    }
+
+    if(session->url->request_time.tv_nsec >= 1000000000) {
+       session->url->request_time.tv_nsec -= 1000000000;
+       session->url->request_time.tv_sec  += 1;
+    }  
+
+    session->url->request_count++;
+    session->url->request_count_metric++;
+    if(STATS_ENABLED && session->url->latency == NULL)
+        session->url->latency = mem_calloc(sizeof(struct lat_hist), MINIWEB_MEM_OTHER);
+    if(session->url->latency != NULL)
+        lat_record(session->url->latency, time_us);
+    lat_record(&latency_all, time_us);
+    session->url->data_sent_metric += session->data_used;
+    session->url->bytes_sent += session->data_used + session->shared_data_size;
+    for(rc = 0; rc < RESP_CODES && resp_codes[rc].number != session->response_code; rc++)
+        ;
+    session->url->response_counts[rc]++;
+    url_size_history_add(session->url, session->data_used);
+    if(session->url->request_count_metric > 0x40000000 || session->url->data_sent_metric > 0x40000000) {
+        session->url->request_count_metric >>= 1;
+        session->url->data_sent_metric     >>= 1;
+    }
+    unlock_url();
+    if(log_callback != NULL) {
+       log_callback(session->full_url, session->response_code, time_us);
+    }
+}
+
+/****************************************************************************************/
+// Plain TCP transport
+/****************************************************************************************/
+static ssize_t plain_read(struct miniweb_session *s, void *buf, size_t len) {
+    return read(s->socket, buf, len);
+}
+
+static ssize_t plain_write(struct miniweb_session *s, const void *buf, size_t len) {
+    // send() rather than write() so a closed connection doesn't raise SIGPIPE
+    return send(s->socket, buf, len, MSG_NOSIGNAL);
+}
+
+static ssize_t plain_sendfile(struct miniweb_session *s, int fd, off_t offset, size_t len) {
+    return sendfile(s->socket, fd, &offset, len);
+}
+
+static int plain_pending(struct miniweb_session *s) {
+    (void)s;
+    return 0;
+}
+
+static int plain_handshake(struct miniweb_session *s) {
+    (void)s;
+    return 1;
+}
+
+static const char *plain_protocol(struct miniweb_session *s) {
+    (void)s;
+    return NULL;
+}
+
+static void plain_close(struct miniweb_session *s) {
+    (void)s;
+}
+
+static const struct transport plain_transport = {
+    plain_read, plain_write, plain_sendfile, plain_pending, plain_handshake, plain_protocol, plain_close
+};
+
+/****************************************************************************************/
+// TLS transport using OpenSSL. Once the handshake is done the connection is moved to
+// kernel TLS if the kernel and library allow it, so sendfile() stays zero-copy.
+// Another library can be added by providing another 'struct transport'.
+/****************************************************************************************/
+static int tls_enabled;
+static unsigned tls_handshakes;
+static unsigned tls_resumed;
+static unsigned tls_ktls_send;
+static unsigned tls_failures;
+
+#ifdef MINIWEB_OPENSSL
+static SSL_CTX *tls_ctx;
+
+// Turn an OpenSSL result into what a system call would have done
+static ssize_t tls_result(struct miniweb_session *s, int rtn) {
+    switch(SSL_get_error(s->tls, rtn)) {
+        case SSL_ERROR_WANT_READ:
+            s->io_want = want_read;
+            errno = EWOULDBLOCK;
+            return -1;
+        case SSL_ERROR_WANT_WRITE:
+            s->io_want = want_write;
+            errno = EWOULDBLOCK;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        default:
+            ERR_clear_error();
+            errno = EIO;
+            return -1;
+    }
+}
+
+static ssize_t tls_read(struct miniweb_session *s, void *buf, size_t len) {
+    int n;
+    s->io_want = want_none;
+    n = SSL_read(s->tls, buf, len);
+    if(n > 0)
+        return n;
+    return tls_result(s, n);
+}
+
+static ssize_t tls_write(struct miniweb_session *s, const void *buf, size_t len) {
+    int n;
+    s->io_want = want_none;
+    n = SSL_write(s->tls, buf, len);
+    if(n > 0)
+        return n;
+    return tls_result(s, n);
+}
+
+static ssize_t tls_sendfile(struct miniweb_session *s, int fd, off_t offset, size_t len) {
+    char buffer[16384];
+    ssize_t n;
+#ifdef SSL_OP_ENABLE_KTLS
+    if(BIO_get_ktls_send(SSL_get_wbio(s->tls))) {
+        s->io_want = want_none;
+        n = SSL_sendfile(s->tls, fd, offset, len, 0);
+        if(n >= 0)
+            return n;
+        return tls_result(s, n);
+    }
+#endif
+    // No kernel TLS, so it has to come through user space. If the write can't go, the
+    // same bytes are read again for the retry, as OpenSSL requires.
+    if(len > sizeof(buffer))
+        len = sizeof(buffer);
+    n = pread(fd, buffer, len, offset);
+    if(n <= 0)
+        return n;
+    return tls_write(s, buffer, n);
+}
+
+static int tls_pending(struct miniweb_session *s) {
+    return SSL_pending(s->tls);
+}
+
+static int tls_handshake(struct miniweb_session *s) {
+    int rtn;
+    s->io_want = want_none;
+    rtn = SSL_do_handshake(s->tls);
+    if(rtn == 1) {
+        tls_handshakes++;
+        if(SSL_session_reused(s->tls))
+            tls_resumed++;
+#ifdef SSL_OP_ENABLE_KTLS
+        if(BIO_get_ktls_send(SSL_get_wbio(s->tls)))
+            tls_ktls_send++;
+#endif
+        return 1;
+    }
+    if(tls_result(s, rtn) == -1 && errno == EWOULDBLOCK)
+        return 0;
+    tls_failures++;
+    return -1;
+}
+
+static const char *tls_protocol(struct miniweb_session *s) {
+    const unsigned char *name;
+    unsigned len;
+    SSL_get0_alpn_selected(s->tls, &name, &len);
+    if(len == 2 && memcmp(name, "h2", 2) == 0)
+        return "h2";
+    if(len == 8 && memcmp(name, "http/1.1", 8) == 0)
+        return "http/1.1";
+    return NULL;
+}
+
+/****************************************************************************************/
+// Offer HTTP/2 to clients that ask for it
+static int tls_alpn_select(SSL *ssl, const unsigned char **out, unsigned char *out_len,
+                           const unsigned char *in, unsigned int in_len, void *arg) {
+    static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+    const unsigned char *offer = protocols;
+    unsigned offer_len = sizeof(protocols)-1;
+    (void)ssl;
+    (void)arg;
+    if(h2_max_streams == 0) {
+        offer += 3;
+        offer_len -= 3;
+    }
+    if(SSL_select_next_proto((unsigned char **)out, out_len, offer, offer_len, in, in_len) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/****************************************************************************************/
+static void tls_close(struct miniweb_session *s) {
+    if(s->tls == NULL)
+        return;
+    // Best effort - we won't wait around for the client's close_notify
+    if(s->io_state != io_handshake)
+        SSL_shutdown(s->tls);
+    SSL_free(s->tls);
+    s->tls = NULL;
+    ERR_clear_error();
+}
+
+static const struct transport tls_transport = {
+    tls_read, tls_write, tls_sendfile, tls_pending, tls_handshake, tls_protocol, tls_close
+};
+
+/****************************************************************************************/
+static int session_tls_start(struct miniweb_session *s) {
+    s->tls = SSL_new(tls_ctx);
+    if(s->tls == NULL) {
+        tls_failures++;
+        return miniweb_log_error(MINIWEB_ERR_TLS);
+    }
+    SSL_set_fd(s->tls, s->socket);
+    SSL_set_accept_state(s->tls);
+    s->transport = &tls_transport;
+    s->io_state  = io_handshake;
+    return 1;
+}
+
+/****************************************************************************************/
+int miniweb_set_tls(char *cert_file, char *key_file) {
+    static const unsigned char session_id_context[] = "miniweb";
+    if(tls_ctx != NULL) {
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        tls_enabled = 0;
+    }
+    if(cert_file == NULL)
+        return 1;
+
+    tls_ctx = SSL_CTX_new(TLS_server_method());
+    if(tls_ctx == NULL)
+        return miniweb_log_error(MINIWEB_ERR_TLS);
+    SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    // Let polling clients resume with a session ticket, or from the session cache
+    SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_id_context(tls_ctx, session_id_context, sizeof(session_id_context)-1);
+    SSL_CTX_sess_set_cache_size(tls_ctx, 1024);
+    SSL_CTX_set_num_tickets(tls_ctx, 1);
+    SSL_CTX_set_alpn_select_cb(tls_ctx, tls_alpn_select, NULL);
+
+    if(SSL_CTX_use_certificate_chain_file(tls_ctx, cert_file) != 1 ||
+       SSL_CTX_use_PrivateKey_file(tls_ctx, key_file ? key_file : cert_file, SSL_FILETYPE_PEM) != 1 ||
+       SSL_CTX_check_private_key(tls_ctx) != 1) {
+        ERR_clear_error();
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+        return miniweb_log_error(MINIWEB_ERR_TLS);
+    }
+    tls_enabled = 1;
+    return 1;
+}
+
+/****************************************************************************************/
+static void tls_tidyup(void) {
+    if(tls_ctx != NULL) {
+        SSL_CTX_free(tls_ctx);
+        tls_ctx = NULL;
+    }
+    tls_enabled = 0;
+}
+#else
+static int session_tls_start(struct miniweb_session *s) {
+    (void)s;
+    return 0;
+}
+
+int miniweb_set_tls(char *cert_file, char *key_file) {
+    (void)key_file;
+    return cert_file == NULL;
+}
+
+static void tls_tidyup(void) {
+}
+#endif
+
+/****************************************************************************************/
+static void session_init(struct miniweb_session *session, int socket);
+
+static struct miniweb_session *session_new(int socket) {
+   struct miniweb_session *session;
+   if(socket == -1)
+       return NULL; 
+  
+   // Can we reused an existing session object? 
+   session = first_session;
+   while(session != NULL && session->socket != -1) {
+       session = session->next;
+   }
+
+   // Do we need a new session object
+   if(session == NULL) {
+#ifdef MINIWEB_STATIC
+       if(session_count == MINIWEB_STATIC_SESSIONS || !static_init())
+           return NULL;
+       session = static_sessions[session_count];
+#else
+       if(session_count >= max_sessions)
+           return NULL;
+       session = mem_alloc(sizeof(struct miniweb_session), MINIWEB_MEM_SESSION);
+       if(session == NULL) {
+           miniweb_log_error(MINIWEB_ERR_NOMEM);
+           return NULL;
+       }
+#endif
+       session->next = first_session;
+       first_session = session;
+       session_count++;
+   }
+   session_init(session, socket);
+   return session;
+}
+
+/****************************************************************************************/
+// Set up a new session. HTTP/2 streams use sessions with no socket of their own.
+static void session_init(struct miniweb_session *session, int socket) {
+   session->io_state     = io_reading;
+   session->parser_state = p_method;
+   session->current_header = NULL;
+   session->socket = socket;
+   session->peer.ss_family = AF_UNSPEC;
+   session->listener = NULL;
+   session->admit_slot = -1;
+   session->phase = phase_header;
+   session->phase_request = 0;
+   session->phase_start = time(NULL);
+   session->admitted = 0;
+   session->refused = 0;
+   session->transport = &plain_transport;
+   session->tls = NULL;
+   session->io_want = want_none;
+   session->response_code = 500;
+   session->requests_served = 0;
+   session->keep_alive = 0;
+   session->corked = 0;
+   session->accept_ns = 0;
+   session->traced = 0;
+   session->url = NULL;
+   session->first_request_header = NULL;
+   session->first_reply_header = NULL;
+
+   session->header_data = NULL;
+   session->header_data_size = 0;
+   session->header_data_alloc = 0;
+   session->data = NULL;
+   session->data_size = 0;
+   session->data_used = 0;
+   session->reply_failed = 0;
+   session->shared_data = NULL;
+   session->shared_data_size = 0;
+   session->shared_blob = NULL;
+   session->shared_fd = -1;
+   session->shared_file_offset = 0;
+   session->write_pointer = 0;
+   session->compress_state = 0;
+   session->zstream = NULL;
+   session->json_depth = 0;
+   session->json_items = 0;
+   session->json_after_key = 0;
+   session->outq_head = NULL;
+   session->outq_tail = NULL;
+   session->outq_bytes = 0;
+   session->outq_chunks = 0;
+   session->h2 = NULL;
+   session->ws = NULL;
+   session->sse_topic = NULL;
+   session->sse_next = NULL;
+
+   session->in_buffer = NULL;
+   session->in_buffer_size = 0;
+   session->in_buffer_used = 0;
+   session->in_buffer_scanned = 0;
+
+   session->last_line_term = 0;
+   session->method = NULL;
+   session->protocol = NULL;
+   session->full_url = NULL;
+   session->wildcard = NULL;
+ 
+   session->content_length = -1;
+   session->content = NULL;
+   session->content_read = 0;
+}
+
+
+/****************************************************************************************/
+char *miniweb_get_wildcard(struct miniweb_session *session) {
+   if(!session)
+       return NULL;
+   return session->wildcard;
+}
+/****************************************************************************************/
+static int session_request_header_add(struct miniweb_session *session,char *header, char *value) {
+    struct request_header *rh;
+
+    if(debug_level >= MINIWEB_DEBUG_DATA) {
+       fprintf(stderr, "Adding header %s: %s\n", header, value);
+    }
+#ifdef MINIWEB_STATIC
+    int slots = 0;
+    for(rh = session->first_request_header; rh != NULL; rh = rh->next) {
+        if(++slots == MINIWEB_STATIC_HEADERS)
+            return 0;
+    }
+#endif
+    rh = mem_alloc(sizeof(struct request_header), MINIWEB_MEM_HEADER);
+    if(rh == NULL) 
+        return 0;
+
+    rh->header = mem_alloc(strlen(header)+1, MINIWEB_MEM_HEADER);
+    if(rh->header == NULL) {
+        mem_free(rh);
+        return 0;
+    }
+
+    rh->value = mem_alloc(strlen(value)+1, MINIWEB_MEM_HEADER);
+    if(rh->value == NULL) {
+        mem_free(rh->header);
+        mem_free(rh);
+        return 0;
+    }
+
+    strcpy(rh->header, header);
+    strcpy(rh->value,  value);
+
+    rh->next = session->first_request_header;
+    session->first_request_header = rh;
+
+    return 1;
+}
+
+/****************************************************************************************/
+static int check_url_match(struct miniweb_session *session, struct url_reg *ur) {
+    // Find the ? that starts the get vars
+    size_t url_end, len = strlen(session->full_url);
+    for(url_end = 0; url_end < len; url_end++) {
+        if(session->full_url[url_end] == '?')
+            break;
+    }
+
+    // If there is no wildcard then check the full URL (excluding vars!)
+    if(ur->pattern_end == NULL) {
+        if(len != ur->pattern_start_len)
+            return 0;
+        if(memcmp(session->full_url, ur->pattern_start, ur->pattern_start_len) != 0)
+            return 0;
+        return 1;
+    }
+
+    // Not long enough to have the start and end patterns, and some wildcard chars?
+    if(url_end < ur->pattern_start_len+1+ur->pattern_end_len)
+        return 0;
+
+    if(memcmp(session->full_url, ur->pattern_start,  ur->pattern_start_len) != 0)
+        return 0;
+
+    if(memcmp(session->full_url+len-ur->pattern_end_len, ur->pattern_end,  ur->pattern_end_len) != 0)
+        return 0;
+
+    int wildcard_len = len - ur->pattern_start_len - ur->pattern_end_len;
+    session->wildcard = mem_alloc(wildcard_len+1, MINIWEB_MEM_REQUEST);
+    if(session->wildcard == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+
+    memcpy(session->wildcard, session->full_url+ur->pattern_start_len,  wildcard_len);
+    session->wildcard[wildcard_len] = '\0';
+
+    return 1;
+}
+/****************************************************************************************/
+static int session_find_target_url(struct miniweb_session *session) {
+    struct url_reg *ur = first_url_reg;
+    if(debug_level == MINIWEB_DEBUG_ALL)
+        printf("Looking for %s %s %s\n", session->method, session->full_url, session->protocol);
+    while(ur) {
+        if(strcmp(session->protocol, "HTTP/1.1") == 0 || strcmp(session->protocol, "HTTP/1.0") == 0 ||
+           strcmp(session->protocol, "HTTP/2") == 0) {
+            if(strcmp(session->method,   ur->method) == 0) {
+                if(check_url_match(session,ur))
+                    break;
+            }
+        }
+        ur = ur->next;
+    }
+    if(debug_level == MINIWEB_DEBUG_ALL) {
+        if(ur == NULL) {
+            printf("Not found\n");
+        } else {
+            printf("Found\n");
+        }
+    }
+    session->url = ur;
+    return ur ? 1 : 0;
+}
+
+/****************************************************************************************/
+static void session_empty(struct miniweb_session *session) {
+    // Clean up any POST content
+    session->content_length = -1;
+    if(session->content) {
+       mem_free(session->content);
+       session->content = NULL;
+    }
+
+    // Clean up method, full_url and protocol
+    session->parser_state = p_method;
+    if(session->method) {
+       mem_free(session->method);
+       session->method = NULL;
+    }
+    if(session->full_url) {
+       mem_free(session->full_url);
+       session->full_url = NULL;
+    }
+    if(session->protocol) {
+       mem_free(session->protocol);
+       session->protocol = NULL;
+    }
+    if(session->wildcard) {
+       mem_free(session->wildcard);
+       session->wildcard = NULL;
+    }
+   
+    if(session->header_data != NULL) {
+        pool_free(session->header_data, session->header_data_alloc);
+        session->header_data = NULL;
+    }
+    session->header_data_size = 0;
+    session->header_data_alloc = 0;
+    // Stop using shared data
+    miniweb_shared_data_buffer(session, NULL, 0);
+
+    // Return any deflate stream to the pool
+    compress_release(session);
+    session->json_depth = 0;
+    session->json_items = 0;
+    session->json_after_key = 0;
+
+    // Clean up reply data
+    if(session->data) {
+       pool_free(session->data, session->data_size);
+       session->data = NULL;
+    }
+    session->data_size = 0;
+    session->data_used = 0;
+    session->reply_failed = 0;
+    session->write_pointer = 0;
+    admit_request_done(session);
+    session->url = NULL;
+    session->response_code = 500;
+    session->current_header = NULL;
+    session->traced = 0;
+    session->refused = 0;
+
+    // Clean up the input buffer, unless it holds the start of a pipelined request
+    if(session->in_buffer && (session->socket == -1 || session->in_buffer_used == 0)) {
+       if(session->in_buffer != read_scratch)
+          pool_free(session->in_buffer, session->in_buffer_size);
+       session->in_buffer = NULL; 
+       session->in_buffer_size = 0;
+       session->in_buffer_used = 0;
+       session->in_buffer_scanned = 0;
+    }
+
+    // Clean up reply header
+    while(session->first_reply_header) {
+       struct reply_header *rh = session->first_reply_header;
+       session->first_reply_header = rh->next;
+       if(rh->header)
+         mem_free(rh->header);
+       if(rh->value)
+         mem_free(rh->value);
+       mem_free(rh);  
+    }
+
+    // Clean up request header
+    while(session->first_request_header) {
+       struct request_header *rh = session->first_request_header;
+       session->first_request_header = rh->next;
+       if(rh->header)
+         mem_free(rh->header);
+       if(rh->value)
+         mem_free(rh->value);
+       mem_free(rh);  
+    }
+}
+
+/****************************************************************************************/
+// Admission control. Each client address has an entry in a small open addressed table,
+// counting its open connections and holding a token bucket for its request rate. Clients
+// over their limits, and requests over the in-flight or route caps, are sent a canned
+// reply without any handler being run, so the load they add stays small.
+/****************************************************************************************/
+#define ADMIT_CLIENTS 1024        // Must be a power of two
+#define ADMIT_PROBES  8           // Slots looked at for a client before it goes untracked
+
+struct admit_client {
+   unsigned char addr[16];        // IPv4 addresses are held IPv6 mapped
+   unsigned conns;                // Connections open now
+   unsigned tokens;               // Requests that can be made now, in 1/1000ths
+   long long refilled_ms;         // When the tokens were last topped up (0 = unused)
+};
+static struct admit_client admit_clients[ADMIT_CLIENTS];
+static unsigned admit_max_conns;       // Per client (0 = no limit)
+static unsigned admit_rate;            // Requests per second per client (0 = no limit)
+static unsigned admit_burst;           // Requests a client can make at once
+static unsigned admit_max_in_flight;   // 0 = no limit
+static unsigned requests_in_flight;
+static unsigned admit_untracked;       // Clients that didn't fit in the table, so weren't limited
+
+enum shed_e { shed_connections, shed_rate, shed_in_flight, shed_route, SHED_REASONS };
+static const char *shed_names[SHED_REASONS] = { "connections", "rate", "in_flight", "route" };
+static unsigned shed_counts[SHED_REASONS];
+
+static long long admit_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000 + 1;   // Never 0
+}
+
+// Top up the client's tokens for the time since it was last seen
+static void admit_refill(struct admit_client *c, long long now_ms) {
+    unsigned long long full = (unsigned long long)admit_burst*1000;
+    unsigned long long tokens = c->tokens + (unsigned long long)(now_ms-c->refilled_ms)*admit_rate;
+    c->tokens = tokens > full ? full : tokens;
+    c->refilled_ms = now_ms;
+}
+
+// Find, or make, the entry for the client's address. An entry can be taken over once its
+// client has no connections and a full bucket, as it then holds nothing worth keeping.
+static int admit_find(struct sockaddr_storage *peer, long long now_ms) {
+    unsigned char addr[16];
+    unsigned hash = 2166136261u;
+    int i, slot, reuse = -1;
+
+    if(peer->ss_family == AF_INET) {
+        memset(addr, 0, 10);
+        addr[10] = addr[11] = 0xFF;
+        memcpy(addr+12, &((struct sockaddr_in *)peer)->sin_addr, 4);
+    } else if(peer->ss_family == AF_INET6) {
+        memcpy(addr, &((struct sockaddr_in6 *)peer)->sin6_addr, 16);
+    } else {
+        return -1;
+    }
+    for(i = 0; i < 16; i++)
+        hash = (hash ^ addr[i]) * 16777619u;
+
+    for(i = 0; i < ADMIT_PROBES; i++) {
+        struct admit_client *c;
+        slot = (hash+i) & (ADMIT_CLIENTS-1);
+        c = &admit_clients[slot];
+        if(c->refilled_ms != 0 && memcmp(c->addr, addr, 16) == 0) {
+            admit_refill(c, now_ms);
+            return slot;
+        }
+        if(reuse == -1 && c->conns == 0) {
+            if(c->refilled_ms != 0)
+                admit_refill(c, now_ms);
+            if(c->refilled_ms == 0 || c->tokens == admit_burst*1000)
+                reuse = slot;
+        }
+    }
+    if(reuse == -1) {
+        admit_untracked++;
+        return -1;
+    }
+    memcpy(admit_clients[reuse].addr, addr, 16);
+    admit_clients[reuse].conns = 0;
+    admit_clients[reuse].tokens = admit_burst*1000;
+    admit_clients[reuse].refilled_ms = now_ms;
+    return reuse;
+}
+
+/****************************************************************************************/
+// A connection or request that can't be served is sent a canned reply and dropped, without
+// reading any more of it. If the socket can't take it straight away the client just sees a
+// close. TLS clients only see the close, as there is no handshake yet to send it over.
+static void session_reject(int socket, int status) {
+    static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+                               "Retry-After: 1\r\nConnection: close\r\n\r\n";
+    static const char slow_down[] = "HTTP/1.1 429 Too Many Requests\r\nContent-Length: 0\r\n"
+                                    "Retry-After: 1\r\nConnection: close\r\n\r\n";
+    const char *reply = status == 429 ? slow_down : busy;
+    size_t len = status == 429 ? sizeof(slow_down)-1 : sizeof(busy)-1;
+    if(tls_enabled)
+        return;
+    if(send(socket, reply, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0 && debug_level >= MINIWEB_DEBUG_ERRORS)
+        perror("send rejection");
+}
+
+// Called for each new connection. Returns 0 if the client already has too many open.
+static int admit_connection(struct miniweb_session *session) {
+    if(admit_max_conns == 0 && admit_rate == 0)
+        return 1;
+    session->admit_slot = admit_find(&session->peer, admit_now_ms());
+    if(session->admit_slot == -1)
+        return 1;
+    if(admit_max_conns != 0 && admit_clients[session->admit_slot].conns >= admit_max_conns) {
+        session->admit_slot = -1;
+        shed_counts[shed_connections]++;
+        return 0;
+    }
+    admit_clients[session->admit_slot].conns++;
+    return 1;
+}
+
+// Called for each request once its route is known, with the session that holds the
+// connection (for HTTP/2 it is not the request's). Returns 0 if the request can be run,
+// otherwise the status it is to be refused with.
+static int admit_request(struct miniweb_session *conn, struct miniweb_session *req) {
+    if(admit_rate != 0 && conn->admit_slot != -1) {
+        struct admit_client *c = &admit_clients[conn->admit_slot];
+        admit_refill(c, admit_now_ms());
+        if(c->tokens < 1000) {
+            shed_counts[shed_rate]++;
+            return 429;
+        }
+        c->tokens -= 1000;
+    }
+    if(admit_max_in_flight != 0 && requests_in_flight >= admit_max_in_flight) {
+        shed_counts[shed_in_flight]++;
+        return 503;
+    }
+    if(req->url != NULL && req->url->max_active != 0 && req->url->active >= req->url->max_active) {
+        shed_counts[shed_route]++;
+        return 503;
+    }
+    requests_in_flight++;
+    if(req->url != NULL)
+        req->url->active++;
+    req->admitted = 1;
+    return 0;
+}
+
+// The request has been answered (or abandoned)
+static void admit_request_done(struct miniweb_session *s) {
+    if(!s->admitted)
+        return;
+    s->admitted = 0;
+    requests_in_flight--;
+    if(s->url != NULL)
+        s->url->active--;
+}
+
+/****************************************************************************************/
+int miniweb_set_client_limits(unsigned max_connections, unsigned requests_per_sec, unsigned burst) {
+    if(requests_per_sec != 0 && burst == 0)
+        burst = requests_per_sec;
+    if(burst > 1000000)
+        return 0;
+    // Tokens held for the old settings mean nothing under the new ones
+    for(int i = 0; i < ADMIT_CLIENTS; i++) {
+        admit_clients[i].tokens = burst*1000;
+        admit_clients[i].refilled_ms = admit_clients[i].conns ? admit_clients[i].refilled_ms : 0;
+    }
+    admit_max_conns = max_connections;
+    admit_rate      = requests_per_sec;
+    admit_burst     = burst;
+    return 1;
+}
+
+/****************************************************************************************/
+int miniweb_set_max_in_flight(unsigned requests) {
+    admit_max_in_flight = requests;
+    return 1;
+}
+
+/****************************************************************************************/
+static void h2_free(struct miniweb_session *s);
+static void ws_free(struct miniweb_session *s);
+static void sse_free(struct miniweb_session *s);
+
+static void session_end(struct miniweb_session *session) {
+    ws_free(session);
+    sse_free(session);
+    outq_free(session);
+    h2_free(session);
+    if(session->socket != -1) {
+        session->transport->close(session);
+        while(close(session->socket) < 0 && errno == EINTR) {
+            miniweb_log_error(MINIWEB_ERR_CLOSE);
+        }
+        if(debug_level >= MINIWEB_DEBUG_ALL) 
+            fprintf(stderr,"SOCKET CLOSE\n");
+        session->socket = -1;
+        if(session->admit_slot != -1) {
+            admit_clients[session->admit_slot].conns--;
+            session->admit_slot = -1;
+        }
+        if(session->listener != NULL) {
+            session->listener->open--;
+            session->listener = NULL;
+        }
+    }
+    session_empty(session);
+}
+
+/****************************************************************************************/
+static void build_header_data(struct miniweb_session *s) {
+    struct reply_header *rh;
+    int rc_index;
+    char rc_str[100];
+    size_t header_len;
+    //TODO: This is really bad code - esp the malloc.
+
+    // Send HTTP response code
+ 
+    for(rc_index = sizeof(resp_codes)/sizeof(struct resp_code)-1; rc_index >= 0;  rc_index--) {
+        if(resp_codes[rc_index].number == s->response_code) {
+           break;
+        }
+    }
+    header_len = strlen(s->protocol);
+    if(rc_index < 0) {
+       sprintf(rc_str, " %i Unknown\r\n", s->response_code); 
+       header_len += strlen(rc_str);
+    } else {
+       header_len += strlen(resp_codes[rc_index].text);
+    }
+
+    rh = s->first_reply_header;
+    while(rh != NULL) {
+        header_len += strlen(rh->header);
+        header_len += 2;
+        header_len += strlen(rh->value);
+        header_len += 2;
+        rh = rh->next;
+    }
+    header_len += 2;
+    header_len += 1; // For the termating null
+
+    // Allocate the space
+    s->header_data = pool_alloc(header_len);
+    if(s->header_data == NULL) {
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        session_end(s);
+        return;
+    }
+    s->header_data_alloc = header_len;
+    s->header_data[0] = '\0';
+
+    // Now assemble the headers
+    strcpy(s->header_data, s->protocol);
+    if(rc_index < 0) {
+       strcat(s->header_data, rc_str);
+    } else {
+       strcat(s->header_data, resp_codes[rc_index].text);
+    }
+
+    rh = s->first_reply_header;
+    while(rh != NULL) {
+        strcat(s->header_data, rh->header);
+        strcat(s->header_data, ": ");
+        strcat(s->header_data, rh->value);
+        strcat(s->header_data, "\r\n");
+        rh = rh->next;
+    }
+    strcat(s->header_data, "\r\n");
+    s->header_data_size = strlen(s->header_data);
+    s->write_pointer = 0;
+}
+
+/****************************************************************************************/
+// Is 'token' one of the comma separated items in a header value?
+static int header_has_token(char *value, char *token) {
+    size_t len = strlen(token);
+    if(value == NULL)
+        return 0;
+    while(*value) {
+        while(*value == ' ' || *value == ',')
+            value++;
+        if(strncasecmp(value, token, len) == 0 && 
+           (value[len] == '\0' || value[len] == ',' || value[len] == ' ' || value[len] == ';'))
+            return 1;
+        while(*value && *value != ',')
+            value++;
+    }
+    return 0;
+}
+
+/****************************************************************************************/
+static char *reply_header_find(struct miniweb_session *session, char *header) {
+    struct reply_header *rh;
+    for(rh = session->first_reply_header; rh != NULL; rh = rh->next) {
+        if(strcasecmp(rh->header, header) == 0)
+            return rh->value;
+    }
+    return NULL;
+}
+
+/****************************************************************************************/
+// Work out if the connection can stay open after this reply, and say so in the headers
+static void session_keepalive_headers(struct miniweb_session *session) {
+    char *connection = miniweb_get_header(session, "Connection");
+    int http11 = strcmp(session->protocol, "HTTP/1.1") == 0;
+
+    session->keep_alive = 0;
+    if(keepalive_timeout_secs > 0) {
+        if(http11)
+            session->keep_alive = !header_has_token(connection, "close");
+        else if(strcmp(session->protocol, "HTTP/1.0") == 0)
+            session->keep_alive = header_has_token(connection, "keep-alive");
+    }
+    if(keepalive_max_requests > 0 && session->requests_served+1 >= keepalive_max_requests)
+        session->keep_alive = 0;
+    // The page handler can also ask for the connection to be closed
+    if(header_has_token(reply_header_find(session, "Connection"), "close"))
+        session->keep_alive = 0;
+
+    if(session->keep_alive) {
+        char buffer[40];
+        if(keepalive_max_requests > 0)
+            sprintf(buffer, "timeout=%i, max=%i", keepalive_timeout_secs, keepalive_max_requests-session->requests_served-1);
+        else
+            sprintf(buffer, "timeout=%i", keepalive_timeout_secs);
+        if(!http11)
+            miniweb_add_header(session, "Connection", "keep-alive");
+        miniweb_add_header(session, "Keep-Alive", buffer);
+    } else {
+        miniweb_add_header(session, "Connection", "close");
+    }
+}
+
+/****************************************************************************************/
+// Cut a 200 reply to GET down to the single byte range asked for, if there is one. Body
+// data is moved down in the reply buffer, but shared data is only ever sent from an offset.
+static void session_apply_range(struct miniweb_session *s) {
+    size_t total = s->data_used + s->shared_data_size;
+    size_t first, last;
+    char *range, *if_range, *end;
+    char buffer[80];
+
+    if(s->response_code != 200 || strcmp(s->method, "GET") != 0 || s->compress_state == 1)
+        return;
+    miniweb_add_header(s, "Accept-Ranges", "bytes");
+
+    range = miniweb_get_header(s, "Range");
+    if(range == NULL || strncmp(range, "bytes=", 6) != 0)
+        return;
+    // Multiple ranges are not supported, so just send it all
+    if(strchr(range, ',') != NULL)
+        return;
+
+    // Only resume if the client's copy is the same version as ours
+    if_range = miniweb_get_header(s, "If-Range");
+    if(if_range != NULL) {
+        char *etag = reply_header_find(s, "ETag");
+        char *modified = reply_header_find(s, "Last-Modified");
+        int match = 0;
+        if(etag != NULL && etag[0] == '"' && strcmp(if_range, etag) == 0)
+            match = 1;
+        if(modified != NULL && strcmp(if_range, modified) == 0)
+            match = 1;
+        if(!match)
+            return;
+    }
+
+    range += 6;
+    if(*range == '-') {
+        // The last n bytes
+        size_t suffix = strtoull(range+1, &end, 10);
+        if(end == range+1 || *end != '\0')
+            return;
+        if(suffix > total)
+            suffix = total;
+        first = total-suffix;
+        last  = total-1;
+        if(suffix == 0)
+            first = total;    // Can't be satisfied
+    } else {
+        first = strtoull(range, &end, 10);
+        if(end == range || *end != '-')
+            return;
+        range = end+1;
+        if(*range == '\0') {
+            last = total-1;
+        } else {
+            last = strtoull(range, &end, 10);
+            if(*end != '\0' || last < first)
+                return;
+            if(last >= total)
+                last = total-1;
+        }
+    }
+
+    if(first >= total) {
+        s->response_code = 416;
+        sprintf(buffer, "bytes */%zu", total);
+        miniweb_add_header(s, "Content-Range", buffer);
+        s->data_used = 0;
+        miniweb_shared_data_buffer(s, NULL, 0);
+        return;
+    }
+
+    s->response_code = 206;
+    sprintf(buffer, "bytes %zu-%zu/%zu", first, last, total);
+    miniweb_add_header(s, "Content-Range", buffer);
+
+    // The part of the range that is in the reply buffer
+    if(first < s->data_used) {
+        size_t data_end = last+1 < s->data_used ? last+1 : s->data_used;
+        memmove(s->data, s->data+first, data_end-first);
+        s->data_used = data_end-first;
+    } else {
+        s->data_used = 0;
+    }
+    // ...and the part in the shared data
+    if(last+1 > total-s->shared_data_size) {
+        size_t shared_first = first > total-s->shared_data_size ? first-(total-s->shared_data_size) : 0;
+        size_t shared_end   = last+1-(total-s->shared_data_size);
+        if(s->shared_data != NULL)
+            s->shared_data += shared_first;
+        s->shared_file_offset += shared_first;
+        s->shared_data_size = shared_end-shared_first;
+    } else {
+        s->shared_data_size = 0;
+    }
+}
+
+/****************************************************************************************/
+// Run the page handler and finish off the reply, ready to be sent on any protocol
+static void session_build_reply(struct miniweb_session *session) {
+    // Set the default headers (can be overwritten)
+    miniweb_add_header(session, "Server","Miniweb/0.0.1 (Linux)");
+    miniweb_add_header(session, "Content-Type","text/html");
+
+    // Now process the request
+    if(session->refused == 429 || session->refused == 503) {
+        // Turned away by admission control, so the handler isn't run
+        session->response_code = session->refused;
+        miniweb_add_header(session, "Retry-After", "1");
+    } else if(session->refused) {
+        // The body can't be read, so the rest of it can only be got rid of by closing
+        session->response_code = session->refused;
+        miniweb_add_header(session, "Connection", "close");
+    } else if(session->url) {
+        session->response_code = 500;      // Default response code
+
+        // TODO Add date header 
+        // Date: Mon, 27 Jul 2009 12:28:53 GMT
+
+        // Do the user portion of the request
+        if(session->url->websocket) {
+            // Only reached by requests that can't be upgraded
+            session->response_code = 426;
+            miniweb_add_header(session, "Upgrade", "websocket");
+            miniweb_add_header(session, "Sec-WebSocket-Version", "13");
+        } else if(session->url->callback) {
+            trace_mark(session, tp_handler_start);
+            session->url->callback(session);
+            trace_mark(session, tp_handler_end);
+        }
+    } else {
+        session->response_code = 404;
+        miniweb_write(session,"Page not found\n",14);
+    }
+
+    // Flush out any compressed data, so the length below is of what goes on the wire
+    compress_finish(session);
+    // Sending what was stored of a reply that didn't fit would pass it off as the whole
+    if(session->reply_failed) {
+        session->data_used = 0;
+        session->response_code = 500;
+        miniweb_shared_data_buffer(session, NULL, 0);
+    }
+    session_apply_range(session);
+
+    // Add the content length header - overwrite any already queued to send
+    char buffer[21];
+    sprintf(buffer,"%zu",session->data_used + session->shared_data_size);
+    miniweb_add_header(session, "Content-Length",buffer);
+}
+
+/****************************************************************************************/
+static int ws_handshake(struct miniweb_session *session);
+static int sse_subscribe(struct miniweb_session *session);
+
+static void session_send_reply(struct miniweb_session *session) {
+    int shed = admit_request(session, session);
+    if(shed) {
+        session_reject(session->socket, shed);
+        session_end(session);
+        return;
+    }
+    if(session->url && session->url->websocket && ws_handshake(session))
+        return;
+    if(session->url && session->url->sse_topic && sse_subscribe(session))
+        return;
+    session_build_reply(session);
+    session_keepalive_headers(session);
+
+    build_header_data(session);
+    if(session->socket != -1)
+        session->io_state = io_writing_headers;
+}
+
+/****************************************************************************************/
+int miniweb_set_keepalive(int idle_secs, int max_requests) {
+    if(idle_secs < 0 || max_requests < 0)
+        return 0;
+    keepalive_timeout_secs = idle_secs;
+    keepalive_max_requests = max_requests;
+    return 1;
+}
+
+/****************************************************************************************/
+int miniweb_set_max_body(size_t bytes) {
+#ifdef MINIWEB_STATIC
+    if(bytes > MINIWEB_STATIC_CONTENT)
+        return 0;
+#endif
+    if(bytes >= INT_MAX)
+        return 0;
+    max_body_size = bytes;
+    return 1;
+}
+
+/****************************************************************************************/
+int miniweb_register_page(char *method, char *url, void (*callback)(struct miniweb_session *)) {
+   struct url_reg *new_url;
+   int url_len = strlen(url);
+
+   // We need the Content-Length header to process POST commands
+   if(strcmp(method,"POST")==0) {
+      if(!miniweb_listen_header("Content-Length")) {
+         return 0;
+      }
+   }
+
+   // Allocate new
+   new_url = mem_alloc(sizeof(struct url_reg), MINIWEB_MEM_CONFIG);
+   if(new_url == NULL) {
+      return miniweb_log_error(MINIWEB_ERR_NOMEM);
+   }
+
+   // Populate fields   
+   new_url->next = NULL;
+   new_url->method = mem_alloc(strlen(method)+1, MINIWEB_MEM_CONFIG);
+   if(new_url->method == NULL) {
+      mem_free(new_url);
+      return miniweb_log_error(MINIWEB_ERR_NOMEM);
+   }
+   strcpy(new_url->method, method);
+
+   int start;
+   for(start = 0; start < url_len; start++) {
+     if(url[start] == '*')
+        break;
+   }
+
+   new_url->pattern_start = mem_alloc(start+1, MINIWEB_MEM_CONFIG);
+   if(new_url->pattern_start == NULL) {
+      mem_free(new_url->method);
+      mem_free(new_url);
+      return miniweb_log_error(MINIWEB_ERR_NOMEM);
+   }
+   if(start > 0) 
+     memcpy(new_url->pattern_start, url, start);
+   new_url->pattern_start[start] = '\0';
+   new_url->pattern_start_len = strlen(new_url->pattern_start);
+
+   if(start == url_len) {
+      new_url->pattern_end = NULL;
+      new_url->pattern_end_len = 0;
+   } else {
+      start++; // Skip the '*' before having the end pattern
+      new_url->pattern_end = mem_alloc(url_len-start+1, MINIWEB_MEM_CONFIG);
+      if(new_url->pattern_end==NULL)
+         return miniweb_log_error(MINIWEB_ERR_NOMEM);
+
+      if(url_len-start > 0) 
+         memcpy(new_url->pattern_end, url+start, url_len-start);
+      new_url->pattern_end[url_len-start] = '\0';
+      new_url->pattern_end_len = strlen(new_url->pattern_end);
+   }
+   
+   new_url->data_sent_metric = 0;
+   new_url->request_count_metric = 0;
+   new_url->request_count = 0;
+   new_url->callback = callback;
+   new_url->request_time.tv_nsec = 0;
+   new_url->request_time.tv_sec = 0;
+   new_url->latency = NULL;
+   new_url->bytes_sent = 0;
+   memset(new_url->response_counts, 0, sizeof(new_url->response_counts));
+   new_url->no_compress = 0;
+   new_url->websocket = 0;
+   new_url->ws_open = NULL;
+   new_url->ws_message = NULL;
+   new_url->ws_close = NULL;
+   new_url->sse_topic = NULL;
+   new_url->max_active = 0;
+   new_url->active = 0;
+   for(int c = 0; c <= POOL_CLASSES; c++)
+      new_url->size_history[c] = 0;
+   new_url->size_history_total = 0;
+
+   // TODO Add in correct order for filtering
+   new_url->next = first_url_reg;
+   first_url_reg = new_url;
+   return 1;
+}
+
+/****************************************************************************************/
+// Find a registration by the same method and URL pattern that it was registered with
+static struct url_reg *url_reg_find(char *method, char *url) {
+   struct url_reg *ur;
+   size_t len = strlen(url);
+   for(ur = first_url_reg; ur != NULL; ur = ur->next) {
+      if(strcmp(ur->method, method) != 0)
+         continue;
+      if(ur->pattern_end == NULL) {
+         if(strcmp(ur->pattern_start, url) == 0)
+            return ur;
+      } else if(len == ur->pattern_start_len+1+ur->pattern_end_len
+             && memcmp(url, ur->pattern_start, ur->pattern_start_len) == 0
+             && url[ur->pattern_start_len] == '*'
+             && strcmp(url+ur->pattern_start_len+1, ur->pattern_end) == 0) {
+         return ur;
+      }
+   }
+   return NULL;
+}
+
+/****************************************************************************************/
+int miniweb_page_compression(char *method, char *url, int enable) {
+   struct url_reg *ur = url_reg_find(method, url);
+   if(ur == NULL)
+      return 0;
+   ur->no_compress = !enable;
+   return 1;
+}
+
+/****************************************************************************************/
+int miniweb_set_route_limit(char *method, char *url, unsigned max_active) {
+   struct url_reg *ur = url_reg_find(method, url);
+   if(ur == NULL)
+      return 0;
+   ur->max_active = max_active;
+   return 1;
+}
+/****************************************************************************************/
+size_t miniweb_shared_data_buffer(struct miniweb_session *session, void *data, size_t len) {
+    // Overwrite any existing shared data with this one
+    if(session->shared_blob) {
+        miniweb_blob_unref(session->shared_blob);
+        session->shared_blob = NULL;
+    }
+    if(session->shared_fd != -1) {
+        close(session->shared_fd);
+        session->shared_fd = -1;
+    }
+    session->shared_data      = data;
+    session->shared_data_size = len;
+    return len;
+}
+
+/****************************************************************************************/
+// Send a file as the shared data. It is sent with sendfile(), so never copied into miniweb,
+// and Last-Modified and ETag headers are added so clients can resume with If-Range.
+size_t miniweb_shared_file(struct miniweb_session *session, char *filename) {
+    struct stat st;
+    char buffer[64];
+    int fd;
+
+    miniweb_shared_data_buffer(session, NULL, 0);
+    fd = open(filename, O_RDONLY);
+    if(fd == -1)
+        return 0;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return 0;
+    }
+    session->shared_fd          = fd;
+    session->shared_file_offset = 0;
+    session->shared_data_size   = st.st_size;
+
+    strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&st.st_mtime));
+    miniweb_add_header(session, "Last-Modified", buffer);
+    sprintf(buffer, "\"%lx-%lx\"", (unsigned long)st.st_mtime, (unsigned long)st.st_size);
+    miniweb_add_header(session, "ETag", buffer);
+    return st.st_size;
+}
+
+/****************************************************************************************/
+size_t miniweb_shared_blob(struct miniweb_session *session, struct miniweb_blob *blob) {
+    if(blob == NULL)
+        return miniweb_shared_data_buffer(session, NULL, 0);
+
+    // Take our reference first, in case this is the blob already attached
+    miniweb_blob_ref(blob);
+    miniweb_shared_data_buffer(session, blob->data, blob->size);
+    session->shared_blob = blob;
+    return blob->size;
+}
+
+/****************************************************************************************/
+size_t miniweb_write(struct miniweb_session *session, void *data, size_t len) {
+    if(len == 0)
+       return 0;
+
+    if(session->compress_state == 0 && compress_level > 0 && session->data_used+len >= compress_threshold)
+       compress_start(session);
+    if(session->compress_state == 1 || session->compress_state == -2)
+       return compress_write(session, data, len);
+
+    if(!session_data_reserve(session, len))
+       return 0;
+    memcpy(session->data+session->data_used, data, len);
+    session->data_used += len;
+    return len;
+}
+
+/****************************************************************************************/
+// Templates. The text is compiled once into literal segments, each followed by a slot,
+// with the literals kept end to end in a blob. Rendering works out the exact size first,
+// so the reply buffer grows at most once, and then writes straight into it.
+/****************************************************************************************/
+enum template_kind_e { tk_escaped, tk_raw, tk_number };
+
+struct template_part {
+   size_t offset;                      // Literal text in the blob...
+   size_t len;
+   int    slot;                        // ...followed by this slot, or -1 at the end
+   char   kind;
+};
+
+struct miniweb_template {
+   struct miniweb_blob *text;
+   struct template_part *parts;
+   int    part_count;
+   char   **slot_names;
+   int    slot_count;
+   size_t literal_bytes;
+};
+
+/****************************************************************************************/
+// Format a number into 'out', which must have room for 20 characters. Returns the length.
+static size_t format_ll(char *out, long long value) {
+    char digits[20];
+    unsigned long long v = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    size_t n = 0, len = 0;
+    do {
+        digits[n++] = '0' + v%10;
+        v /= 10;
+    } while(v != 0);
+    if(value < 0)
+        out[len++] = '-';
+    while(n > 0)
+        out[len++] = digits[--n];
+    return len;
+}
+
+// The length of 'text' once HTML escaped
+static size_t html_escaped_len(const char *text) {
+    size_t len = 0;
+    for(; *text != '\0'; text++) {
+        switch(*text) {
+            case '&':  len += 5; break;
+            case '<':  len += 4; break;
+            case '>':  len += 4; break;
+            case '"':  len += 6; break;
+            case '\'': len += 5; break;
+            default:   len++;    break;
+        }
+    }
+    return len;
+}
+
+// Escape 'text' into 'out', which must have room for html_escaped_len(text) characters
+static size_t html_escape(char *out, const char *text) {
+    char *p = out;
+    for(; *text != '\0'; text++) {
+        switch(*text) {
+            case '&':  memcpy(p, "&amp;", 5);  p += 5; break;
+            case '<':  memcpy(p, "&lt;", 4);   p += 4; break;
+            case '>':  memcpy(p, "&gt;", 4);   p += 4; break;
+            case '"':  memcpy(p, "&quot;", 6); p += 6; break;
+            case '\'': memcpy(p, "&#39;", 5);  p += 5; break;
+            default:   *p++ = *text;           break;
+        }
+    }
+    return p-out;
+}
+
+/****************************************************************************************/
+void miniweb_template_free(struct miniweb_template *t) {
+    if(t == NULL)
+        return;
+    // Sessions still sending a shared tail hold their own reference on the text
+    miniweb_blob_unref(t->text);
+    for(int i = 0; i < t->slot_count; i++)
+        mem_free(t->slot_names[i]);
+    mem_free(t->slot_names);
+    mem_free(t->parts);
+    mem_free(t);
+}
+
+/****************************************************************************************/
+// Slots are "{{name}}" for HTML escaped text, "{{{name}}}" for raw text and "{{name:int}}"
+// for a number. A name can appear more than once, and is numbered by its first appearance.
+struct miniweb_template *miniweb_template_compile(char *source) {
+    struct miniweb_template *t;
+    size_t source_len = strlen(source);
+    char *p, *text;
+    int max_parts = 1;
+
+    for(p = strstr(source, "{{"); p != NULL; p = strstr(p+2, "{{"))
+        max_parts++;
+    t = mem_calloc(sizeof(struct miniweb_template), MINIWEB_MEM_CONFIG);
+    if(t == NULL) {
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+    t->text = miniweb_blob_new(source_len);
+    t->parts = mem_alloc(sizeof(struct template_part)*max_parts, MINIWEB_MEM_CONFIG);
+    t->slot_names = mem_alloc(sizeof(char *)*max_parts, MINIWEB_MEM_CONFIG);
+    if(t->text == NULL || t->parts == NULL || t->slot_names == NULL) {
+        miniweb_template_free(t);
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+
+    text = t->text->data;
+    p = source;
+    for(;;) {
+        struct template_part *part = &t->parts[t->part_count++];
+        char *open = strstr(p, "{{"), *name, *end;
+        size_t name_len;
+        int raw;
+
+        // The literal up to the slot, or to the end
+        part->offset = t->literal_bytes;
+        part->len    = open ? (size_t)(open-p) : strlen(p);
+        part->slot   = -1;
+        memcpy(text+part->offset, p, part->len);
+        t->literal_bytes += part->len;
+        if(open == NULL)
+            break;
+
+        raw  = open[2] == '{';
+        name = open+2+raw;
+        end  = strstr(name, raw ? "}}}" : "}}");
+        if(end == NULL)
+            break;
+        while(*name == ' ')
+            name++;
+        name_len = end-name;
+        while(name_len > 0 && name[name_len-1] == ' ')
+            name_len--;
+        part->kind = raw ? tk_raw : tk_escaped;
+        if(!raw && name_len > 4 && memcmp(name+name_len-4, ":int", 4) == 0) {
+            part->kind = tk_number;
+            name_len -= 4;
+        }
+        if(name_len == 0)
+            break;
+        for(part->slot = 0; part->slot < t->slot_count; part->slot++) {
+            if(strlen(t->slot_names[part->slot]) == name_len && memcmp(t->slot_names[part->slot], name, name_len) == 0)
+                break;
+        }
+        if(part->slot == t->slot_count) {
+            char *copy = mem_alloc(name_len+1, MINIWEB_MEM_CONFIG);
+            if(copy == NULL) {
+                miniweb_template_free(t);
+                miniweb_log_error(MINIWEB_ERR_NOMEM);
+                return NULL;
+            }
+            memcpy(copy, name, name_len);
+            copy[name_len] = '\0';
+            t->slot_names[t->slot_count++] = copy;
+        }
+        p = end+2+raw;
+    }
+    if(t->parts[t->part_count-1].slot != -1 || strstr(p, "{{") != NULL) {
+        // A slot that isn't closed, or has no name
+        miniweb_template_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+/****************************************************************************************/
+struct miniweb_template *miniweb_template_load(char *filename) {
+    struct miniweb_template *t;
+    struct stat st;
+    char *source;
+    FILE *f = fopen(filename, "rb");
+    if(f == NULL)
+        return NULL;
+    if(fstat(fileno(f), &st) != 0 || (source = mem_alloc(st.st_size+1, MINIWEB_MEM_OTHER)) == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    if(fread(source, 1, st.st_size, f) != (size_t)st.st_size) {
+        mem_free(source);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    source[st.st_size] = '\0';
+    t = miniweb_template_compile(source);
+    mem_free(source);
+    return t;
+}
+
+/****************************************************************************************/
+int miniweb_template_slot(struct miniweb_template *t, char *name) {
+    for(int i = 0; i < t->slot_count; i++) {
+        if(strcmp(t->slot_names[i], name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/****************************************************************************************/
+int miniweb_template_render(struct miniweb_session *session, struct miniweb_template *t,
+                            union miniweb_template_value *values, int flags) {
+    struct template_part *tail = NULL;
+    size_t total = t->literal_bytes;
+    char *out;
+    int i;
+
+    // A literal at the end can be sent from the template itself, if nothing else is shared
+    if((flags & MINIWEB_TEMPLATE_SHARE_TAIL) && t->parts[t->part_count-1].len > 0 &&
+       session->shared_data == NULL && session->shared_fd == -1) {
+        tail = &t->parts[t->part_count-1];
+        total -= tail->len;
+    }
+    for(i = 0; i < t->part_count; i++) {
+        struct template_part *part = &t->parts[i];
+        char *text = part->slot == -1 ? NULL : values[part->slot].text;
+        if(part->slot == -1)
+            continue;
+        if(part->kind == tk_number)
+            total += 20;
+        else if(text != NULL)
+            total += part->kind == tk_raw ? strlen(text) : html_escaped_len(text);
+    }
+
+    if(session->compress_state == 1 || session->compress_state == -2 ||
+       (session->compress_state == 0 && compress_level > 0 && session->data_used+total >= compress_threshold)) {
+        // Compressed replies are built a piece at a time, as the output size isn't known
+        for(i = 0; i < t->part_count; i++) {
+            struct template_part *part = &t->parts[i];
+            char *text = part->slot == -1 ? NULL : values[part->slot].text;
+            char buffer[256];
+            if(part != tail)
+                miniweb_write(session, t->text->data+part->offset, part->len);
+            if(part->slot == -1)
+                continue;
+            if(part->kind == tk_number) {
+                miniweb_write(session, buffer, format_ll(buffer, values[part->slot].number));
+            } else if(text != NULL && part->kind == tk_raw) {
+                miniweb_write(session, text, strlen(text));
+            } else if(text != NULL) {
+                // Escaped a little at a time, as each character grows by at most six times
+                while(*text != '\0') {
+                    char piece[sizeof(buffer)/6+1];
+                    size_t n = strlen(text);
+                    if(n > sizeof(piece)-1)
+                        n = sizeof(piece)-1;
+                    memcpy(piece, text, n);
+                    piece[n] = '\0';
+                    miniweb_write(session, buffer, html_escape(buffer, piece));
+                    text += n;
+                }
+            }
+        }
+    } else {
+        if(total > 0 && !session_data_reserve(session, total))
+            return 0;
+        out = session->data+session->data_used;
+        for(i = 0; i < t->part_count; i++) {
+            struct template_part *part = &t->parts[i];
+            char *text = part->slot == -1 ? NULL : values[part->slot].text;
+            if(part != tail) {
+                memcpy(out, t->text->data+part->offset, part->len);
+                out += part->len;
+            }
+            if(part->slot == -1)
+                continue;
+            if(part->kind == tk_number) {
+                out += format_ll(out, values[part->slot].number);
+            } else if(text != NULL && part->kind == tk_raw) {
+                size_t len = strlen(text);
+                memcpy(out, text, len);
+                out += len;
+            } else if(text != NULL) {
+                out += html_escape(out, text);
+            }
+        }
+        session->data_used = out-session->data;
+    }
+
+    if(tail != NULL) {
+        miniweb_blob_ref(t->text);
+        miniweb_shared_data_buffer(session, t->text->data+tail->offset, tail->len);
+        session->shared_blob = t->text;
+    }
+    return 1;
+}
+
+/****************************************************************************************/
+// Formatted output. Text is formatted in place in the spare room at the end of the reply
+// buffer, which is only grown if it doesn't fit. Compressed replies need it copied into
+// the deflate stream, so for them it goes through miniweb_write().
+/****************************************************************************************/
+// Room for 'len' more bytes of reply body, to be written in place, or NULL if it has to
+// go through miniweb_write() instead
+static char *session_out_start(struct miniweb_session *session, size_t len) {
+    if(session->compress_state == 1 || session->compress_state == -2 || !session_data_reserve(session, len))
+        return NULL;
+    return session->data+session->data_used;
+}
+
+// 'len' bytes have been written in place
+static void session_out_end(struct miniweb_session *session, size_t len) {
+    session->data_used += len;
+    if(session->compress_state == 0 && compress_level > 0 && session->data_used >= compress_threshold)
+        compress_start(session);
+}
+
+/****************************************************************************************/
+size_t miniweb_printf(struct miniweb_session *session, char *format, ...) {
+    va_list args;
+    char buffer[256], *out;
+    size_t room;
+    int len;
+
+    out = session_out_start(session, 64);
+    if(out != NULL) {
+        room = session->data_size-session->data_used;
+        va_start(args, format);
+        len = vsnprintf(out, room, format, args);
+        va_end(args);
+        if(len < 0)
+            return 0;
+        if((size_t)len >= room) {
+            // Didn't fit, but now the size is known
+            if((out = session_out_start(session, len+1)) == NULL)
+                return 0;
+            va_start(args, format);
+            vsnprintf(out, len+1, format, args);
+            va_end(args);
+        }
+        session_out_end(session, len);
+        return len;
+    }
+
+    if(session->compress_state != 1)
+        return 0;    // Out of memory
+    va_start(args, format);
+    len = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    if(len < 0)
+        return 0;
+    if((size_t)len < sizeof(buffer))
+        return miniweb_write(session, buffer, len);
+    // Too long for the stack, so it needs a buffer of its own
+    out = mem_alloc(len+1, MINIWEB_MEM_OTHER);
+    if(out == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    va_start(args, format);
+    vsnprintf(out, len+1, format, args);
+    va_end(args);
+    len = miniweb_write(session, out, len);
+    mem_free(out);
+    return len;
+}
+
+/****************************************************************************************/
+// Streaming JSON. Commas and colons are added as values go in, so a reply is built with
+// one call per value and nothing is kept but a bit for each open object or array.
+/****************************************************************************************/
+#define JSON_MAX_DEPTH 64
+
+static int json_put(struct miniweb_session *session, const char *text, size_t len) {
+    char *out = session_out_start(session, len);
+    if(out == NULL)
+        return miniweb_write(session, (void *)text, len) == len;
+    memcpy(out, text, len);
+    session_out_end(session, len);
+    return 1;
+}
+
+// Called before each value, and each key, to separate it from the one before
+static int json_separate(struct miniweb_session *session) {
+    unsigned long long bit;
+    if(session->json_after_key) {
+        session->json_after_key = 0;
+        return 1;
+    }
+    if(session->json_depth == 0)
+        return 1;
+    bit = 1ULL << (session->json_depth-1);
+    if(session->json_items & bit)
+        return json_put(session, ",", 1);
+    session->json_items |= bit;
+    return 1;
+}
+
+static int json_open(struct miniweb_session *session, const char *bracket) {
+    if(session->json_depth == JSON_MAX_DEPTH || !json_separate(session) || !json_put(session, bracket, 1))
+        return 0;
+    session->json_depth++;
+    session->json_items &= ~(1ULL << (session->json_depth-1));
+    return 1;
+}
+
+static int json_close(struct miniweb_session *session, const char *bracket) {
+    if(session->json_depth == 0 || session->json_after_key)
+        return 0;
+    session->json_depth--;
+    return json_put(session, bracket, 1);
+}
+
+// The length of 'text' once escaped for a JSON string, without the quotes
+static size_t json_escaped_len(const char *text) {
+    size_t len = 0;
+    for(; *text != '\0'; text++) {
+        unsigned char c = *text;
+        if(c == '"' || c == '\\' || c == '\n' || c == '\r' || c == '\t' || c == '\b' || c == '\f')
+            len += 2;
+        else if(c < 0x20)
+            len += 6;
+        else
+            len++;
+    }
+    return len;
+}
+
+// Escape 'text' into 'out', which must have room for json_escaped_len(text) characters
+static size_t json_escape(char *out, const char *text) {
+    static const char hex[] = "0123456789abcdef";
+    char *p = out;
+    for(; *text != '\0'; text++) {
+        unsigned char c = *text;
+        switch(c) {
+            case '"':  *p++ = '\\'; *p++ = '"';  break;
+            case '\\': *p++ = '\\'; *p++ = '\\'; break;
+            case '\n': *p++ = '\\'; *p++ = 'n';  break;
+            case '\r': *p++ = '\\'; *p++ = 'r';  break;
+            case '\t': *p++ = '\\'; *p++ = 't';  break;
+            case '\b': *p++ = '\\'; *p++ = 'b';  break;
+            case '\f': *p++ = '\\'; *p++ = 'f';  break;
+            default:
+                if(c < 0x20) {
+                    memcpy(p, "\\u00", 4);
+                    p[4] = hex[c >> 4];
+                    p[5] = hex[c & 15];
+                    p += 6;
+                } else {
+                    *p++ = c;
+                }
+                break;
+        }
+    }
+    return p-out;
+}
+
+static int json_put_string(struct miniweb_session *session, const char *text) {
+    size_t len = json_escaped_len(text);
+    char *out = session_out_start(session, len+2);
+    if(out != NULL) {
+        out[0] = '"';
+        json_escape(out+1, text);
+        out[len+1] = '"';
+        session_out_end(session, len+2);
+        return 1;
+    }
+    // Escaped a little at a time, as each character grows by at most six times
+    if(!json_put(session, "\"", 1))
+        return 0;
+    while(*text != '\0') {
+        char piece[43], buffer[6*sizeof(piece)];
+        size_t n = strlen(text);
+        if(n > sizeof(piece)-1)
+            n = sizeof(piece)-1;
+        memcpy(piece, text, n);
+        piece[n] = '\0';
+        if(!json_put(session, buffer, json_escape(buffer, piece)))
+            return 0;
+        text += n;
+    }
+    return json_put(session, "\"", 1);
+}
+
+/****************************************************************************************/
+int miniweb_json_object_start(struct miniweb_session *session) {
+    return json_open(session, "{");
+}
+
+int miniweb_json_object_end(struct miniweb_session *session) {
+    return json_close(session, "}");
+}
+
+int miniweb_json_array_start(struct miniweb_session *session) {
+    return json_open(session, "[");
+}
+
+int miniweb_json_array_end(struct miniweb_session *session) {
+    return json_close(session, "]");
+}
+
+/****************************************************************************************/
+int miniweb_json_key(struct miniweb_session *session, char *key) {
+    if(session->json_after_key || !json_separate(session) || !json_put_string(session, key) || !json_put(session, ":", 1))
+        return 0;
+    session->json_after_key = 1;
+    return 1;
+}
+
+/****************************************************************************************/
+int miniweb_json_null(struct miniweb_session *session) {
+    return json_separate(session) && json_put(session, "null", 4);
+}
+
+/****************************************************************************************/
+int miniweb_json_string(struct miniweb_session *session, char *value) {
+    if(value == NULL)
+        return miniweb_json_null(session);
+    return json_separate(session) && json_put_string(session, value);
+}
+
+/****************************************************************************************/
+int miniweb_json_int(struct miniweb_session *session, long long value) {
+    char buffer[20];
+    return json_separate(session) && json_put(session, buffer, format_ll(buffer, value));
+}
+
+/****************************************************************************************/
+// Whole numbers are common (counts, sizes, times), so take the integer path when it is
+// exact. Anything else gets the 17 significant digits that always read back the same.
+int miniweb_json_double(struct miniweb_session *session, double value) {
+    char buffer[32];
+    size_t len;
+    if(value != value || value-value != 0)
+        return miniweb_json_null(session);     // NaN and the infinities aren't JSON
+    if(value > -1e15 && value < 1e15 && value == (double)(long long)value)
+        len = format_ll(buffer, (long long)value);
+    else {
+        // The fewest digits that read back as the same double, so 0.1 isn't 0.10000000000000001.
+        // %g drops trailing zeros, so for normal doubles 15 digits give the shortest text.
+        // Subnormals hold fewer digits, so they start from one.
+        int precision = (value > -DBL_MIN && value < DBL_MIN) ? 1 : 15;
+        for(; precision < 17; precision++) {
+            len = sprintf(buffer, "%.*g", precision, value);
+            if(strtod(buffer, NULL) == value)
+                break;
+        }
+        if(precision == 17)
+            len = sprintf(buffer, "%.17g", value);
+    }
+    return json_separate(session) && json_put(session, buffer, len);
+}
+
+/****************************************************************************************/
+int miniweb_json_bool(struct miniweb_session *session, int value) {
+    return json_separate(session) && json_put(session, value ? "true" : "false", value ? 4 : 5);
+}
+
+/****************************************************************************************/
+int miniweb_add_header(struct miniweb_session *session, char *header, char *value) {
+    struct reply_header *rh;
+    rh = session->first_reply_header;
+    while(rh != NULL) {
+        if(strcmp(rh->header, header) == 0) {
+            // No change needed?
+            if(strcmp(rh->value,value)==0) 
+                return 1;
+ 
+            // Replace value
+            char *v = mem_alloc(strlen(value)+1, MINIWEB_MEM_HEADER);
+            if(v == NULL) 
+                return miniweb_log_error(MINIWEB_ERR_NOMEM);
+            strcpy(v, value);
+            mem_free(rh->value);
             rh->value = v; 
             return 1;
         }
-        rh = rh->next;
+        rh = rh->next;
+    }
+
+#ifdef MINIWEB_STATIC
+    int slots = 0;
+    for(rh = session->first_reply_header; rh != NULL; rh = rh->next) {
+        if(++slots == MINIWEB_STATIC_HEADERS)
+            return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    }
+#endif
+
+    // Allocate the structure
+    rh = mem_alloc(sizeof(struct reply_header), MINIWEB_MEM_HEADER);
+    if(rh == NULL) {
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    }
+
+    // Populate the structure
+    rh->next = NULL; 
+    rh->header = mem_alloc(strlen(header)+1, MINIWEB_MEM_HEADER);
+    if(rh->header == NULL) {
+        mem_free(rh);
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    }
+    rh->value = mem_alloc(strlen(value)+1, MINIWEB_MEM_HEADER);
+    if(rh->value == NULL) {
+        mem_free(rh->header);
+        mem_free(rh);
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    }
+    strcpy(rh->header,header);
+    strcpy(rh->value,value);
+
+    // Adding the first header? If so, add at state
+    if(session->first_reply_header == NULL) {
+        session->first_reply_header = rh;
+    } else {
+        // Add at the end of the list (so they go out in order)
+        struct reply_header *h;
+        h = session->first_reply_header;
+        while(h->next != NULL) {
+            h = h->next;
+        }
+        h->next = rh;
+    }
+    return 1;
+}
+
+/****************************************************************************************/
+char *miniweb_get_header(struct miniweb_session *session, char *header) {
+    struct request_header *h = session->first_request_header;
+    while(h != NULL) {
+      if(strcmp(header,h->header)==0) {
+         return h->value;
+      }
+      h = h->next;
+    }
+    return NULL;
+}
+
+/****************************************************************************************/
+// A Content-Length is digits and nothing else, bar trailing spaces. Returns -1 if it isn't
+// one. Anything too big for an int is far over any body size limit, so becomes INT_MAX.
+static int content_length_parse(const char *value) {
+   long long length;
+   char *end;
+   if(!isdigit((unsigned char)*value))
+      return -1;
+   errno = 0;
+   length = strtoll(value, &end, 10);
+   while(*end == ' ' || *end == '\t')
+      end++;
+   if(*end != '\0')
+      return -1;
+   if(errno == ERANGE || length > INT_MAX)
+      return INT_MAX;
+   return length;
+}
+
+/****************************************************************************************/
+// Where a request's body ends has to be certain, or the rest of it would be read as the
+// next request on the connection. Returns 0, with the status it is refused with set, if
+// the body can't be framed or is too big to take.
+static int session_check_framing(struct miniweb_session *session) {
+   struct request_header *h;
+   int length = -1;
+
+   if(miniweb_get_header(session, "Transfer-Encoding") != NULL) {
+      session->refused = 501;    // Chunked bodies aren't supported
+      return 0;
+   }
+   for(h = session->first_request_header; h != NULL; h = h->next) {
+      if(strcmp(h->header, "Content-Length") == 0) {
+         int l = content_length_parse(h->value);
+         if(l == -1 || (length != -1 && l != length)) {
+            session->refused = 400;
+            return 0;
+         }
+         length = l;
+      }
+   }
+   session->content_length = length;
+   if(length > max_body_size) {
+      session->refused = 413;
+      return 0;
+   }
+   return 1;
+}
+
+/****************************************************************************************/
+int miniweb_content_length(struct miniweb_session *session) {
+   if(session->content_length == -1) {
+      char *length_string = miniweb_get_header(session, "Content-Length");
+      if(length_string == NULL) {
+         if(debug_level >= MINIWEB_DEBUG_ALL)
+            fprintf(stderr, "No content length header\n");
+      } else {
+         int length = content_length_parse(length_string);
+         session->content_length = length == -1 ? 0 : length;
+      }
+   }
+   return session->content_length;
+}
+
+/****************************************************************************************/
+char *miniweb_content(struct miniweb_session *session) {
+   return session->content;
+}
+/****************************************************************************************/
+int miniweb_listen_header(char *header) {
+   struct listen_header *lh;
+   char *h;
+
+   // First check if we already have the header in the list?
+   lh = first_listen_header;
+   while(lh != NULL) {
+      if(strcmp(header,lh->header)==0)
+          return 1;
+      lh = lh->next;
+   }
+
+   // Nope - we need to add it.
+   int len = strlen(header);
+   h = mem_alloc(len+1, MINIWEB_MEM_CONFIG);
+   if(h == NULL)
+     return miniweb_log_error(MINIWEB_ERR_NOMEM);
+
+   lh = mem_alloc(sizeof(struct listen_header), MINIWEB_MEM_CONFIG);
+   if(lh == NULL) {
+     mem_free(h);
+     return miniweb_log_error(MINIWEB_ERR_NOMEM);
+   }
+   strcpy(h,header);
+   lh->header = h;
+   lh->len = len;
+   lh->next = first_listen_header;
+   first_listen_header = lh; 
+   return 1;
+}
+
+/****************************************************************************************/
+int miniweb_response(struct miniweb_session *session, int response) {
+   session->response_code = response;
+   return 1;
+}
+
+/****************************************************************************************/
+static void sse_tidyup(void);
+static void metrics_tidyup(void);
+
+void  miniweb_tidyup(void) {
+   while(first_session != NULL) {
+      struct miniweb_session *next = first_session->next;
+      session_end(first_session);
+#ifndef MINIWEB_STATIC
+      mem_free(first_session);   // Static sessions are kept to be used again
+#endif
+      first_session = next;
+   }
+   session_count = 0;
+   while(first_listen_header != NULL) {
+      struct listen_header *lh = first_listen_header;
+      first_listen_header = lh->next;
+      if(lh->header)
+        mem_free(lh->header);
+      mem_free(lh);
+   }
+
+   while(first_url_reg != NULL) {
+      struct url_reg *url = first_url_reg;
+      first_url_reg = url->next;
+      if(url->method)
+        mem_free(url->method);
+      if(url->pattern_start)
+        mem_free(url->pattern_start);
+      if(url->pattern_end)
+        mem_free(url->pattern_end);
+      if(url->latency)
+        mem_free(url->latency);
+      mem_free(url);
+   }
+
+   while(first_listener) {
+     struct listener *l = first_listener;
+     first_listener = l->next;
+     if(l->fd != -1) {
+       close(l->fd);
+       if(l->addr.ss_family == AF_UNIX)
+         unlink(((struct sockaddr_un *)&l->addr)->sun_path);
+     }
+     mem_free(l->address);
+     mem_free(l);
+   }
+   metrics_tidyup();
+   miniweb_set_trace(0, 0);
+   miniweb_access_log(0, NULL, NULL);
+   sse_tidyup();
+   compress_tidyup();
+   tls_tidyup();
+   pool_trim();
+}
+/****************************************************************************************/
+int miniweb_latency(char *method, char *url, struct miniweb_latency *latency, int reset) {
+    struct lat_hist *h = &latency_all;
+    if(latency == NULL)
+        return 0;
+    if(url != NULL) {
+        struct url_reg *ur = url_reg_find(method ? method : "GET", url);
+        if(ur == NULL)
+            return 0;
+        h = ur->latency;
+    }
+    memset(latency, 0, sizeof(struct miniweb_latency));
+    if(h == NULL)
+        return 1;   // Registered, but not yet requested
+    latency->count = h->total;
+    latency->p50   = lat_percentile(h, 500);
+    latency->p90   = lat_percentile(h, 900);
+    latency->p99   = lat_percentile(h, 990);
+    latency->p999  = lat_percentile(h, 999);
+    latency->max   = h->max;
+    // Start again, so the next call only sees what happens from now on
+    if(reset)
+        memset(h, 0, sizeof(struct lat_hist));
+    return 1;
+}
+
+/****************************************************************************************/
+// Prometheus metrics. The text is rendered into a blob that is kept between scrapes, and
+// only replaced if it is too small or still being sent to an earlier scraper.
+/****************************************************************************************/
+static struct miniweb_blob *metrics_blob;
+static size_t metrics_used;
+static int metrics_full;
+
+static const char *error_names[] = { "", "nomem", "accept", "listen", "socket", "bind", "close",
+                                     "hdrtobig", "select", "write", "tls", "parse" };
+// Fails to compile if an error code is added without a name here
+typedef char error_names_check[sizeof(error_names)/sizeof(error_names[0]) == MINIWEB_ERR_COUNT ? 1 : -1];
+
+static const struct {
+   unsigned us;
+   char *le;
+} metrics_buckets[] = {
+   {100, "0.0001"}, {250, "0.00025"}, {500, "0.0005"}, {1000, "0.001"}, {2500, "0.0025"},
+   {5000, "0.005"}, {10000, "0.01"}, {25000, "0.025"}, {50000, "0.05"}, {100000, "0.1"},
+   {250000, "0.25"}, {500000, "0.5"}, {1000000, "1"}, {2500000, "2.5"}, {5000000, "5"}, {10000000, "10"}
+};
+
+static void metrics_printf(const char *format, ...) {
+    size_t room = metrics_blob->size - metrics_used;
+    va_list args;
+    int n;
+    if(metrics_full)
+        return;
+    va_start(args, format);
+    n = vsnprintf(metrics_blob->data + metrics_used, room, format, args);
+    va_end(args);
+    if(n < 0 || (size_t)n >= room)
+        metrics_full = 1;
+    else
+        metrics_used += n;
+}
+
+/****************************************************************************************/
+// The labels for a route, with quotes and backslashes escaped
+static void metrics_route(struct url_reg *ur, char *out, size_t len) {
+    char *parts[3];
+    size_t used = 0;
+    int i;
+    parts[0] = ur->pattern_start;
+    parts[1] = ur->pattern_end ? "*" : "";
+    parts[2] = ur->pattern_end ? ur->pattern_end : "";
+    for(i = 0; i < 3; i++) {
+        char *p;
+        for(p = parts[i]; *p != '\0' && used+3 < len; p++) {
+            if(*p == '"' || *p == '\\')
+                out[used++] = '\\';
+            out[used++] = *p;
+        }
+    }
+    out[used] = '\0';
+}
+
+// A label value, escaped in the same way
+static void metrics_label(char *in, char *out, size_t len) {
+    size_t used = 0;
+    for(; *in != '\0' && used+3 < len; in++) {
+        if(*in == '"' || *in == '\\')
+            out[used++] = '\\';
+        out[used++] = *in;
+    }
+    out[used] = '\0';
+}
+
+/****************************************************************************************/
+static void metrics_render(void) {
+    struct miniweb_session *s;
+    struct url_reg *ur;
+    struct listener *l;
+    char route[256];
+    unsigned active = 0, idle = 0, rc;
+    int i, b;
+
+    metrics_printf("# HELP miniweb_requests_total Requests answered, by route and response code.\n"
+                   "# TYPE miniweb_requests_total counter\n");
+    for(ur = first_url_reg; ur != NULL; ur = ur->next) {
+        metrics_route(ur, route, sizeof(route));
+        for(rc = 0; rc <= RESP_CODES; rc++) {
+            if(ur->response_counts[rc] == 0)
+                continue;
+            if(rc < RESP_CODES)
+                metrics_printf("miniweb_requests_total{method=\"%s\",route=\"%s\",code=\"%i\"} %u\n",
+                               ur->method, route, resp_codes[rc].number, ur->response_counts[rc]);
+            else
+                metrics_printf("miniweb_requests_total{method=\"%s\",route=\"%s\",code=\"other\"} %u\n",
+                               ur->method, route, ur->response_counts[rc]);
+        }
+    }
+    metrics_printf("# HELP miniweb_unrouted_requests_total Requests that matched no route.\n"
+                   "# TYPE miniweb_unrouted_requests_total counter\n"
+                   "miniweb_unrouted_requests_total %u\n", requests_unrouted);
+
+    metrics_printf("# HELP miniweb_response_bytes_total Reply body bytes, by route.\n"
+                   "# TYPE miniweb_response_bytes_total counter\n");
+    for(ur = first_url_reg; ur != NULL; ur = ur->next) {
+        metrics_route(ur, route, sizeof(route));
+        metrics_printf("miniweb_response_bytes_total{method=\"%s\",route=\"%s\"} %llu\n",
+                       ur->method, route, ur->bytes_sent);
+    }
+
+    metrics_printf("# HELP miniweb_request_duration_seconds Time from the first byte of a request to the last byte of the reply.\n"
+                   "# TYPE miniweb_request_duration_seconds histogram\n");
+    for(ur = first_url_reg; ur != NULL; ur = ur->next) {
+        struct lat_hist *h = ur->latency;
+        unsigned seen = 0;
+        if(h == NULL)
+            continue;
+        metrics_route(ur, route, sizeof(route));
+        // A bucket counts towards a bound once all of its values are within it
+        for(i = 0, b = 0; i < (int)(sizeof(metrics_buckets)/sizeof(metrics_buckets[0])); i++) {
+            for(; b < LAT_BUCKETS && lat_bucket_value(b) <= metrics_buckets[i].us; b++)
+                seen += h->counts[b];
+            metrics_printf("miniweb_request_duration_seconds_bucket{method=\"%s\",route=\"%s\",le=\"%s\"} %u\n",
+                           ur->method, route, metrics_buckets[i].le, seen);
+        }
+        metrics_printf("miniweb_request_duration_seconds_bucket{method=\"%s\",route=\"%s\",le=\"+Inf\"} %u\n"
+                       "miniweb_request_duration_seconds_sum{method=\"%s\",route=\"%s\"} %llu.%06llu\n"
+                       "miniweb_request_duration_seconds_count{method=\"%s\",route=\"%s\"} %u\n",
+                       ur->method, route, h->total, ur->method, route, h->sum / 1000000, h->sum % 1000000,
+                       ur->method, route, h->total);
+    }
+
+    // Idle means waiting on keep-alive for the next request
+    for(s = first_session; s != NULL; s = s->next) {
+        if(s->socket == -1)
+            continue;
+        if(s->requests_served > 0 && s->io_state == io_reading && s->in_buffer_used == 0)
+            idle++;
+        else
+            active++;
+    }
+    metrics_printf("# HELP miniweb_sessions Open connections.\n"
+                   "# TYPE miniweb_sessions gauge\n"
+                   "miniweb_sessions{state=\"active\"} %u\n"
+                   "miniweb_sessions{state=\"idle\"} %u\n", active, idle);
+    metrics_printf("# HELP miniweb_accepts_total Connections accepted.\n"
+                   "# TYPE miniweb_accepts_total counter\n"
+                   "miniweb_accepts_total %u\n", sessions_accepted);
+    metrics_printf("# HELP miniweb_rejected_total Connections turned away with a 503, as no session was free.\n"
+                   "# TYPE miniweb_rejected_total counter\n"
+                   "miniweb_rejected_total %u\n", sessions_rejected);
+    metrics_printf("# HELP miniweb_listener_up Whether each listener is open.\n"
+                   "# TYPE miniweb_listener_up gauge\n");
+    for(l = first_listener; l != NULL; l = l->next) {
+        metrics_label(l->address, route, sizeof(route));
+        metrics_printf("miniweb_listener_up{listener=\"%s\"} %i\n", route, l->fd >= 0);
+    }
+    metrics_printf("# HELP miniweb_listener_accepts_total Connections accepted, by listener.\n"
+                   "# TYPE miniweb_listener_accepts_total counter\n");
+    for(l = first_listener; l != NULL; l = l->next) {
+        metrics_label(l->address, route, sizeof(route));
+        metrics_printf("miniweb_listener_accepts_total{listener=\"%s\"} %u\n", route, l->accepted);
+    }
+    metrics_printf("# HELP miniweb_listener_rejected_total Connections turned away straight after being accepted, by listener.\n"
+                   "# TYPE miniweb_listener_rejected_total counter\n");
+    for(l = first_listener; l != NULL; l = l->next) {
+        metrics_label(l->address, route, sizeof(route));
+        metrics_printf("miniweb_listener_rejected_total{listener=\"%s\"} %u\n", route, l->rejected);
+    }
+    metrics_printf("# HELP miniweb_listener_connections Open connections, by listener.\n"
+                   "# TYPE miniweb_listener_connections gauge\n");
+    for(l = first_listener; l != NULL; l = l->next) {
+        metrics_label(l->address, route, sizeof(route));
+        metrics_printf("miniweb_listener_connections{listener=\"%s\"} %u\n", route, l->open);
+    }
+    metrics_printf("# HELP miniweb_shed_total Connections and requests refused by admission control.\n"
+                   "# TYPE miniweb_shed_total counter\n");
+    for(i = 0; i < SHED_REASONS; i++)
+        metrics_printf("miniweb_shed_total{reason=\"%s\"} %u\n", shed_names[i], shed_counts[i]);
+    metrics_printf("# HELP miniweb_in_flight Requests being answered.\n"
+                   "# TYPE miniweb_in_flight gauge\n"
+                   "miniweb_in_flight %u\n", requests_in_flight);
+    metrics_printf("# HELP miniweb_timeouts_total Connections closed for being idle or too slow, by what they were doing.\n"
+                   "# TYPE miniweb_timeouts_total counter\n");
+    for(i = 0; i < PHASES; i++)
+        metrics_printf("miniweb_timeouts_total{phase=\"%s\"} %u\n", phase_names[i], phase_timeouts[i]);
+    metrics_printf("# HELP miniweb_errors_total Internal errors, by MINIWEB_ERR_* code.\n"
+                   "# TYPE miniweb_errors_total counter\n");
+    for(i = 1; i < (int)(sizeof(error_counts)/sizeof(error_counts[0])); i++)
+        metrics_printf("miniweb_errors_total{error=\"%s\"} %u\n", error_names[i], error_counts[i]);
+    metrics_printf("# HELP miniweb_access_log_dropped_total Access log records lost to a full ring.\n"
+                   "# TYPE miniweb_access_log_dropped_total counter\n"
+                   "miniweb_access_log_dropped_total %u\n", access_dropped);
+    metrics_printf("# HELP miniweb_pool_failures_total Buffer allocations refused by the pool limit or the heap.\n"
+                   "# TYPE miniweb_pool_failures_total counter\n"
+                   "miniweb_pool_failures_total %u\n", pool_failures);
+    metrics_printf("# HELP miniweb_pool_bytes Buffer pool memory.\n"
+                   "# TYPE miniweb_pool_bytes gauge\n"
+                   "miniweb_pool_bytes{state=\"in_use\"} %zu\n"
+                   "miniweb_pool_bytes{state=\"cached\"} %zu\n", pool_bytes_in_use, pool_bytes_cached);
+}
+
+/****************************************************************************************/
+static void metrics_page(struct miniweb_session *session) {
+    size_t size = metrics_blob ? metrics_blob->size : 16384;
+    for(;;) {
+        if(metrics_blob != NULL && metrics_blob->refs > 1) {
+            // An earlier scrape is still being sent from it
+            miniweb_blob_unref(metrics_blob);
+            metrics_blob = NULL;
+        }
+        if(metrics_blob == NULL && (metrics_blob = miniweb_blob_new(size)) == NULL) {
+            miniweb_response(session, 500);
+            return;
+        }
+        metrics_used = 0;
+        metrics_full = 0;
+        metrics_render();
+        if(!metrics_full)
+            break;
+        size = metrics_blob->size*2;
+        miniweb_blob_unref(metrics_blob);
+        metrics_blob = NULL;
+    }
+    miniweb_response(session, 200);
+    miniweb_add_header(session, "Content-Type", "text/plain; version=0.0.4");
+    miniweb_shared_blob(session, metrics_blob);
+    session->shared_data_size = metrics_used;
+}
+
+/****************************************************************************************/
+int miniweb_enable_metrics(char *url) {
+    if(url == NULL)
+        return 0;
+    return miniweb_register_page("GET", url, metrics_page);
+}
+
+/****************************************************************************************/
+static void metrics_tidyup(void) {
+    if(metrics_blob != NULL) {
+        miniweb_blob_unref(metrics_blob);
+        metrics_blob = NULL;
+    }
+}
+
+/****************************************************************************************/
+void miniweb_stats(void) {
+   struct url_reg *url = first_url_reg;
+   printf("%i active session, %i timed out, %u rejected\n", session_count, sessions_timed_out, sessions_rejected);
+   for(struct listener *l = first_listener; l != NULL; l = l->next)
+      printf("Listener %s: %s, %u accepted, %u rejected, %u open\n", l->address, l->fd >= 0 ? "up" : "down",
+             l->accepted, l->rejected, l->open);
+   printf("Timeouts: %u idle, %u header, %u body, %u write, %u stream\n", phase_timeouts[phase_idle],
+          phase_timeouts[phase_header], phase_timeouts[phase_body], phase_timeouts[phase_write], phase_timeouts[phase_stream]);
+   printf("Admission: %u in flight, shed %u for connections, %u for rate, %u for in flight, %u for route,"
+          " %u clients untracked\n", requests_in_flight, shed_counts[shed_connections], shed_counts[shed_rate],
+          shed_counts[shed_in_flight], shed_counts[shed_route], admit_untracked);
+   printf("Buffer pool: %u hits, %u misses, %u resizes, %u failures, %zu in use, %zu cached, %zu peak\n",
+          pool_hits, pool_misses, pool_resizes, pool_failures, pool_bytes_in_use, pool_bytes_cached, pool_bytes_peak);
+   printf("Input: %u reads parsed in place, %u left a partial request\n", reads_in_place, reads_kept);
+   printf("Memory: %zu bytes, %zu peak (session %zu, buffer %zu, header %zu, request %zu, content %zu,"
+          " config %zu, stream %zu, compress %zu, other %zu)\n", mem_total, mem_total_peak,
+          mem_bytes[MINIWEB_MEM_SESSION], mem_bytes[MINIWEB_MEM_BUFFER], mem_bytes[MINIWEB_MEM_HEADER],
+          mem_bytes[MINIWEB_MEM_REQUEST], mem_bytes[MINIWEB_MEM_CONTENT], mem_bytes[MINIWEB_MEM_CONFIG],
+          mem_bytes[MINIWEB_MEM_STREAM], mem_bytes[MINIWEB_MEM_COMPRESS], mem_bytes[MINIWEB_MEM_OTHER]);
+   {
+      unsigned long failures = 0;
+      for(int c = 0; c < MINIWEB_MEM_CATEGORIES; c++)
+         failures += mem_failures[c];
+      if(failures > 0)
+         printf("Memory: %lu allocations failed\n", failures);
+   }
+   if(tls_enabled)
+      printf("TLS: %u handshakes, %u resumed, %u kernel TLS, %u failures\n",
+             tls_handshakes, tls_resumed, tls_ktls_send, tls_failures);
+   if(h2_connections > 0)
+      printf("HTTP/2: %u connections, %u streams, %u refused\n", h2_connections, h2_streams, h2_refused);
+   if(ws_connections > 0)
+      printf("WebSocket: %u connections, %u messages in, %u out, %u refused\n",
+             ws_connections, ws_messages_in, ws_messages_out, ws_refused);
+   if(access_ring != NULL)
+      printf("Access log: %u written, %u dropped\n", access_tail, access_dropped);
+   if(sse_subscribers > 0)
+      printf("SSE: %u subscribers, %u events, %u coalesced, %u dropped\n",
+             sse_subscribers, sse_events, sse_coalesced, sse_dropped);
+   if(latency_all.total > 0)
+      printf("Latency (us): p50 %u, p90 %u, p99 %u, p99.9 %u, max %u\n",
+             lat_percentile(&latency_all, 500), lat_percentile(&latency_all, 900),
+             lat_percentile(&latency_all, 990), lat_percentile(&latency_all, 999), latency_all.max);
+   printf("Count   Time                 p50      p99      max URL\n");
+   while(url != NULL) {
+      printf("%6i ", url->request_count);
+      printf("%6i.%09i ", (int)url->request_time.tv_sec, (int)url->request_time.tv_nsec); 
+      if(url->latency != NULL)
+         printf("%8u %8u %8u ", lat_percentile(url->latency, 500), lat_percentile(url->latency, 990), url->latency->max);
+      else
+         printf("%8s %8s %8s ", "-", "-", "-");
+      if(url->pattern_end == NULL) {
+         printf("%s %s\n", url->method, url->pattern_start);
+      } else {
+         printf("%s %s*%s\n", url->method, url->pattern_start, url->pattern_end);
+      }
+      url = url->next;
+   } 
+   putchar('\n');
+}
+
+/****************************************************************************************/
+// Write from 'buf' until 'len' bytes have gone. Returns 1 when done, 0 if the socket is full
+// and we need to come back later, and -1 if the session had to be ended.
+static int session_write_buffer(struct miniweb_session *s, char *buf, size_t len) {
+    while(s->write_pointer != len) {
+        ssize_t n = s->transport->write(s, buf+s->write_pointer, len-s->write_pointer);
+        if(n >= 0) {
+            trace_mark(s, tp_first_write);
+            s->write_pointer += n;
+        } else {
+            switch(errno) {
+                case EINTR:
+                   break;
+                case EWOULDBLOCK:
+                   return 0; // Go away and come back later
+                default: 
+                   miniweb_log_error(MINIWEB_ERR_WRITE);
+                   session_end(s);
+                   return -1;
+            }
+        }
+    }
+    s->write_pointer = 0;
+    return 1;
+}
+
+/****************************************************************************************/
+// Only used when MINIWEB_SOCKOPT_CORK is on, and never on Unix sockets
+static void session_set_cork(struct miniweb_session *s, int cork) {
+#ifdef TCP_CORK
+    if(s->corked == cork)
+        return;
+    if(cork && (!sockopt_cork || s->listener == NULL || s->listener->addr.ss_family == AF_UNIX))
+        return;
+    if(setsockopt(s->socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork)) == 0)
+        s->corked = cork;
+#else
+    (void)s;
+    (void)cork;
+#endif
+}
+
+/****************************************************************************************/
+// The whole reply has been sent - close the connection, or get ready for the next request
+static void ws_open(struct miniweb_session *s);
+static void sse_open(struct miniweb_session *s);
+
+static void session_reply_done(struct miniweb_session *s) {
+    // Push out the last partial frame
+    session_set_cork(s, 0);
+    s->requests_served++;
+    if(s->ws != NULL) {
+        // The WebSocket handshake reply has gone
+        ws_open(s);
+        return;
+    }
+    if(s->sse_topic != NULL) {
+        // As are the headers of an event stream
+        sse_open(s);
+        return;
+    }
+    session_update_metrics(s);
+    if(!s->keep_alive) {
+        session_end(s);
+        return;
+    }
+    // Release everything but the socket (and any pipelined input), so idle connections are cheap
+    session_empty(s);
+    s->io_state = io_reading;
+}
+
+/****************************************************************************************/
+// As session_write_buffer(), but from the shared file
+static int session_write_file(struct miniweb_session *s) {
+    while(s->write_pointer != s->shared_data_size) {
+        off_t offset = s->shared_file_offset+s->write_pointer;
+        ssize_t n = s->transport->sendfile(s, s->shared_fd, offset, s->shared_data_size-s->write_pointer);
+        if(n > 0) {
+            s->write_pointer += n;
+        } else if(n == 0) {
+            // The file has been truncated under us, so the reply can't be completed
+            miniweb_log_error(MINIWEB_ERR_WRITE);
+            session_end(s);
+            return -1;
+        } else {
+            switch(errno) {
+                case EINTR:
+                   break;
+                case EWOULDBLOCK:
+                   return 0; // Go away and come back later
+                default: 
+                   miniweb_log_error(MINIWEB_ERR_WRITE);
+                   session_end(s);
+                   return -1;
+            }
+        }
+    }
+    s->write_pointer = 0;
+    return 1;
+}
+
+/****************************************************************************************/
+// Send what is in the output queue. Returns 1 when it is empty, 0 if the socket is full
+// and -1 if the session had to be ended.
+static int session_write_queue(struct miniweb_session *s) {
+    // Small frames go out together with what follows them, if corking is on
+    if(s->outq_head != NULL && s->outq_head->next != NULL)
+        session_set_cork(s, 1);
+    while(s->outq_head != NULL) {
+        int rtn = session_write_buffer(s, s->outq_head->data, s->outq_head->len);
+        if(rtn != 1)
+            return rtn;
+        outq_pop(s);
+    }
+    session_set_cork(s, 0);
+    return 1;
+}
+
+/****************************************************************************************/
+static void write_more_shared_data(struct miniweb_session *s) {
+    s->io_state = io_writing_shared_data;   
+    if(s->shared_fd != -1) {
+        if(session_write_file(s) != 1)
+            return;
+    } else if(s->shared_data && session_write_buffer(s, s->shared_data, s->shared_data_size) != 1) {
+        return;
+    }
+
+    session_reply_done(s);
+}
+
+/****************************************************************************************/
+static void write_more_data(struct miniweb_session *s) {
+    s->io_state = io_writing_data;   
+    if(s->data && session_write_buffer(s, s->data, s->data_used) != 1)
+        return;
+
+    if(s->shared_data != NULL || s->shared_fd != -1)
+        write_more_shared_data(s);
+    else
+        session_reply_done(s);
+}
+
+/****************************************************************************************/
+static void write_more_headers(struct miniweb_session *s) {
+    // Hold back partial frames so the headers share packets with the body
+    if(sockopt_cork && (s->data != NULL || s->shared_data != NULL || s->shared_fd != -1))
+        session_set_cork(s, 1);
+    if(s->header_data && session_write_buffer(s, s->header_data, s->header_data_size) != 1)
+        return;
+
+    // Carry straight on with the body, rather than waiting for the next select()
+    if(s->data != NULL)
+        write_more_data(s);
+    else if(s->shared_data != NULL || s->shared_fd != -1)
+        write_more_shared_data(s);
+    else
+        session_reply_done(s);
+}
+
+/****************************************************************************************/
+// HTTP/2, for clients that start with the HTTP/2 preface (h2c with prior knowledge) or
+// agree to "h2" during the TLS handshake. Each stream gets a miniweb_session of its own, so
+// page callbacks run unchanged, and the replies are sent as frames on the one connection.
+/****************************************************************************************/
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_FLAG_END_STREAM  0x01
+#define H2_FLAG_ACK         0x01
+#define H2_FLAG_END_HEADERS 0x04
+#define H2_FLAG_PADDED      0x08
+#define H2_FLAG_PRIORITY    0x20
+
+enum h2_frame_e { h2_data, h2_headers, h2_priority, h2_rst_stream, h2_settings,
+                  h2_push_promise, h2_ping, h2_goaway, h2_window_update, h2_continuation };
+enum h2_error_e { h2_no_error, h2_protocol_error, h2_internal_error, h2_flow_control_error,
+                  h2_settings_timeout, h2_stream_closed, h2_frame_size_error, h2_refused_stream,
+                  h2_cancel, h2_compression_error, h2_connect_error, h2_enhance_your_calm,
+                  h2_inadequate_security, h2_http_1_1_required };
+
+struct h2_stream {
+   struct h2_stream *next;
+   unsigned id;
+   int    send_window;
+   int    recv_window;                 // What the client may still send on it
+   char   replying;                    // The request is complete and the reply is being sent
+   char   body_refused;                // Replied to with a 413 before all of the body came
+   size_t sent;
+   size_t total;
+   size_t content_alloc;
+   struct miniweb_session *req;
+};
+
+struct h2_table_entry {
+   char   *name;
+   char   *value;
+   size_t size;
+};
+
+struct h2_conn {
+   const char *preface;                // What is left of the client preface to check
+   struct h2_stream *first_stream;
+   int      stream_count;
+   unsigned last_stream_id;
+   int      send_window;               // Connection level flow control
+   int      recv_window;
+   int      initial_window;            // The client's SETTINGS_INITIAL_WINDOW_SIZE
+   unsigned max_frame;                 // Largest frame the client will accept
+   char     closing;                   // We've sent GOAWAY
+   char     goaway;                    // The client has sent GOAWAY
+
+   // A header block split over HEADERS and CONTINUATION frames
+   unsigned hblock_stream;
+   char     hblock_end_stream;
+   char     *hblock;
+   size_t   hblock_len;
+
+   // HPACK decoder's dynamic table, newest first
+   struct h2_table_entry table[H2_TABLE_MAX/32];
+   int      table_count;
+   size_t   table_size;
+   size_t   table_max;
+};
+
+static const char *h2_static_table[61][2] = {
+   {":authority", ""}, {":method", "GET"}, {":method", "POST"}, {":path", "/"},
+   {":path", "/index.html"}, {":scheme", "http"}, {":scheme", "https"}, {":status", "200"},
+   {":status", "204"}, {":status", "206"}, {":status", "304"}, {":status", "400"},
+   {":status", "404"}, {":status", "500"}, {"accept-charset", ""}, {"accept-encoding", "gzip, deflate"},
+   {"accept-language", ""}, {"accept-ranges", ""}, {"accept", ""}, {"access-control-allow-origin", ""},
+   {"age", ""}, {"allow", ""}, {"authorization", ""}, {"cache-control", ""},
+   {"content-disposition", ""}, {"content-encoding", ""}, {"content-language", ""}, {"content-length", ""},
+   {"content-location", ""}, {"content-range", ""}, {"content-type", ""}, {"cookie", ""},
+   {"date", ""}, {"etag", ""}, {"expect", ""}, {"expires", ""},
+   {"from", ""}, {"host", ""}, {"if-match", ""}, {"if-modified-since", ""},
+   {"if-none-match", ""}, {"if-range", ""}, {"if-unmodified-since", ""}, {"last-modified", ""},
+   {"link", ""}, {"location", ""}, {"max-forwards", ""}, {"proxy-authenticate", ""},
+   {"proxy-authorization", ""}, {"range", ""}, {"referer", ""}, {"refresh", ""},
+   {"retry-after", ""}, {"server", ""}, {"set-cookie", ""}, {"strict-transport-security", ""},
+   {"transfer-encoding", ""}, {"user-agent", ""}, {"vary", ""}, {"via", ""},
+   {"www-authenticate", ""}
+};
+
+// The HPACK Huffman code for each byte value
+static const unsigned h2_huffman_codes[256] = {
+   0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+   0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+   0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+   0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+   0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+   0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+   0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+   0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+   0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+   0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+   0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+   0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+   0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+   0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+   0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+   0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+   0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+   0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+   0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+   0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+   0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+   0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+   0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+   0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+   0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+   0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+   0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+   0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+   0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+   0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+   0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+   0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee
+};
+static const unsigned char h2_huffman_lengths[256] = {
+   13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+   28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+   6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+   5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+   13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+   7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+   15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+   6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+   20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+   24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+   22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+   21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+   26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+   19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+   20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+   26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26
+};
+
+// Decoding tree, built on first use. Positive entries are the next node, negative entries
+// are -(symbol+1), and zero is an invalid code.
+static short h2_huffman_tree[256][2];
+static int h2_huffman_nodes;
+
+/****************************************************************************************/
+static void h2_huffman_build(void) {
+    int sym, bit;
+    h2_huffman_nodes = 1;
+    for(sym = 0; sym < 256; sym++) {
+        int node = 0;
+        for(bit = h2_huffman_lengths[sym]-1; bit >= 0; bit--) {
+            int b = (h2_huffman_codes[sym] >> bit) & 1;
+            if(bit == 0) {
+                h2_huffman_tree[node][b] = -(sym+1);
+            } else {
+                if(h2_huffman_tree[node][b] == 0)
+                    h2_huffman_tree[node][b] = h2_huffman_nodes++;
+                node = h2_huffman_tree[node][b];
+            }
+        }
+    }
+}
+
+/****************************************************************************************/
+static int h2_huffman_decode(const unsigned char *in, size_t len, char *out, size_t *out_len) {
+    int node = 0, depth = 0, ones = 1;   // 'ones' while the bits since the last symbol are all 1s
+    size_t i, n = 0;
+    if(h2_huffman_nodes == 0)
+        h2_huffman_build();
+    for(i = 0; i < len; i++) {
+        int bit;
+        for(bit = 7; bit >= 0; bit--) {
+            int next = h2_huffman_tree[node][(in[i] >> bit) & 1];
+            if(next < 0) {
+                out[n++] = -next-1;
+                node  = 0;
+                depth = 0;
+                ones  = 1;
+            } else if(next == 0) {
+                // Not a code, or EOS, which isn't in the tree and mustn't be sent
+                return 0;
+            } else {
+                node = next;
+                depth++;
+                ones &= (in[i] >> bit) & 1;
+            }
+        }
+    }
+    // Anything left over can only be padding, which is the start of EOS
+    if(depth > 7 || !ones)
+        return 0;
+    *out_len = n;
+    return 1;
+}
+
+/****************************************************************************************/
+// HPACK integers have an 'prefix' bit start, and then continue in 7 bit groups
+static int h2_get_int(const unsigned char **p, const unsigned char *end, int prefix, size_t *value) {
+    size_t v, max = (1 << prefix)-1;
+    int shift = 0;
+    if(*p >= end)
+        return 0;
+    v = **p & max;
+    (*p)++;
+    if(v == max) {
+        do {
+            if(*p >= end || shift > 21)
+                return 0;
+            v += (size_t)(**p & 0x7f) << shift;
+            shift += 7;
+        } while(*(*p)++ & 0x80);
+    }
+    *value = v;
+    return 1;
+}
+
+/****************************************************************************************/
+static size_t h2_put_int(unsigned char *p, size_t value, int prefix, int first) {
+    size_t max = (1 << prefix)-1, n = 1;
+    if(value < max) {
+        p[0] = first | value;
+        return 1;
+    }
+    p[0] = first | max;
+    value -= max;
+    while(value >= 128) {
+        p[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+/****************************************************************************************/
+// Returns a malloced copy of the string, decoded and NULL terminated
+static char *h2_get_string(const unsigned char **p, const unsigned char *end, size_t *len) {
+    int huffman;
+    size_t n;
+    char *str;
+    if(*p >= end)
+        return NULL;
+    huffman = **p & 0x80;
+    if(!h2_get_int(p, end, 7, &n) || n > (size_t)(end-*p))
+        return NULL;
+    if(huffman) {
+        str = mem_alloc(n*8/5+1, MINIWEB_MEM_STREAM);
+        if(str != NULL && !h2_huffman_decode(*p, n, str, len)) {
+            mem_free(str);
+            return NULL;
+        }
+    } else {
+        str = mem_alloc(n+1, MINIWEB_MEM_STREAM);
+        if(str != NULL)
+            memcpy(str, *p, n);
+        *len = n;
+    }
+    if(str == NULL) {
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+    str[*len] = '\0';
+    *p += n;
+    return str;
+}
+
+/****************************************************************************************/
+static void h2_table_evict(struct h2_conn *c, size_t max) {
+    while(c->table_count > 0 && c->table_size > max) {
+        struct h2_table_entry *e = &c->table[--c->table_count];
+        c->table_size -= e->size;
+        mem_free(e->name);
+        mem_free(e->value);
+    }
+}
+
+/****************************************************************************************/
+// Takes ownership of the strings
+static void h2_table_add(struct h2_conn *c, char *name, char *value) {
+    size_t size = strlen(name)+strlen(value)+32;
+    if(size > c->table_max) {
+        // Too big to keep, and it pushes everything else out too
+        h2_table_evict(c, 0);
+        mem_free(name);
+        mem_free(value);
+        return;
+    }
+    h2_table_evict(c, c->table_max-size);
+    memmove(c->table+1, c->table, c->table_count*sizeof(struct h2_table_entry));
+    c->table[0].name  = name;
+    c->table[0].value = value;
+    c->table[0].size  = size;
+    c->table_count++;
+    c->table_size += size;
+}
+
+/****************************************************************************************/
+static int h2_table_get(struct h2_conn *c, size_t index, const char **name, const char **value) {
+    if(index == 0)
+        return 0;
+    if(index <= 61) {
+        *name  = h2_static_table[index-1][0];
+        *value = h2_static_table[index-1][1];
+        return 1;
+    }
+    if(index-62 >= (size_t)c->table_count)
+        return 0;
+    *name  = c->table[index-62].name;
+    *value = c->table[index-62].value;
+    return 1;
+}
+
+/****************************************************************************************/
+// Give a request header to the stream, as the HTTP/1 parser would
+static void h2_request_header(struct miniweb_session *req, const char *name, const char *value) {
+    struct listen_header *lh;
+    char **field = NULL;
+    if(req == NULL)
+        return;
+    if(name[0] == ':') {
+        if(strcmp(name, ":method") == 0)
+            field = &req->method;
+        else if(strcmp(name, ":path") == 0)
+            field = &req->full_url;
+        else if(strcmp(name, ":authority") == 0)
+            name = "host";
+        else
+            return;
+    }
+    if(field != NULL) {
+        if(*field == NULL) {
+            *field = mem_alloc(strlen(value)+1, MINIWEB_MEM_REQUEST);
+            if(*field != NULL)
+                strcpy(*field, value);
+        }
+        return;
+    }
+    lh = header_find((char *)name, strlen(name));
+    if(lh != NULL)
+        session_request_header_add(req, lh->header, (char *)value);
+}
+
+/****************************************************************************************/
+// Decode a complete header block. 'req' is NULL if the headers are to be thrown away, but
+// they are still decoded to keep the dynamic table in step with the client's.
+static int h2_decode_headers(struct h2_conn *c, struct miniweb_session *req, const unsigned char *p, size_t len) {
+    const unsigned char *end = p+len;
+    while(p < end) {
+        const char *name, *value;
+        char *new_name = NULL, *new_value;
+        size_t index, name_len, value_len;
+        int add;
+
+        if(*p & 0x80) {
+            // Indexed header field
+            if(!h2_get_int(&p, end, 7, &index) || !h2_table_get(c, index, &name, &value))
+                return 0;
+            h2_request_header(req, name, value);
+            continue;
+        }
+        if((*p & 0xe0) == 0x20) {
+            // Dynamic table size update
+            if(!h2_get_int(&p, end, 5, &index) || index > H2_TABLE_MAX)
+                return 0;
+            c->table_max = index;
+            h2_table_evict(c, index);
+            continue;
+        }
+
+        // Literal header field, with or without indexing
+        add = (*p & 0x40) != 0;
+        if(!h2_get_int(&p, end, add ? 6 : 4, &index))
+            return 0;
+        if(index == 0) {
+            new_name = h2_get_string(&p, end, &name_len);
+            if(new_name == NULL)
+                return 0;
+            name = new_name;
+        } else if(!h2_table_get(c, index, &name, &value)) {
+            return 0;
+        }
+        new_value = h2_get_string(&p, end, &value_len);
+        if(new_value == NULL) {
+            mem_free(new_name);
+            return 0;
+        }
+        h2_request_header(req, name, new_value);
+
+        if(add) {
+            if(new_name == NULL) {
+                new_name = mem_alloc(strlen(name)+1, MINIWEB_MEM_STREAM);
+                if(new_name == NULL) {
+                    mem_free(new_value);
+                    return miniweb_log_error(MINIWEB_ERR_NOMEM);
+                }
+                strcpy(new_name, name);
+            }
+            h2_table_add(c, new_name, new_value);
+        } else {
+            mem_free(new_name);
+            mem_free(new_value);
+        }
+    }
+    return 1;
+}
+
+/****************************************************************************************/
+static void h2_put32(unsigned char *p, unsigned v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned h2_get32(const unsigned char *p) {
+    return ((unsigned)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/****************************************************************************************/
+static void h2_frame_header(char *buffer, size_t len, int type, int flags, unsigned id) {
+    unsigned char *p = (unsigned char *)buffer;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    h2_put32(p+5, id & 0x7fffffff);
+}
+
+/****************************************************************************************/
+static int h2_queue_frame(struct miniweb_session *s, int type, int flags, unsigned id, const void *payload, size_t len) {
+    struct out_chunk *chunk = outq_chunk(9+len);
+    if(chunk == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    h2_frame_header(chunk->data, len, type, flags, id);
+    if(len > 0)
+        memcpy(chunk->data+9, payload, len);
+    outq_add(s, chunk);
+    return 1;
+}
+
+/****************************************************************************************/
+static void h2_send_rst_stream(struct miniweb_session *s, unsigned id, int error) {
+    unsigned char payload[4];
+    h2_put32(payload, error);
+    h2_queue_frame(s, h2_rst_stream, 0, id, payload, 4);
+}
+
+/****************************************************************************************/
+static void h2_send_window_update(struct miniweb_session *s, unsigned id, unsigned increment) {
+    unsigned char payload[4];
+    h2_put32(payload, increment);
+    h2_queue_frame(s, h2_window_update, 0, id, payload, 4);
+}
+
+/****************************************************************************************/
+// A connection error - say why, then close once that has been sent
+static void h2_error(struct miniweb_session *s, int error) {
+    unsigned char payload[8];
+    if(s->h2->closing)
+        return;
+    h2_put32(payload, s->h2->last_stream_id);
+    h2_put32(payload+4, error);
+    h2_queue_frame(s, h2_goaway, 0, 0, payload, 8);
+    s->h2->closing = 1;
+}
+
+/****************************************************************************************/
+static struct h2_stream *h2_stream_find(struct h2_conn *c, unsigned id) {
+    struct h2_stream *st = c->first_stream;
+    while(st != NULL && st->id != id)
+        st = st->next;
+    return st;
+}
+
+/****************************************************************************************/
+static struct h2_stream *h2_stream_new(struct h2_conn *c, unsigned id) {
+    struct h2_stream *st, **tail;
+    st = mem_alloc(sizeof(struct h2_stream), MINIWEB_MEM_STREAM);
+    if(st == NULL) {
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+    st->req = mem_alloc(sizeof(struct miniweb_session), MINIWEB_MEM_SESSION);
+    if(st->req == NULL) {
+        mem_free(st);
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+    session_init(st->req, -1);
+    st->req->protocol = mem_alloc(7, MINIWEB_MEM_REQUEST);
+    if(st->req->protocol == NULL) {
+        mem_free(st->req);
+        mem_free(st);
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+    strcpy(st->req->protocol, "HTTP/2");
+    clock_gettime(CLOCK_MONOTONIC, &(st->req->start_time));
+
+    st->next          = NULL;
+    st->id            = id;
+    st->send_window   = c->initial_window;
+    st->recv_window   = H2_RECV_WINDOW;
+    st->replying      = 0;
+    st->body_refused  = 0;
+    st->sent          = 0;
+    st->total         = 0;
+    st->content_alloc = 0;
+
+    // Keep them in order, so replies get their turn fairly
+    tail = &c->first_stream;
+    while(*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = st;
+    c->stream_count++;
+    h2_streams++;
+    return st;
+}
+
+/****************************************************************************************/
+static void h2_stream_free(struct h2_conn *c, struct h2_stream *st) {
+    struct h2_stream **link = &c->first_stream;
+    while(*link != st)
+        link = &(*link)->next;
+    *link = st->next;
+    c->stream_count--;
+    session_empty(st->req);
+    mem_free(st->req);
+    mem_free(st);
+}
+
+/****************************************************************************************/
+static void h2_stream_done(struct miniweb_session *s, struct h2_stream *st) {
+    // The reply is complete, so the client can stop sending the rest of the body
+    if(st->body_refused)
+        h2_send_rst_stream(s, st->id, h2_no_error);
+    session_update_metrics(st->req);
+    s->requests_served++;
+    h2_stream_free(s->h2, st);
+}
+
+/****************************************************************************************/
+// Add request body data to the stream
+static int h2_stream_content(struct h2_stream *st, const unsigned char *data, size_t len) {
+    struct miniweb_session *req = st->req;
+    if(len == 0)
+        return 1;
+    if(req->content_read+len+1 > st->content_alloc) {
+        size_t new_size = st->content_alloc ? st->content_alloc : 256;
+        char *content;
+        while(new_size < req->content_read+len+1)
+            new_size *= 2;
+        // The body is never bigger than the limit, so neither is the buffer
+        if(new_size > (size_t)max_body_size+1)
+            new_size = max_body_size+1;
+        content = mem_realloc(req->content, new_size, MINIWEB_MEM_CONTENT);
+        if(content == NULL)
+            return miniweb_log_error(MINIWEB_ERR_NOMEM);
+        req->content = content;
+        st->content_alloc = new_size;
+    }
+    memcpy(req->content+req->content_read, data, len);
+    req->content_read += len;
+    return 1;
+}
+
+/****************************************************************************************/
+// Encode the reply headers and queue them as a HEADERS frame (and CONTINUATIONs if needed)
+static int h2_queue_reply_headers(struct miniweb_session *s, struct h2_stream *st, int end_stream) {
+    static const int status_index[][2] = {{200,8}, {204,9}, {206,10}, {304,11}, {400,12}, {404,13}, {500,14}};
+    struct miniweb_session *req = st->req;
+    struct reply_header *rh;
+    unsigned char *block, *p;
+    size_t size = 16, len, done;
+    int i, flags;
+
+    for(rh = req->first_reply_header; rh != NULL; rh = rh->next)
+        size += strlen(rh->header)+strlen(rh->value)+11;
+    block = mem_alloc(size, MINIWEB_MEM_STREAM);
+    if(block == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    p = block;
+
+    for(i = sizeof(status_index)/sizeof(status_index[0])-1; i >= 0; i--) {
+        if(status_index[i][0] == req->response_code)
+            break;
+    }
+    if(i >= 0) {
+        *p++ = 0x80 | status_index[i][1];
+    } else {
+        char status[12];
+        len = sprintf(status, "%03i", req->response_code);
+        *p++ = 0x08;          // Literal, not indexed, with the name ':status'
+        p += h2_put_int(p, len, 7, 0);
+        memcpy(p, status, len);
+        p += len;
+    }
+
+    for(rh = req->first_reply_header; rh != NULL; rh = rh->next) {
+        // These only mean something on HTTP/1 connections
+        if(strcasecmp(rh->header, "Connection") == 0 || strcasecmp(rh->header, "Keep-Alive") == 0 ||
+           strcasecmp(rh->header, "Transfer-Encoding") == 0 || strcasecmp(rh->header, "Upgrade") == 0)
+            continue;
+        // Literal without indexing, with a new name which must be lower case
+        *p++ = 0x00;
+        len = strlen(rh->header);
+        p += h2_put_int(p, len, 7, 0);
+        for(done = 0; done < len; done++)
+            *p++ = tolower((unsigned char)rh->header[done]);
+        len = strlen(rh->value);
+        p += h2_put_int(p, len, 7, 0);
+        memcpy(p, rh->value, len);
+        p += len;
+    }
+
+    // Split it to fit the client's largest frame
+    size = p-block;
+    done = 0;
+    flags = end_stream ? H2_FLAG_END_STREAM : 0;
+    do {
+        int type = done == 0 ? h2_headers : h2_continuation;
+        len = size-done;
+        if(len > s->h2->max_frame)
+            len = s->h2->max_frame;
+        if(done+len == size)
+            flags |= H2_FLAG_END_HEADERS;
+        if(!h2_queue_frame(s, type, flags, st->id, block+done, len)) {
+            mem_free(block);
+            return 0;
+        }
+        flags = 0;
+        done += len;
+    } while(done < size);
+    mem_free(block);
+    return 1;
+}
+
+/****************************************************************************************/
+// The whole request has arrived, so run the page callback and queue the reply headers
+static void h2_stream_request(struct miniweb_session *s, struct h2_stream *st) {
+    struct miniweb_session *req = st->req;
+    if(req->method == NULL || req->full_url == NULL) {
+        h2_send_rst_stream(s, st->id, h2_protocol_error);
+        h2_stream_free(s->h2, st);
+        return;
+    }
+    if(req->content != NULL) {
+        req->content[req->content_read] = '\0';
+        req->content_length = req->content_read;
+    }
+
+    session_find_target_url(req);
+    if(req->url && req->url->sse_topic) {
+        // Event streams never end, so ask the client to come back over HTTP/1.1
+        h2_send_rst_stream(s, st->id, h2_http_1_1_required);
+        h2_stream_free(s->h2, st);
+        return;
+    }
+    // Other streams carry on, so a refused request gets a reply rather than a close
+    if(!req->refused)
+        req->refused = admit_request(s, req);
+    session_build_reply(req);
+    trace_mark(req, tp_first_write);
+    st->replying = 1;
+    st->total = req->data_used + req->shared_data_size;
+    if(!h2_queue_reply_headers(s, st, st->total == 0)) {
+        h2_send_rst_stream(s, st->id, h2_internal_error);
+        h2_stream_free(s->h2, st);
+    } else if(st->total == 0) {
+        h2_stream_done(s, st);
+    }
+}
+
+/****************************************************************************************/
+// Queue the next DATA frame of a stream's reply. Blobs are referenced rather than copied.
+static int h2_stream_data(struct miniweb_session *s, struct h2_stream *st) {
+    struct miniweb_session *req = st->req;
+    struct h2_conn *c = s->h2;
+    struct out_chunk *chunk, *blob = NULL;
+    size_t n = st->total-st->sent;
+
+    if(n > (size_t)c->send_window)
+        n = c->send_window;
+    if(n > (size_t)st->send_window)
+        n = st->send_window;
+    if(n > c->max_frame)
+        n = c->max_frame;
+
+    if(st->sent < req->data_used) {
+        if(n > req->data_used-st->sent)
+            n = req->data_used-st->sent;
+        chunk = outq_chunk(9+n);
+        if(chunk != NULL)
+            memcpy(chunk->data+9, req->data+st->sent, n);
+    } else if(req->shared_blob != NULL) {
+        // Both are made before either is queued, so a frame header never goes without its data
+        chunk = outq_chunk(9);
+        blob = outq_blob_chunk(req->shared_blob, req->shared_data+st->sent-req->data_used, n);
+        if(chunk != NULL && blob == NULL) {
+            mem_free(chunk);
+            chunk = NULL;
+        } else if(chunk == NULL && blob != NULL) {
+            miniweb_blob_unref(blob->blob);
+            mem_free(blob);
+        }
+    } else {
+        size_t offset = st->sent-req->data_used;
+        chunk = outq_chunk(9+n);
+        if(chunk != NULL && req->shared_fd != -1) {
+            if(pread(req->shared_fd, chunk->data+9, n, req->shared_file_offset+offset) != (ssize_t)n) {
+                mem_free(chunk);
+                return miniweb_log_error(MINIWEB_ERR_WRITE);
+            }
+        } else if(chunk != NULL) {
+            memcpy(chunk->data+9, req->shared_data+offset, n);
+        }
+    }
+    if(chunk == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+
+    h2_frame_header(chunk->data, n, h2_data, st->sent+n == st->total ? H2_FLAG_END_STREAM : 0, st->id);
+    outq_add(s, chunk);
+    if(blob != NULL)
+        outq_add(s, blob);
+
+    st->sent        += n;
+    st->send_window -= n;
+    c->send_window  -= n;
+    return 1;
+}
+
+/****************************************************************************************/
+// Make DATA frames, a frame from each stream in turn, until the flow control windows are
+// used up or there is enough queued to keep the socket busy
+static void h2_pump(struct miniweb_session *s) {
+    struct h2_conn *c = s->h2;
+    int progress = 1;
+    while(progress && s->outq_bytes < H2_QUEUE_LIMIT && c->send_window > 0) {
+        struct h2_stream *st, *next;
+        progress = 0;
+        for(st = c->first_stream; st != NULL && c->send_window > 0; st = next) {
+            next = st->next;
+            if(!st->replying || st->send_window <= 0)
+                continue;
+            if(!h2_stream_data(s, st)) {
+                h2_send_rst_stream(s, st->id, h2_internal_error);
+                h2_stream_free(c, st);
+                continue;
+            }
+            progress = 1;
+            if(st->sent == st->total)
+                h2_stream_done(s, st);
+        }
+    }
+}
+
+/****************************************************************************************/
+static void h2_headers_done(struct miniweb_session *s, unsigned id, int end_stream, const unsigned char *block, size_t len) {
+    struct h2_conn *c = s->h2;
+    struct h2_stream *st = h2_stream_find(c, id);
+    int refuse = 0;
+
+    if(st == NULL) {
+        if(id <= c->last_stream_id) {
+            h2_error(s, h2_protocol_error);
+            return;
+        }
+        c->last_stream_id = id;
+        if(c->stream_count < h2_max_streams)
+            st = h2_stream_new(c, id);
+        refuse = st == NULL;
+        if(st != NULL) {
+            memcpy(&st->req->peer, &s->peer, sizeof(s->peer));
+            trace_start(st->req, s->socket, id);
+        }
+    } else if(st->replying) {
+        h2_error(s, h2_stream_closed);
+        return;
+    }
+
+    if(!h2_decode_headers(c, st ? st->req : NULL, block, len)) {
+        h2_error(s, h2_compression_error);
+        return;
+    }
+    if(refuse) {
+        h2_send_rst_stream(s, id, h2_refused_stream);
+        h2_refused++;
+        return;
+    }
+    trace_mark(st->req, tp_headers);
+    if(!end_stream && miniweb_content_length(st->req) > max_body_size) {
+        // Said up front to be too big, so refused before any of it is read
+        st->body_refused = 1;
+        st->req->refused = 413;
+        end_stream = 1;
+    }
+    if(end_stream)
+        h2_stream_request(s, st);
+}
+
+/****************************************************************************************/
+static void h2_frame(struct miniweb_session *s, int type, int flags, unsigned id, const unsigned char *p, size_t len) {
+    struct h2_conn *c = s->h2;
+    struct h2_stream *st;
+    size_t pad = 0, total = len;
+    unsigned value;
+    int i;
+
+    // Nothing may come between HEADERS and the end of its header block
+    if(c->hblock_stream != 0 && (type != h2_continuation || id != c->hblock_stream)) {
+        h2_error(s, h2_protocol_error);
+        return;
+    }
+    if((type == h2_data || type == h2_headers) && (flags & H2_FLAG_PADDED)) {
+        if(len < 1) {
+            h2_error(s, h2_protocol_error);
+            return;
+        }
+        pad = p[0];
+        p++;
+        len--;
+    }
+
+    switch(type) {
+        case h2_data:
+            if(id == 0 || pad > len) {
+                h2_error(s, h2_protocol_error);
+                return;
+            }
+            len -= pad;
+            if(total > (size_t)c->recv_window) {
+                h2_error(s, h2_flow_control_error);
+                return;
+            }
+            // Every frame is finished with before the next is read, so the connection's room
+            // is given back in batches, once half of it is used. The streams' windows are
+            // what hold back a client sending more body than will be taken.
+            c->recv_window -= total;
+            if(c->recv_window < H2_RECV_WINDOW/2) {
+                h2_send_window_update(s, 0, H2_RECV_WINDOW-c->recv_window);
+                c->recv_window = H2_RECV_WINDOW;
+            }
+            st = h2_stream_find(c, id);
+            if(st == NULL && (id > c->last_stream_id || (id & 1) == 0)) {
+                h2_error(s, h2_protocol_error);   // The stream is idle, not just closed
+                return;
+            }
+            if(st != NULL && st->body_refused)
+                return;   // Thrown away until the client sees the reset
+            if(st == NULL || st->replying) {
+                h2_send_rst_stream(s, id, h2_stream_closed);
+                return;
+            }
+            if(total > (size_t)st->recv_window) {
+                h2_send_rst_stream(s, id, h2_flow_control_error);
+                h2_stream_free(c, st);
+                return;
+            }
+            st->recv_window -= total;
+            if(st->req->content_read+len > (size_t)max_body_size) {
+                // Too big, so it gets a 413 straight away and the rest isn't kept
+                st->body_refused = !(flags & H2_FLAG_END_STREAM);
+                st->req->refused = 413;
+                h2_stream_request(s, st);
+                return;
+            }
+            if(!h2_stream_content(st, p, len)) {
+                h2_send_rst_stream(s, id, h2_internal_error);
+                h2_stream_free(c, st);
+                return;
+            }
+            if(flags & H2_FLAG_END_STREAM) {
+                h2_stream_request(s, st);
+            } else if(st->recv_window < H2_RECV_WINDOW/2) {
+                // Give back the room used, but no more than the rest of the body may need, and
+                // a byte over so a body that is too big can be seen to be
+                size_t room = max_body_size+1-st->req->content_read;
+                if((size_t)st->recv_window < room) {
+                    size_t increment = H2_RECV_WINDOW-st->recv_window;
+                    if(increment > room-st->recv_window)
+                        increment = room-st->recv_window;
+                    h2_send_window_update(s, id, increment);
+                    st->recv_window += increment;
+                }
+            }
+            break;
+
+        case h2_headers:
+            if(id == 0 || (id & 1) == 0) {
+                h2_error(s, h2_protocol_error);
+                return;
+            }
+            if(flags & H2_FLAG_PRIORITY) {
+                if(len < 5) {
+                    h2_error(s, h2_protocol_error);
+                    return;
+                }
+                p   += 5;
+                len -= 5;
+            }
+            if(pad > len) {
+                h2_error(s, h2_protocol_error);
+                return;
+            }
+            len -= pad;
+            if(flags & H2_FLAG_END_HEADERS) {
+                h2_headers_done(s, id, flags & H2_FLAG_END_STREAM, p, len);
+                return;
+            }
+            c->hblock_stream     = id;
+            c->hblock_end_stream = flags & H2_FLAG_END_STREAM;
+            c->hblock_len        = 0;
+            // Fall through - collect the start of the block
+        case h2_continuation:
+            if(c->hblock_stream == 0 || c->hblock_len+len > H2_HEADER_BLOCK_MAX) {
+                h2_error(s, h2_protocol_error);
+                return;
+            }
+            if(len > 0) {
+                char *block = mem_realloc(c->hblock, c->hblock_len+len, MINIWEB_MEM_STREAM);
+                if(block == NULL) {
+                    miniweb_log_error(MINIWEB_ERR_NOMEM);
+                    h2_error(s, h2_internal_error);
+                    return;
+                }
+                c->hblock = block;
+                memcpy(c->hblock+c->hblock_len, p, len);
+                c->hblock_len += len;
+            }
+            if(type == h2_continuation && (flags & H2_FLAG_END_HEADERS)) {
+                c->hblock_stream = 0;
+                h2_headers_done(s, id, c->hblock_end_stream, (unsigned char *)c->hblock, c->hblock_len);
+            }
+            break;
+
+        case h2_rst_stream:
+            st = h2_stream_find(c, id);
+            if(st != NULL)
+                h2_stream_free(c, st);
+            break;
+
+        case h2_settings:
+            if(id != 0 || (flags & H2_FLAG_ACK))
+                break;
+            if(len % 6 != 0) {
+                h2_error(s, h2_frame_size_error);
+                return;
+            }
+            for(i = 0; (size_t)i < len; i += 6) {
+                value = h2_get32(p+i+2);
+                switch((p[i] << 8) | p[i+1]) {
+                    case 4:  // SETTINGS_INITIAL_WINDOW_SIZE, which changes open streams too
+                        if(value > 0x7fffffff) {
+                            h2_error(s, h2_flow_control_error);
+                            return;
+                        }
+                        for(st = c->first_stream; st != NULL; st = st->next)
+                            st->send_window += (int)value-c->initial_window;
+                        c->initial_window = value;
+                        break;
+                    case 5:  // SETTINGS_MAX_FRAME_SIZE
+                        if(value < 16384 || value > 16777215) {
+                            h2_error(s, h2_protocol_error);
+                            return;
+                        }
+                        c->max_frame = value;
+                        break;
+                }
+            }
+            h2_queue_frame(s, h2_settings, H2_FLAG_ACK, 0, NULL, 0);
+            break;
+
+        case h2_ping:
+            if(len != 8) {
+                h2_error(s, h2_frame_size_error);
+                return;
+            }
+            if(!(flags & H2_FLAG_ACK))
+                h2_queue_frame(s, h2_ping, H2_FLAG_ACK, 0, p, 8);
+            break;
+
+        case h2_goaway:
+            c->goaway = 1;
+            break;
+
+        case h2_window_update:
+            if(len != 4) {
+                h2_error(s, h2_frame_size_error);
+                return;
+            }
+            value = h2_get32(p) & 0x7fffffff;
+            if(id == 0) {
+                if((long)c->send_window+value > 0x7fffffff) {
+                    h2_error(s, h2_flow_control_error);
+                    return;
+                }
+                c->send_window += value;
+            } else if((st = h2_stream_find(c, id)) != NULL) {
+                if((long)st->send_window+value > 0x7fffffff) {
+                    h2_send_rst_stream(s, id, h2_flow_control_error);
+                    h2_stream_free(c, st);
+                    return;
+                }
+                st->send_window += value;
+            }
+            break;
+
+        case h2_push_promise:
+            h2_error(s, h2_protocol_error);
+            break;
+
+        default:  // Frames of unknown types are ignored
+            break;
     }
+}
 
-    // Allocate the structure
-    rh = malloc(sizeof(struct reply_header));
-    if(rh == NULL) {
+/****************************************************************************************/
+// Switch the session over to HTTP/2. 'preface' is what is still to come of the client's
+// connection preface.
+static int h2_start(struct miniweb_session *s, const char *preface) {
+    unsigned char settings[6];
+    struct h2_conn *c = mem_alloc(sizeof(struct h2_conn), MINIWEB_MEM_STREAM);
+    if(c == NULL)
         return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    memset(c, 0, sizeof(struct h2_conn));
+    c->preface        = preface;
+    c->send_window    = 65535;
+    c->recv_window    = H2_RECV_WINDOW;
+    c->initial_window = 65535;
+    c->max_frame      = 16384;
+    c->table_max      = H2_TABLE_MAX;
+
+    // Nothing of the HTTP/1 request is needed
+    session_empty(s);
+    s->h2 = c;
+    s->io_state = io_streaming;
+    h2_connections++;
+
+    settings[0] = 0;
+    settings[1] = 3;  // SETTINGS_MAX_CONCURRENT_STREAMS
+    h2_put32(settings+2, h2_max_streams);
+    return h2_queue_frame(s, h2_settings, 0, 0, settings, 6);
+}
+
+/****************************************************************************************/
+static void h2_free(struct miniweb_session *s) {
+    struct h2_conn *c = s->h2;
+    if(c == NULL)
+        return;
+    while(c->first_stream != NULL)
+        h2_stream_free(c, c->first_stream);
+    h2_table_evict(c, 0);
+    if(c->hblock)
+        mem_free(c->hblock);
+    mem_free(c);
+    s->h2 = NULL;
+}
+
+/****************************************************************************************/
+// Handle all the complete frames in the input buffer
+static void h2_process(struct miniweb_session *s) {
+    struct h2_conn *c = s->h2;
+    unsigned char *in = (unsigned char *)s->in_buffer;
+    int pos = 0;
+
+    while(*c->preface != '\0' && pos < s->in_buffer_used) {
+        if(in[pos] != (unsigned char)*c->preface) {
+            session_end(s);
+            return;
+        }
+        c->preface++;
+        pos++;
     }
 
-    // Populate the structure
-    rh->next = NULL; 
-    rh->header = malloc(strlen(header)+1);
-    if(rh->header == NULL) {
-        free(rh);
-        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    while(*c->preface == '\0' && !c->closing && s->in_buffer_used-pos >= 9) {
+        size_t len = (in[pos] << 16) | (in[pos+1] << 8) | in[pos+2];
+        if(len > H2_FRAME_MAX) {
+            h2_error(s, h2_frame_size_error);
+            break;
+        }
+        if((size_t)(s->in_buffer_used-pos) < 9+len)
+            break;
+        h2_frame(s, in[pos+3], in[pos+4], h2_get32(in+pos+5) & 0x7fffffff, in+pos+9, len);
+        pos += 9+len;
     }
-    rh->value = malloc(strlen(value)+1);
-    if(rh->value == NULL) {
-        free(rh->header);
-        free(rh);
+
+    if(pos > 0) {
+        memmove(s->in_buffer, s->in_buffer+pos, s->in_buffer_used-pos);
+        s->in_buffer_used -= pos;
+    }
+}
+
+/****************************************************************************************/
+// WebSockets. The upgrade request is parsed and answered as any other request, and then
+// the connection moves to io_streaming, where frames are read as they arrive and sent
+// from the output queue.
+/****************************************************************************************/
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC11D65"
+
+enum ws_opcode_e { ws_continuation = 0x0, ws_text = 0x1, ws_binary = 0x2,
+                   ws_close = 0x8, ws_ping = 0x9, ws_pong = 0xA };
+
+struct ws_conn {
+   char   *message;                    // A message arriving in fragments
+   size_t message_len;
+   size_t message_alloc;
+   int    message_type;                // 0 when no fragmented message is in progress
+   char   closing;                     // Close once the close frame has been sent
+   char   ping_sent;
+};
+
+/****************************************************************************************/
+static unsigned sha1_rol(unsigned v, int bits) {
+    return (v << bits) | (v >> (32-bits));
+}
+
+// Only needed for the handshake, so small rather than fast
+static void sha1(const unsigned char *data, size_t len, unsigned char digest[20]) {
+    unsigned h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    size_t blocks = (len+9+63)/64, b, i;
+    for(b = 0; b < blocks; b++) {
+        unsigned char block[64];
+        unsigned w[80], a, bb, c, d, e, f, k, t;
+        // The message, a 1 bit, zeros and then the length in bits
+        for(i = 0; i < 64; i++) {
+            size_t pos = b*64+i;
+            block[i] = pos < len ? data[pos] : pos == len ? 0x80 : 0;
+        }
+        if(b == blocks-1) {
+            unsigned long long bits = (unsigned long long)len*8;
+            for(i = 0; i < 8; i++)
+                block[63-i] = bits >> (8*i);
+        }
+        for(i = 0; i < 16; i++)
+            w[i] = ((unsigned)block[i*4] << 24) | (block[i*4+1] << 16) | (block[i*4+2] << 8) | block[i*4+3];
+        for(i = 16; i < 80; i++)
+            w[i] = sha1_rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        a = h[0]; bb = h[1]; c = h[2]; d = h[3]; e = h[4];
+        for(i = 0; i < 80; i++) {
+            if(i < 20) {
+                f = (bb & c) | (~bb & d);
+                k = 0x5A827999;
+            } else if(i < 40) {
+                f = bb ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if(i < 60) {
+                f = (bb & c) | (bb & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = bb ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            t = sha1_rol(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = sha1_rol(bb, 30);
+            bb = a;
+            a = t;
+        }
+        h[0] += a; h[1] += bb; h[2] += c; h[3] += d; h[4] += e;
+    }
+    for(i = 0; i < 20; i++)
+        digest[i] = h[i/4] >> (24-8*(i%4));
+}
+
+/****************************************************************************************/
+static void base64_encode(const unsigned char *data, size_t len, char *out) {
+    static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i;
+    for(i = 0; i < len; i += 3) {
+        unsigned v = data[i] << 16;
+        if(i+1 < len) v |= data[i+1] << 8;
+        if(i+2 < len) v |= data[i+2];
+        *out++ = digits[(v >> 18) & 63];
+        *out++ = digits[(v >> 12) & 63];
+        *out++ = i+1 < len ? digits[(v >> 6) & 63] : '=';
+        *out++ = i+2 < len ? digits[v & 63] : '=';
+    }
+    *out = '\0';
+}
+
+/****************************************************************************************/
+// Answer an upgrade request with 101, ready to switch once it has been sent. Returns 0 if
+// the request isn't a valid upgrade, to be answered as an ordinary request.
+static int ws_handshake(struct miniweb_session *session) {
+    char *key = miniweb_get_header(session, "Sec-WebSocket-Key");
+    char *version = miniweb_get_header(session, "Sec-WebSocket-Version");
+    unsigned char digest[20];
+    char accept[32], *buffer;
+
+    if(strcmp(session->method, "GET") != 0 || strcmp(session->protocol, "HTTP/1.1") != 0 ||
+       !header_has_token(miniweb_get_header(session, "Upgrade"), "websocket") ||
+       !header_has_token(miniweb_get_header(session, "Connection"), "upgrade") ||
+       key == NULL || version == NULL || strcmp(version, "13") != 0)
+        return 0;
+
+    session->ws = mem_alloc(sizeof(struct ws_conn), MINIWEB_MEM_STREAM);
+    buffer = mem_alloc(strlen(key)+sizeof(WS_GUID), MINIWEB_MEM_STREAM);
+    if(session->ws == NULL || buffer == NULL) {
+        mem_free(buffer);
+        mem_free(session->ws);
+        session->ws = NULL;
         return miniweb_log_error(MINIWEB_ERR_NOMEM);
     }
-    strcpy(rh->header,header);
-    strcpy(rh->value,value);
+    memset(session->ws, 0, sizeof(struct ws_conn));
+    strcpy(buffer, key);
+    strcat(buffer, WS_GUID);
+    sha1((unsigned char *)buffer, strlen(buffer), digest);
+    mem_free(buffer);
+    base64_encode(digest, sizeof(digest), accept);
 
-    // Adding the first header? If so, add at state
-    if(session->first_reply_header == NULL) {
-        session->first_reply_header = rh;
+    session->response_code = 101;
+    miniweb_add_header(session, "Upgrade", "websocket");
+    miniweb_add_header(session, "Connection", "Upgrade");
+    miniweb_add_header(session, "Sec-WebSocket-Accept", accept);
+    build_header_data(session);
+    if(session->socket != -1)
+        session->io_state = io_writing_headers;
+    return 1;
+}
+
+/****************************************************************************************/
+// The 101 reply has gone, so the connection is now a WebSocket. The request details are
+// kept, so the callbacks can still look at the URL and headers.
+static void ws_open(struct miniweb_session *s) {
+    if(s->header_data != NULL) {
+        pool_free(s->header_data, s->header_data_alloc);
+        s->header_data = NULL;
+        s->header_data_size = 0;
+        s->header_data_alloc = 0;
+    }
+    s->io_state = io_streaming;
+    ws_connections++;
+    session_update_metrics(s);
+    if(s->url->ws_open)
+        s->url->ws_open(s);
+}
+
+/****************************************************************************************/
+// Called as the session ends, for whatever reason
+static void ws_free(struct miniweb_session *s) {
+    struct ws_conn *ws = s->ws;
+    if(ws == NULL)
+        return;
+    if(s->io_state == io_streaming && s->url && s->url->ws_close)
+        s->url->ws_close(s);
+    if(ws->message)
+        mem_free(ws->message);
+    mem_free(ws);
+    s->ws = NULL;
+}
+
+/****************************************************************************************/
+// Queue a frame from the server, which is never masked
+static int ws_queue_frame(struct miniweb_session *s, int opcode, const void *data, size_t len) {
+    struct out_chunk *chunk;
+    size_t header = len < 126 ? 2 : len < 65536 ? 4 : 10;
+    unsigned char *p;
+    int i;
+
+    chunk = outq_chunk(header+len);
+    if(chunk == NULL)
+        return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    p = (unsigned char *)chunk->data;
+    p[0] = 0x80 | opcode;
+    if(header == 2) {
+        p[1] = len;
+    } else if(header == 4) {
+        p[1] = 126;
+        p[2] = len >> 8;
+        p[3] = len;
     } else {
-        // Add at the end of the list (so they go out in order)
-        struct reply_header *h;
-        h = session->first_reply_header;
-        while(h->next != NULL) {
-            h = h->next;
+        p[1] = 127;
+        for(i = 0; i < 8; i++)
+            p[9-i] = (unsigned long long)len >> (8*i);
+    }
+    if(len > 0)
+        memcpy(p+header, data, len);
+    outq_add(s, chunk);
+    return 1;
+}
+
+/****************************************************************************************/
+// Start the closing handshake, and close the connection once the close frame has gone
+static void ws_close_with(struct miniweb_session *s, int status) {
+    unsigned char payload[2];
+    if(s->ws->closing)
+        return;
+    payload[0] = status >> 8;
+    payload[1] = status;
+    ws_queue_frame(s, ws_close, payload, 2);
+    s->ws->closing = 1;
+}
+
+/****************************************************************************************/
+// Text must be well formed UTF-8 - no overlong forms, surrogates or code points past U+10FFFF
+static int utf8_valid(const unsigned char *p, size_t len) {
+    size_t i = 0, n, k;
+    unsigned cp, min;
+    while(i < len) {
+        if(p[i] < 0x80) {
+            i++;
+            continue;
         }
-        h->next = rh;
+        if((p[i] & 0xe0) == 0xc0) {
+            n = 1; cp = p[i] & 0x1f; min = 0x80;
+        } else if((p[i] & 0xf0) == 0xe0) {
+            n = 2; cp = p[i] & 0x0f; min = 0x800;
+        } else if((p[i] & 0xf8) == 0xf0) {
+            n = 3; cp = p[i] & 0x07; min = 0x10000;
+        } else {
+            return 0;
+        }
+        if(len-i <= n)
+            return 0;
+        for(k = 1; k <= n; k++) {
+            if((p[i+k] & 0xc0) != 0x80)
+                return 0;
+            cp = (cp << 6) | (p[i+k] & 0x3f);
+        }
+        if(cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+            return 0;
+        i += n+1;
     }
     return 1;
 }
 
+static void ws_message(struct miniweb_session *s, int opcode, char *data, size_t len) {
+    if(opcode == ws_text && !utf8_valid((unsigned char *)data, len)) {
+        ws_close_with(s, 1007);
+        return;
+    }
+    ws_messages_in++;
+    if(s->url->ws_message)
+        s->url->ws_message(s, opcode == ws_text ? MINIWEB_WS_TEXT : MINIWEB_WS_BINARY, data, len);
+}
+
 /****************************************************************************************/
-char *miniweb_get_header(struct miniweb_session *session, char *header) {
-    struct request_header *h = session->first_request_header;
-    while(h != NULL) {
-      if(strcmp(header,h->header)==0) {
-         return h->value;
-      }
-      h = h->next;
+static void ws_frame(struct miniweb_session *s, int fin, int opcode, char *data, size_t len) {
+    struct ws_conn *ws = s->ws;
+
+    ws->ping_sent = 0;
+    // Control frames can come in the middle of a fragmented message, but can't be split
+    if((opcode & 0x8) && (!fin || len > 125)) {
+        ws_close_with(s, 1002);
+        return;
+    }
+
+    switch(opcode) {
+        case ws_text:
+        case ws_binary:
+            if(ws->message_type != 0) {
+                ws_close_with(s, 1002);
+                return;
+            }
+            if(fin) {
+                // A whole message in one frame is passed straight from the input buffer,
+                // NULL terminated for the benefit of text
+                char t = data[len];
+                data[len] = '\0';
+                ws_message(s, opcode, data, len);
+                data[len] = t;
+                return;
+            }
+            ws->message_type = opcode;
+            ws->message_len  = 0;
+            // Fall through - the first fragment
+        case ws_continuation:
+            if(ws->message_type == 0) {
+                ws_close_with(s, 1002);
+                return;
+            }
+            if(ws->message_len+len > ws_max_message) {
+                ws_close_with(s, 1009);
+                return;
+            }
+            if(ws->message_len+len+1 > ws->message_alloc) {
+                size_t new_size = ws->message_alloc ? ws->message_alloc : 256;
+                char *message;
+                while(new_size < ws->message_len+len+1)
+                    new_size *= 2;
+                message = mem_realloc(ws->message, new_size, MINIWEB_MEM_STREAM);
+                if(message == NULL) {
+                    miniweb_log_error(MINIWEB_ERR_NOMEM);
+                    ws_close_with(s, 1011);
+                    return;
+                }
+                ws->message = message;
+                ws->message_alloc = new_size;
+            }
+            memcpy(ws->message+ws->message_len, data, len);
+            ws->message_len += len;
+            if(fin) {
+                int type = ws->message_type;
+                ws->message[ws->message_len] = '\0';
+                ws->message_type = 0;
+                ws_message(s, type, ws->message, ws->message_len);
+            }
+            break;
+
+        case ws_close:
+            // Reply with the same status, and then close
+            if(!ws->closing) {
+                ws_queue_frame(s, ws_close, data, len >= 2 ? 2 : 0);
+                ws->closing = 1;
+            }
+            break;
+
+        case ws_ping:
+            ws_queue_frame(s, ws_pong, data, len);
+            break;
+
+        case ws_pong:
+            break;
+
+        default:
+            ws_close_with(s, 1002);
+            break;
     }
-    return NULL;
 }
 
 /****************************************************************************************/
-int miniweb_content_length(struct miniweb_session *session) {
-   if(session->content_length == -1) {
-      char *length_string = miniweb_get_header(session, "Content-Length");
-      if(length_string == NULL) {
-         fprintf(stderr, "No content length header\n");
-      } else {
-         session->content_length = atoi(length_string);
-         if(session->content_length < 0) {
-           fprintf(stderr, "Negative content length mapped to zero");
-           session->content_length = 0;
-         }
-      }
-   }
-   return session->content_length;
+// Handle all the complete frames in the input buffer
+static void ws_process(struct miniweb_session *s) {
+    unsigned char *in = (unsigned char *)s->in_buffer;
+    int pos = 0;
+
+    while(!s->ws->closing && s->in_buffer_used-pos >= 2) {
+        size_t avail = s->in_buffer_used-pos, header = 2, len, i;
+        unsigned char mask[4], *payload;
+
+        // Clients must mask what they send, and no extensions have been agreed
+        if(!(in[pos+1] & 0x80) || (in[pos] & 0x70)) {
+            ws_close_with(s, 1002);
+            break;
+        }
+        len = in[pos+1] & 0x7f;
+        if(len == 126) {
+            header = 4;
+        } else if(len == 127) {
+            header = 10;
+        }
+        if(avail < header+4)
+            break;
+        if(header == 4) {
+            len = (in[pos+2] << 8) | in[pos+3];
+        } else if(header == 10) {
+            unsigned long long big = 0;
+            for(i = 0; i < 8; i++)
+                big = (big << 8) | in[pos+2+i];
+            len = big > ws_max_message ? ws_max_message+1 : big;
+        }
+        if(len > ws_max_message) {
+            ws_close_with(s, 1009);
+            break;
+        }
+        if(avail < header+4+len)
+            break;
+
+        // Unmask the payload down over the mask, which leaves room after it for a NULL
+        memcpy(mask, in+pos+header, 4);
+        payload = in+pos+header;
+        for(i = 0; i < len; i++)
+            payload[i] = payload[i+4] ^ mask[i & 3];
+        ws_frame(s, in[pos] & 0x80, in[pos] & 0x0f, (char *)payload, len);
+        pos += header+4+len;
+        if(s->socket == -1)
+            return;
+    }
+
+    if(pos > 0) {
+        memmove(s->in_buffer, s->in_buffer+pos, s->in_buffer_used-pos);
+        s->in_buffer_used -= pos;
+    }
 }
 
 /****************************************************************************************/
-char *miniweb_content(struct miniweb_session *session) {
-   return session->content;
+int miniweb_register_websocket(char *url, void (*on_open)(struct miniweb_session *s),
+                               void (*on_message)(struct miniweb_session *s, int type, char *data, size_t len),
+                               void (*on_close)(struct miniweb_session *s)) {
+    struct url_reg *ur;
+    if(!miniweb_listen_header("Upgrade") || !miniweb_listen_header("Connection") ||
+       !miniweb_listen_header("Sec-WebSocket-Key") || !miniweb_listen_header("Sec-WebSocket-Version"))
+        return 0;
+    if(!miniweb_register_page("GET", url, NULL))
+        return 0;
+    ur = url_reg_find("GET", url);
+    if(ur == NULL)
+        return 0;
+    ur->websocket  = 1;
+    ur->ws_open    = on_open;
+    ur->ws_message = on_message;
+    ur->ws_close   = on_close;
+    return 1;
 }
+
 /****************************************************************************************/
-int miniweb_listen_header(char *header) {
-   struct listen_header *lh;
-   char *h;
+int miniweb_ws_send(struct miniweb_session *session, int type, void *data, size_t len) {
+    if(session == NULL || session->ws == NULL || session->ws->closing || session->socket == -1)
+        return 0;
+    if(type != MINIWEB_WS_TEXT && type != MINIWEB_WS_BINARY)
+        return 0;
+    // Backpressure - the client isn't keeping up, so the caller should hold back
+    if(session->outq_bytes+len > ws_max_queue) {
+        ws_refused++;
+        return 0;
+    }
+    if(!ws_queue_frame(session, type == MINIWEB_WS_TEXT ? ws_text : ws_binary, data, len))
+        return 0;
+    ws_messages_out++;
+    return 1;
+}
+
+/****************************************************************************************/
+size_t miniweb_ws_queued(struct miniweb_session *session) {
+    if(session == NULL || session->ws == NULL)
+        return 0;
+    return session->outq_bytes;
+}
+
+/****************************************************************************************/
+int miniweb_ws_close(struct miniweb_session *session) {
+    if(session == NULL || session->ws == NULL || session->socket == -1)
+        return 0;
+    ws_close_with(session, 1000);
+    return 1;
+}
+
+/****************************************************************************************/
+int miniweb_set_websocket_limits(size_t max_message, size_t max_queue) {
+    if(max_message == 0 || max_queue == 0)
+        return 0;
+    ws_max_message = max_message;
+    ws_max_queue   = max_queue;
+    return 1;
+}
+
+/****************************************************************************************/
+// Server-Sent Events. Subscribers are answered with the event stream headers, and then
+// sit in io_streaming. Each published event is encoded once into a blob, which is queued
+// to every subscriber of the topic by reference.
+/****************************************************************************************/
+struct sse_topic {
+   struct sse_topic *next;
+   char *name;
+   struct miniweb_session *first_subscriber;
+   unsigned subscribers;
+};
+static struct sse_topic *first_sse_topic;
+
+/****************************************************************************************/
+static struct sse_topic *sse_topic_find(char *name, int create) {
+    struct sse_topic *t;
+    for(t = first_sse_topic; t != NULL; t = t->next) {
+        if(strcmp(t->name, name) == 0)
+            return t;
+    }
+    if(!create)
+        return NULL;
+    t = mem_alloc(sizeof(struct sse_topic), MINIWEB_MEM_CONFIG);
+    if(t == NULL) {
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+    t->name = mem_strdup(name, MINIWEB_MEM_CONFIG);
+    if(t->name == NULL) {
+        mem_free(t);
+        miniweb_log_error(MINIWEB_ERR_NOMEM);
+        return NULL;
+    }
+    t->first_subscriber = NULL;
+    t->subscribers = 0;
+    t->next = first_sse_topic;
+    first_sse_topic = t;
+    return t;
+}
+
+/****************************************************************************************/
+// Answer a subscription with the stream headers. There is no Content-Length, as the
+// stream only ends when the connection closes.
+static int sse_subscribe(struct miniweb_session *session) {
+    if(session->socket == -1)
+        return 0;
+    session->response_code = 200;
+    miniweb_add_header(session, "Server","Miniweb/0.0.1 (Linux)");
+    miniweb_add_header(session, "Content-Type", "text/event-stream");
+    miniweb_add_header(session, "Cache-Control", "no-cache");
+    session->sse_topic = session->url->sse_topic;
+    build_header_data(session);
+    session->io_state = io_writing_headers;
+    return 1;
+}
+
+/****************************************************************************************/
+// The headers have gone, so start sending events
+static void sse_open(struct miniweb_session *s) {
+    struct sse_topic *t = s->sse_topic;
+    if(s->header_data != NULL) {
+        pool_free(s->header_data, s->header_data_alloc);
+        s->header_data = NULL;
+        s->header_data_size = 0;
+        s->header_data_alloc = 0;
+    }
+    s->io_state = io_streaming;
+    s->sse_next = t->first_subscriber;
+    t->first_subscriber = s;
+    t->subscribers++;
+    sse_subscribers++;
+    session_update_metrics(s);
+}
+
+/****************************************************************************************/
+// Called as the session ends, for whatever reason
+static void sse_free(struct miniweb_session *s) {
+    struct miniweb_session **link;
+    if(s->sse_topic == NULL)
+        return;
+    for(link = &s->sse_topic->first_subscriber; *link != NULL; link = &(*link)->sse_next) {
+        if(*link == s) {
+            *link = s->sse_next;
+            s->sse_topic->subscribers--;
+            break;
+        }
+    }
+    s->sse_topic = NULL;
+    s->sse_next = NULL;
+}
+
+/****************************************************************************************/
+// Encode an event into 'out', or just measure it if 'out' is NULL. Each line of the data
+// gets a field of its own, and a blank line ends the event.
+static size_t sse_encode(const char *data, char *out) {
+    size_t len = 0;
+    do {
+        size_t n = strcspn(data, "\r\n");
+        if(out != NULL) {
+            memcpy(out+len, "data: ", 6);
+            memcpy(out+len+6, data, n);
+            out[len+6+n] = '\n';
+        }
+        len += n+7;
+        data += n;
+        if(data[0] == '\r' && data[1] == '\n')
+            data++;
+        if(data[0] != '\0')
+            data++;
+    } while(data[0] != '\0');
+    if(out != NULL)
+        out[len] = '\n';
+    return len+1;
+}
+
+/****************************************************************************************/
+// Queue an event to one subscriber, dealing with those that aren't keeping up
+static void sse_queue(struct miniweb_session *s, struct miniweb_blob *blob, size_t len) {
+    // A burst of events can fill the queue before the main loop gets to send any
+    if(s->outq_chunks >= (unsigned)sse_max_queue && session_write_queue(s) < 0)
+        return;
+    if(s->outq_chunks >= (unsigned)sse_max_queue) {
+        if(sse_slow_policy == MINIWEB_SSE_DROP) {
+            sse_dropped++;
+            session_end(s);
+            return;
+        }
+        // Only the latest event is still of interest
+        sse_coalesced += outq_drop_unsent(s);
+    }
+    outq_add_blob(s, blob, blob->data, len);
+}
+
+/****************************************************************************************/
+int miniweb_register_sse(char *url, char *topic) {
+    struct sse_topic *t;
+    struct url_reg *ur;
+    if(url == NULL || topic == NULL)
+        return 0;
+    t = sse_topic_find(topic, 1);
+    if(t == NULL)
+        return 0;
+    if(!miniweb_register_page("GET", url, NULL))
+        return 0;
+    ur = url_reg_find("GET", url);
+    if(ur == NULL)
+        return 0;
+    ur->sse_topic = t;
+    return 1;
+}
 
-   // First check if we already have the header in the list?
-   lh = first_listen_header;
-   while(lh != NULL) {
-      if(strcmp(header,lh->header)==0)
-          return 1;
-      lh = lh->next;
-   }
+/****************************************************************************************/
+int miniweb_sse_publish(char *topic, char *data) {
+    struct sse_topic *t;
+    struct miniweb_session *s, *next;
+    struct miniweb_blob *blob;
+    size_t len;
 
-   // Nope - we need to add it.
-   int len = strlen(header);
-   h = malloc(len+1);
-   if(h == NULL)
-     return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    if(topic == NULL || data == NULL)
+        return 0;
+    t = sse_topic_find(topic, 0);
+    if(t == NULL)
+        return 0;
+    sse_events++;
+    if(t->first_subscriber == NULL)
+        return 1;
 
-   lh = malloc(sizeof(struct listen_header));
-   if(lh == NULL) {
-     free(h);
-     return miniweb_log_error(MINIWEB_ERR_NOMEM);
-   }
-   strcpy(h,header);
-   lh->header = h;
-   lh->len = len;
-   lh->next = first_listen_header;
-   first_listen_header = lh; 
-   return 1;
+    len = sse_encode(data, NULL);
+    blob = miniweb_blob_new(len);
+    if(blob == NULL)
+        return 0;
+    sse_encode(data, blob->data);
+    for(s = t->first_subscriber; s != NULL; s = next) {
+        next = s->sse_next;
+        sse_queue(s, blob, len);
+    }
+    // The subscribers' queues hold their own references
+    miniweb_blob_unref(blob);
+    return 1;
 }
 
 /****************************************************************************************/
-int miniweb_response(struct miniweb_session *session, int response) {
-   session->response_code = response;
-   return 1;
+int miniweb_sse_subscribers(char *topic) {
+    struct sse_topic *t;
+    if(topic == NULL)
+        return 0;
+    t = sse_topic_find(topic, 0);
+    return t == NULL ? 0 : (int)t->subscribers;
 }
 
 /****************************************************************************************/
-void  miniweb_tidyup(void) {
-   while(first_session != NULL) {
-      struct miniweb_session *next = first_session->next;
-      session_end(first_session);
-      free(first_session);
-      first_session = next;
-   }
-   while(first_listen_header != NULL) {
-      struct listen_header *lh = first_listen_header;
-      first_listen_header = lh->next;
-      if(lh->header)
-        free(lh->header);
-      free(lh);
-   }
+int miniweb_set_sse_limits(int max_queue, int slow_policy) {
+    if(max_queue < 1)
+        return 0;
+    if(slow_policy != MINIWEB_SSE_DROP && slow_policy != MINIWEB_SSE_COALESCE)
+        return 0;
+    sse_max_queue   = max_queue;
+    sse_slow_policy = slow_policy;
+    return 1;
+}
 
-   while(first_url_reg != NULL) {
-      struct url_reg *url = first_url_reg;
-      first_url_reg = url->next;
-      if(url->method)
-        free(url->method);
-      if(url->pattern_start)
-        free(url->pattern_start);
-      if(url->pattern_end)
-        free(url->pattern_end);
-      free(url);
-   }
+/****************************************************************************************/
+static void sse_tidyup(void) {
+    while(first_sse_topic != NULL) {
+        struct sse_topic *t = first_sse_topic;
+        first_sse_topic = t->next;
+        mem_free(t->name);
+        mem_free(t);
+    }
+}
 
-   if(listen_socket != -1) {
-     close(listen_socket);
-     listen_socket = -1;
-   }
+/****************************************************************************************/
+// Connections in io_streaming - send what is queued, and make more to send
+static void stream_flush(struct miniweb_session *s) {
+    while(s->socket != -1) {
+        if(session_write_queue(s) != 1)
+            return;
+        if(s->h2 == NULL)
+            break;
+        h2_pump(s);
+        if(s->outq_head == NULL)
+            break;
+    }
+    // Everything has gone, so it's safe to close if we've been asked to
+    if(s->h2 != NULL && (s->h2->closing || (s->h2->goaway && s->h2->first_stream == NULL)))
+        session_end(s);
+    else if(s->ws != NULL && s->ws->closing)
+        session_end(s);
 }
+
 /****************************************************************************************/
-void miniweb_stats(void) {
-   struct url_reg *url = first_url_reg;
-   printf("%i active session, %i timed out\n", session_count, sessions_timed_out);
-   printf("Count   Time    URL\n");
-   while(url != NULL) {
-      printf("%6i ", url->request_count);
-      printf("%6i.%09i ", (int)url->request_time.tv_sec, (int)url->request_time.tv_nsec); 
-      if(url->pattern_end == NULL) {
-         printf("%s %s\n", url->method, url->pattern_start);
-      } else {
-         printf("%s %s*%s\n", url->method, url->pattern_start, url->pattern_end);
-      }
-      url = url->next;
-   } 
-   putchar('\n');
+static void stream_process(struct miniweb_session *s) {
+    if(s->h2 != NULL)
+        h2_process(s);
+    else if(s->ws != NULL)
+        ws_process(s);
+    else if(s->sse_topic != NULL)
+        s->in_buffer_used = s->in_buffer_scanned = 0;  // Subscribers have nothing to say
+    if(s->socket != -1)
+        stream_flush(s);
 }
 
 /****************************************************************************************/
-static void write_more_headers(struct miniweb_session *s) {
-    if(s->header_data) {
-        while(s->write_pointer != s->header_data_size) {
-            int n = write(s->socket, s->header_data+s->write_pointer, s->header_data_size-s->write_pointer);
-            if(n >= 0) {
-                s->write_pointer += n;
-            } else if(n == -1) {
-                switch(errno) {
-                    case EINTR:
-                       break;
-                    case EWOULDBLOCK:
-                       return; // Go away and come back later
-                    default: 
-                       miniweb_log_error(MINIWEB_ERR_WRITE);
-                       return; // Go away and come back later
-                }
+// Check on a streaming connection that has been quiet for 'idle' seconds. Returns 1 if
+// it should be closed.
+static int stream_idle(struct miniweb_session *s, int idle) {
+    if(s->ws != NULL) {
+        // Ping the client to see if it is still there. The ping being sent resets the clock,
+        // so a client that doesn't answer goes after three times WS_PING_SECS.
+        if(idle >= 2*WS_PING_SECS)
+            return 1;
+        if(idle >= WS_PING_SECS && !s->ws->ping_sent) {
+            s->ws->ping_sent = 1;
+            ws_queue_frame(s, ws_ping, NULL, 0);
+        }
+        return 0;
+    }
+    if(s->sse_topic != NULL) {
+        // A comment keeps proxies from timing out quiet streams, and finds clients that have
+        // gone. Clients that stop reading are dropped.
+        if(s->outq_head != NULL)
+            return idle >= 2*WS_PING_SECS;
+        if(idle >= WS_PING_SECS) {
+            struct out_chunk *chunk = outq_chunk(2);
+            if(chunk != NULL) {
+                memcpy(chunk->data, ":\n", 2);
+                outq_add(s, chunk);
             }
         }
+        return 0;
     }
-    s->write_pointer = 0;
-    if(s->data != NULL) {
-        s->io_state = io_writing_data;   
-    } else  if(s->shared_data != NULL) {
-        s->io_state = io_writing_shared_data;   
-    } else {
-        // Close older 1.0 (non-persistent) connections
-        if(strcmp(s->protocol, "HTTP/1.1") != 0)
-            session_end(s);
-        else
-            s->io_state = io_reading;   
+    if(s->h2 != NULL && s->h2->first_stream == NULL && s->outq_head == NULL && keepalive_timeout_secs > 0)
+        return idle > keepalive_timeout_secs;
+    return idle > timeout_secs;
+}
+
+/****************************************************************************************/
+// Work out which part of a request the session is in, for its deadline
+static int session_phase(struct miniweb_session *s) {
+    switch(s->io_state) {
+        case io_handshake:
+            return phase_header;
+        case io_reading:
+            if(s->parser_state == p_content)
+                return phase_body;
+            if(s->parser_state == p_method && s->in_buffer_used == 0 && s->requests_served > 0)
+                return phase_idle;
+            return phase_header;
+        case io_writing_headers:
+        case io_writing_data:
+        case io_writing_shared_data:
+            return phase_write;
+        default:
+            return phase_stream;
     }
 }
 
+// Bytes moved so far in the phase, which each earn the session more time
+static unsigned long long session_progress(struct miniweb_session *s, int phase) {
+    if(phase == phase_body)
+        return s->content_read;
+    if(phase != phase_write)
+        return 0;
+    if(s->io_state == io_writing_headers)
+        return s->write_pointer;
+    if(s->io_state == io_writing_data)
+        return s->header_data_size + s->write_pointer;
+    return s->header_data_size + s->data_used + s->write_pointer;
+}
+
 /****************************************************************************************/
-static void write_more_data(struct miniweb_session *s) {
-    if(s->data) {
-        while(s->write_pointer != s->data_size) {
-            int n = write(s->socket, s->data+s->write_pointer, s->data_size-s->write_pointer);
-            if(n >= 0) {
-                s->write_pointer += n;
-            } else if(n == -1) {
-                switch(errno) {
-                    case EINTR:
-                       break;
-                    case EWOULDBLOCK:
-                       return; // Go away and come back later
-                    default: 
-                       miniweb_log_error(MINIWEB_ERR_WRITE);
-                       return; // Go away and come back later
-                }
-            }
-        }
+// Called about once a second for each open session. Phases are noticed here rather than
+// where they change, so the request path pays nothing and deadlines are good to a second.
+// Returns 1 if the session is out of time.
+static int session_deadline(struct miniweb_session *s, time_t now) {
+    int phase = session_phase(s);
+    int limit;
+
+    if(phase != s->phase || s->requests_served != s->phase_request) {
+        s->phase = phase;
+        s->phase_request = s->requests_served;
+        s->phase_start = now;
     }
-    s->write_pointer = 0;
-    if(s->shared_data != NULL) {
-        s->io_state = io_writing_shared_data;   
-    } else {
-        // Close older 1.0 (non-persistent) connections
-        if(strcmp(s->protocol, "HTTP/1.1") != 0)
-            session_end(s);
-        else
-            s->io_state = io_reading;   
+    if(phase == phase_stream)
+        return stream_idle(s, now-s->last_action);
+    if(phase == phase_idle)
+        return s->last_action+keepalive_timeout_secs < now;
+    // Any phase is over if nothing at all happens for timeout_secs
+    if(s->last_action+timeout_secs < now)
+        return 1;
+    limit = deadline_secs[phase];
+    if(limit == 0)
+        return 0;
+    if(deadline_min_rate[phase] > 0)
+        limit += session_progress(s, phase)/deadline_min_rate[phase];
+    return s->phase_start+limit < now;
+}
+
+/****************************************************************************************/
+int miniweb_set_deadline(int phase, int secs, int min_rate) {
+    if(secs < 0 || min_rate < 0)
+        return 0;
+    switch(phase) {
+        case MINIWEB_DEADLINE_HEADER:
+            if(min_rate != 0)      // Headers are small, so only their total time counts
+                return 0;
+            deadline_secs[phase_header] = secs;
+            break;
+        case MINIWEB_DEADLINE_BODY:
+            deadline_secs[phase_body] = secs;
+            deadline_min_rate[phase_body] = min_rate;
+            break;
+        case MINIWEB_DEADLINE_WRITE:
+            deadline_secs[phase_write] = secs;
+            deadline_min_rate[phase_write] = min_rate;
+            break;
+        case MINIWEB_DEADLINE_IDLE:
+            if(secs == 0 || min_rate != 0)
+                return 0;
+            keepalive_timeout_secs = secs;
+            break;
+        default:
+            return 0;
     }
+    return 1;
 }
+
 /****************************************************************************************/
-static void write_more_shared_data(struct miniweb_session *s) {
-    if(s->shared_data) {
-        while(s->write_pointer != s->shared_data_size) {
-            int n = write(s->socket, s->shared_data+s->write_pointer, s->shared_data_size-s->write_pointer);
-            if(n >= 0) {
-                s->write_pointer += n;
-            } else if(n == -1) {
-                switch(errno) {
-                    case EINTR:
-                       break;
-                    case EWOULDBLOCK:
-                       return; // Go away and come back later
-                    default: 
-                       miniweb_log_error(MINIWEB_ERR_WRITE);
-                       return; // Go away and come back later
-                }
-            }
-        }
+int miniweb_set_http2(int max_streams) {
+    if(max_streams < 0)
+        return 0;
+    h2_max_streams = max_streams;
+    return 1;
+}
+
+/****************************************************************************************/
+static int session_parse(struct miniweb_session *session);
+
+// Parse and answer whatever input is buffered. Replies are written straight away, and
+// once one has been sent any pipelined request behind it is parsed.
+static void session_process(struct miniweb_session *s) {
+    while(s->socket != -1 && s->io_state == io_reading && s->in_buffer_used > s->in_buffer_scanned) {
+        session_parse(s);
+        if(s->socket != -1 && s->io_state == io_writing_headers)
+            write_more_headers(s);
     }
+    if(s->socket != -1 && s->io_state == io_streaming)
+        stream_process(s);
+}
 
-    session_update_metrics(s);
-    s->write_pointer = 0;
-    // Close older 1.0 (non-persistent) connections
-    if(strcmp(s->protocol, "HTTP/1.1") != 0)
-        session_end(s);
-    else
-        s->io_state = io_reading;   
+/****************************************************************************************/
+// Called once the contents of read_scratch have been parsed. Anything still unparsed is
+// the start of a request (or frame) that has not all arrived yet, so it gets copied into a
+// buffer of the session's own, sized to fit. Otherwise the session holds no input buffer.
+static int session_keep_input(struct miniweb_session *session) {
+    size_t size;
+    char *buffer;
+
+    if(session->in_buffer != read_scratch || session->in_buffer_used == 0) {
+       session->in_buffer = NULL;   // Either all used, or let go of when the session ended
+       session->in_buffer_size = 0;
+       session->in_buffer_used = 0;
+       session->in_buffer_scanned = 0;
+       reads_in_place++;
+       return 1;
+    }
+    size = pool_round(session->in_buffer_used);
+    buffer = pool_alloc(size);
+    if(buffer == NULL) {
+       session_end(session);   // Lets go of read_scratch too
+       return miniweb_log_error(MINIWEB_ERR_NOMEM);
+    }
+    memcpy(buffer, session->in_buffer, session->in_buffer_used);
+    session->in_buffer      = buffer;
+    session->in_buffer_size = size;
+    reads_kept++;
+    return 1;
 }
+
 /****************************************************************************************/
 static int session_read(struct miniweb_session *session) {
-    int n;
+    int n, shared;
+    size_t limit = session->h2 ? H2_FRAME_MAX+9 : session->ws ? ws_max_message+14 : MAX_HEADER_SIZE;
     if(session->socket == -1) 
        return 0;
     /* If connection is established then start communicating */
     if(session->in_buffer == NULL) {
-        // Need to allocate the buffer?
-        size_t new_size = 128; 
-        session->in_buffer = malloc(new_size);
-        if(session->in_buffer == NULL) {
-            return miniweb_log_error(MINIWEB_ERR_NOMEM);
-        }
-        session->in_buffer_size = new_size;
+        // Nothing left over from last time, so read into the shared buffer
+        session->in_buffer = read_scratch;
+        session->in_buffer_size = limit < sizeof(read_scratch) ? limit : sizeof(read_scratch);
         session->in_buffer_used = 0;
+        session->in_buffer_scanned = 0;
     } else if(session->in_buffer_size == session->in_buffer_used) {
         // Need to grow the buffer?
-        if(session->in_buffer_size == MAX_HEADER_SIZE) {
+        if((size_t)session->in_buffer_size >= limit) {
             session_end(session);
             return miniweb_log_error(MINIWEB_ERR_HDRTOBIG);
         } else {
-            size_t new_size = session->in_buffer_size*3/2+1;
-            if(new_size > MAX_HEADER_SIZE)
-                new_size = MAX_HEADER_SIZE;
+            size_t new_size = pool_round(session->in_buffer_size+1);
+            if(new_size > limit)
+                new_size = limit;
             
-            char *buffer = realloc(session->in_buffer, new_size);
+            char *buffer = pool_grow(session->in_buffer, session->in_buffer_used, session->in_buffer_size, new_size);
             if(buffer == NULL) {
                 session_end(session);
                 return miniweb_log_error(MINIWEB_ERR_NOMEM);
@@ -1076,27 +6317,45 @@ static int session_read(struct miniweb_session *session) {
         }
     }
 
-    n = read( session->socket,session->in_buffer+session->in_buffer_used,session->in_buffer_size-session->in_buffer_used);
+    shared = session->in_buffer == read_scratch;
+    n = session->transport->read(session, session->in_buffer+session->in_buffer_used,session->in_buffer_size-session->in_buffer_used);
+    if (n < 0 && (errno == EWOULDBLOCK || errno == EINTR)) {
+        if(shared) {  // TLS record not complete yet, and nothing read
+            session->in_buffer = NULL;
+            session->in_buffer_size = 0;
+        }
+        return 1;
+    }
     if (n < 1) {
         session_end(session);
         return 0;
     }
-
-    int scan_pos = session->in_buffer_used;
     session->in_buffer_used += n;
+    session_process(session);
+    return shared ? session_keep_input(session) : 1;
+}
+
+/****************************************************************************************/
+// Run the parser over any input not yet scanned. Stops after a complete request, leaving
+// anything pipelined behind it in the buffer until the reply has been sent.
+static int session_parse(struct miniweb_session *session) {
+    int scan_pos = session->in_buffer_scanned;
     int consumed = 0;
-    while(scan_pos != session->in_buffer_used) {
+    // A reply that fails ends the session, which takes the input buffer with it
+    while(session->socket != -1 && scan_pos != session->in_buffer_used && session->io_state == io_reading) {
         int c = session->in_buffer[scan_pos];
         scan_pos++;
         switch(session->parser_state) {
             case p_method:
                 if(DEBUG_FSM) debug_fsm(scan_pos-1,c,"p_method");
                 // Start recording transaction time from now
-                if(scan_pos == 1)
+                if(scan_pos == 1) {
                     clock_gettime(CLOCK_MONOTONIC, &(session->start_time));
+                    trace_start(session, session->socket, 0);
+                }
                 if(c == ' ') {
                     int len = scan_pos-consumed-1;
-                    session->method = malloc(len+1);
+                    session->method = mem_alloc(len+1, MINIWEB_MEM_REQUEST);
                     if(session->method == NULL) {
                         session->parser_state = p_error;
                     } else {
@@ -1113,7 +6372,7 @@ static int session_read(struct miniweb_session *session) {
                 if(DEBUG_FSM) debug_fsm(scan_pos-1, c,"p_url");
                 if(c == ' ') {
                    int len = scan_pos-consumed-1;
-                   session->full_url = malloc(len+1);
+                   session->full_url = mem_alloc(len+1, MINIWEB_MEM_REQUEST);
                    if(session->full_url == NULL) {
                        session->parser_state = p_error;
                    } else {
@@ -1130,7 +6389,7 @@ static int session_read(struct miniweb_session *session) {
                 if(DEBUG_FSM) debug_fsm(scan_pos-1, c,"p_protocol");
                 if(c == '\r') {
                    int len = scan_pos-consumed-1;
-                   session->protocol = malloc(len+1);
+                   session->protocol = mem_alloc(len+1, MINIWEB_MEM_REQUEST);
                    if(session->protocol == NULL) {
                        session->parser_state = p_error;
                    } else {
@@ -1209,16 +6468,28 @@ static int session_read(struct miniweb_session *session) {
                         printf("Ready to run a query\n"); 
 
                     consumed = scan_pos;
-                    miniweb_content_length(session); // Pull content lenght from headers
-                    // TODO - Add limit to content lenght
-                    if(strcmp(session->method,"POST")==0 && session->content_length > 0) {
-                        session->content = malloc(session->content_length+1); // Add space for a NULL
-                        if(session->content != NULL) {
-                           session->content_read = 0;
-                           session->parser_state = p_content;
-                        } else {
-                           printf("Unable to allocate content_memory\n"); 
-                           session->parser_state = p_error;
+                    trace_mark(session, tp_headers);
+                    if(strcmp(session->method, "PRI") == 0 && strcmp(session->protocol, "HTTP/2.0") == 0 &&
+                       h2_max_streams > 0) {
+                        // The start of the HTTP/2 preface
+                        if(!h2_start(session, H2_PREFACE+18))
+                            session->parser_state = p_error;
+                    } else if(!session_check_framing(session)) {
+                        // Unsafe or too big to read, so it is refused and the connection closed
+                        session->parser_state = p_method;
+                        session_find_target_url(session);
+                        session_send_reply(session);
+                    // Any request with a body needs it read, even if only to skip over it. With
+                    // no handler to read it, it is thrown away as it arrives rather than kept.
+                    } else if(session->content_length > 0) {
+                        session->content_read = 0;
+                        session->parser_state = p_content;
+                        if(session_find_target_url(session)) {
+                           session->content = mem_alloc(session->content_length+1, MINIWEB_MEM_CONTENT); // Add space for a NULL
+                           if(session->content == NULL) {
+                              printf("Unable to allocate content_memory\n"); 
+                              session->parser_state = p_error;
+                           }
                         }
                     } else {
                         session->parser_state = p_method;
@@ -1232,33 +6503,26 @@ static int session_read(struct miniweb_session *session) {
                 break;
             case p_content:
                 if(DEBUG_FSM) debug_fsm(scan_pos-1, c,"p_content");
-
-                consumed = scan_pos;
-                // First add the chracter 'c';
-                if(consumed != session->in_buffer_used) {
-                    session->content[session->content_read] = c;
-                    session->content_read++;
-                }
-                // Now add the rest of the buffer
-                if(consumed != session->in_buffer_used) {
-                    // Work out how much content we have left to read
-                    int data_to_copy = session->in_buffer_used-consumed;
+                {
+                    // Copy 'c' and as much of the rest of the buffer as is part of the content
+                    int data_to_copy = session->in_buffer_used-(scan_pos-1);
                     if(data_to_copy > session->content_length-session->content_read)
                        data_to_copy = session->content_length-session->content_read;
-                    // move over what is in the buffer
-                    memcpy(session->content+session->content_read, 
-                           session->in_buffer+consumed,
-                           data_to_copy);
-                    consumed += data_to_copy;
+                    if(session->content != NULL)
+                       memcpy(session->content+session->content_read, 
+                              session->in_buffer+scan_pos-1,
+                              data_to_copy);
                     session->content_read += data_to_copy;
+                    scan_pos += data_to_copy-1;
+                    consumed = scan_pos;
                 }
                 // If we have all the content
                 if(session->content_read == session->content_length) {
                     // Append a NULL to the content
-                    session->content[session->content_read] = '\0'; 
+                    if(session->content != NULL)
+                       session->content[session->content_read] = '\0'; 
                     session->parser_state = p_method;
                     // Exec request
-                    session_find_target_url(session);
                     session_send_reply(session); 
                 }     
                 break;
@@ -1269,6 +6533,18 @@ static int session_read(struct miniweb_session *session) {
                 break;
         }
     }
+    // The reply may have failed and ended the session
+    if(session->socket == -1)
+        return 0;
+    // Nothing more can be made of the connection
+    if(session->parser_state == p_error) {
+        static const char bad_request[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n"
+                                          "Connection: close\r\n\r\n";
+        // Say why, if the socket will take it straight away, before closing
+        session->transport->write(session, bad_request, sizeof(bad_request)-1);
+        session_end(session);
+        return miniweb_log_error(MINIWEB_ERR_PARSE);
+    }
     if(consumed) {
         // Throw away the data 
         if(consumed != session->in_buffer_used) {
@@ -1277,67 +6553,270 @@ static int session_read(struct miniweb_session *session) {
         }
         session->in_buffer_used -= consumed;
     }
+    session->in_buffer_scanned = scan_pos-consumed;
     return 1;
 }
 
+/****************************************************************************************/
+int miniweb_set_socket_option(int option, int value) {
+   if(value < 0)
+      return 0;
+   switch(option) {
+      case MINIWEB_SOCKOPT_REUSEADDR:    sockopt_reuseaddr    = value; break;
+      case MINIWEB_SOCKOPT_BACKLOG:      sockopt_backlog      = value; break;
+      case MINIWEB_SOCKOPT_DEFER_ACCEPT: sockopt_defer_accept = value; break;
+      case MINIWEB_SOCKOPT_FASTOPEN:     sockopt_fastopen     = value; break;
+      case MINIWEB_SOCKOPT_NODELAY:      sockopt_nodelay      = value; break;
+      case MINIWEB_SOCKOPT_CORK:         sockopt_cork         = value; break;
+      case MINIWEB_SOCKOPT_SNDBUF:       sockopt_sndbuf       = value; break;
+      case MINIWEB_SOCKOPT_RCVBUF:       sockopt_rcvbuf       = value; break;
+      default:                           return 0;
+   }
+   return 1;
+}
+
+/****************************************************************************************/
+// Options that have to be set before bind() and listen(). Accepted sockets inherit the
+// buffer sizes. Failures are only reported, as the server still works without them.
+static void listen_socket_options(int fd, int family, int before_bind) {
+   if(before_bind) {
+      int v6only = 0;    // IPv6 listeners take IPv4 connections too
+      if(family == AF_UNIX)
+         return;
+      if(family == AF_INET6 && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(int)) == -1)
+         perror("setsockopt IPV6_V6ONLY");
+      if(sockopt_reuseaddr && setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &sockopt_reuseaddr, sizeof(int)) == -1)
+         perror("setsockopt SO_REUSEADDR");
+      if(sockopt_sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sockopt_sndbuf, sizeof(int)) == -1)
+         perror("setsockopt SO_SNDBUF");
+      if(sockopt_rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &sockopt_rcvbuf, sizeof(int)) == -1)
+         perror("setsockopt SO_RCVBUF");
+      return;
+   }
+   if(family == AF_UNIX)
+      return;
+#ifdef TCP_DEFER_ACCEPT
+   if(sockopt_defer_accept && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &sockopt_defer_accept, sizeof(int)) == -1)
+      perror("setsockopt TCP_DEFER_ACCEPT");
+#endif
+#ifdef TCP_FASTOPEN
+   if(sockopt_fastopen && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &sockopt_fastopen, sizeof(int)) == -1)
+      perror("setsockopt TCP_FASTOPEN");
+#endif
+}
+
 /****************************************************************************************/
 int miniweb_set_port(int port) {
    port_no = port;
    return 1;
 }
 
+/****************************************************************************************/
+// Listeners. Each is opened when miniweb_run() is first called, and retried every few
+// seconds if that fails. All of them share one select() loop and the same accept path.
+/****************************************************************************************/
+int miniweb_add_listener(char *address) {
+   struct listener *l, **link;
+   char host[INET6_ADDRSTRLEN];
+   char *port_str, *end;
+   long port;
+
+   l = mem_calloc(sizeof(struct listener), MINIWEB_MEM_CONFIG);
+   if(l == NULL)
+      return miniweb_log_error(MINIWEB_ERR_NOMEM);
+   l->fd = -1;
+   if(strncmp(address, "unix:", 5) == 0) {
+      struct sockaddr_un *sun = (struct sockaddr_un *)&l->addr;
+      if(address[5] == '\0' || strlen(address+5) >= sizeof(sun->sun_path)) {
+         mem_free(l);
+         return 0;
+      }
+      sun->sun_family = AF_UNIX;
+      strcpy(sun->sun_path, address+5);
+      l->addr_len = sizeof(struct sockaddr_un);
+   } else {
+      // "[v6 address]:port" or "v4 address:port", with an empty address for any
+      int v6 = address[0] == '[';
+      port_str = v6 ? strstr(address, "]:") : strrchr(address, ':');
+      if(port_str == NULL || port_str-address-v6 >= (long)sizeof(host)) {
+         mem_free(l);
+         return 0;
+      }
+      memcpy(host, address+v6, port_str-address-v6);
+      host[port_str-address-v6] = '\0';
+      port_str += v6 ? 2 : 1;
+      port = strtol(port_str, &end, 10);
+      if(end == port_str || *end != '\0' || port < 1 || port > 65535) {
+         mem_free(l);
+         return 0;
+      }
+      if(v6) {
+         struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&l->addr;
+         sin6->sin6_family = AF_INET6;
+         sin6->sin6_port   = htons(port);
+         if(host[0] != '\0' && inet_pton(AF_INET6, host, &sin6->sin6_addr) != 1) {
+            mem_free(l);
+            return 0;
+         }
+         l->addr_len = sizeof(struct sockaddr_in6);
+      } else {
+         struct sockaddr_in *sin = (struct sockaddr_in *)&l->addr;
+         sin->sin_family = AF_INET;
+         sin->sin_port   = htons(port);
+         if(host[0] != '\0' && inet_pton(AF_INET, host, &sin->sin_addr) != 1) {
+            mem_free(l);
+            return 0;
+         }
+         l->addr_len = sizeof(struct sockaddr_in);
+      }
+   }
+   l->address = mem_strdup(address, MINIWEB_MEM_CONFIG);
+   if(l->address == NULL) {
+      mem_free(l);
+      return miniweb_log_error(MINIWEB_ERR_NOMEM);
+   }
+   // Keep them in the order they were added, for the stats
+   for(link = &first_listener; *link != NULL; link = &(*link)->next)
+      ;
+   *link = l;
+   return 1;
+}
+
+/****************************************************************************************/
+static int listener_open(struct listener *l, time_t now) {
+   int family = l->addr.ss_family;
+   l->retry_time = now+3;
+
+   if(debug_level >= MINIWEB_DEBUG_ALL) {
+      fprintf(stderr, "Attempting to set up listening socket %s\n", l->address);
+   }
+#ifdef MINIWEB_STATIC
+   // Reserve everything before serving anything
+   if(!static_init())
+      return 0;
+#endif
+
+   l->fd = socket(family, SOCK_STREAM, 0);
+   if(l->fd < 0) {
+      return miniweb_log_error(MINIWEB_ERR_SOCKET);
+   }
+
+   listen_socket_options(l->fd, family, 1);
+
+   // A socket file left behind by an earlier run would stop the bind
+   if(family == AF_UNIX) {
+      struct stat st;
+      char *path = ((struct sockaddr_un *)&l->addr)->sun_path;
+      if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+         unlink(path);
+   }
+
+   /* Now bind the host address using bind() call.*/
+   if (bind(l->fd, (struct sockaddr *)&l->addr, l->addr_len) < 0) {
+      close(l->fd);
+      l->fd = -1;
+      return miniweb_log_error(MINIWEB_ERR_BIND);
+   }
+   if(debug_level >= MINIWEB_DEBUG_ALL) {
+      fprintf(stderr, "Listening socket opened\n");
+   }
+   int fileflags;
+   if((fileflags = fcntl(l->fd, F_GETFL, 0)) == -1) {
+      perror("fcntl F_GETFL");
+   }
+   if((fcntl(l->fd, F_SETFL, fileflags | O_NONBLOCK)) == -1) {
+      perror("fcntl F_SETFL, O_NONBLOCK");
+   }
+   listen_socket_options(l->fd, family, 0);
+   if(listen(l->fd,sockopt_backlog) == -1 ) {
+      close(l->fd);
+      l->fd = -1;
+      return miniweb_log_error(MINIWEB_ERR_LISTEN);
+   }
+   // Needed to find the end of each request, to decide if connections are kept alive
+   // and to send partial replies
+   miniweb_listen_header("Content-Length");
+   miniweb_listen_header("Transfer-Encoding");
+   miniweb_listen_header("Connection");
+   miniweb_listen_header("Range");
+   miniweb_listen_header("If-Range");
+   return 1;
+}
+
+/****************************************************************************************/
+static void listener_accept(struct listener *l, time_t now) {
+   int newsockfd; 
+   struct sockaddr_storage cli_addr;
+   socklen_t clilen;
+
+   clilen = sizeof(cli_addr);
+
+   /* Accept actual connection from the client */
+   newsockfd = accept(l->fd, (struct sockaddr *)&cli_addr, &clilen);
+   if (newsockfd < 0) {
+      miniweb_log_error(MINIWEB_ERR_ACCEPT);
+      perror("Accept");
+      return;
+   }
+   if(debug_level >= MINIWEB_DEBUG_ALL) {
+      fprintf(stderr, "SOCKET ACCPTED\n");
+   }
+   sessions_accepted++;
+   l->accepted++;
+   int fileflags;
+   if((fileflags = fcntl(newsockfd, F_GETFL, 0)) == -1) {
+      perror("fcntl F_GETFL");
+   }
+   if((fcntl(newsockfd, F_SETFL, fileflags | O_NONBLOCK)) == -1) {
+      perror("fcntl F_SETFL, O_NONBLOCK");
+   }
+   if(sockopt_nodelay && l->addr.ss_family != AF_UNIX &&
+      setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &sockopt_nodelay, sizeof(int)) == -1) {
+      perror("setsockopt TCP_NODELAY");
+   }
+
+   struct miniweb_session *session = session_new(newsockfd);
+   if(session == NULL) {
+      sessions_rejected++;
+      l->rejected++;
+      session_reject(newsockfd, 503);
+      close(newsockfd);
+      return;
+   }
+   memcpy(&session->peer, &cli_addr, clilen < sizeof(session->peer) ? clilen : sizeof(session->peer));
+   session->listener = l;
+   l->open++;
+   session->last_action = now;
+   if(trace_ring != NULL)
+      session->accept_ns = trace_now();
+   if(!admit_connection(session)) {
+      l->rejected++;
+      session_reject(newsockfd, 429);
+      session_end(session);
+   } else if(tls_enabled && !session_tls_start(session)) {
+      session_end(session);
+   }
+}
+
 /****************************************************************************************/
 int miniweb_run(int timeout_ms) {
-     static time_t listen_retry_time = 0;
      static time_t last_now = 0;
      time_t now = time(NULL);
+     struct listener *l;
 
-     if(listen_socket < 0 && listen_retry_time <= now) {
-         listen_retry_time = now+3;
-         struct sockaddr_in serv_addr;
-
-         if(debug_level >= MINIWEB_DEBUG_ALL) {
-            fprintf(stderr, "Attempting to set up listening socket\n");
-         }
-
-         listen_socket = socket(AF_INET, SOCK_STREAM, 0);
-         if(listen_socket < 0) {
-             miniweb_log_error(MINIWEB_ERR_SOCKET);
-             return 0;
-         }
-     
-         /* Initialize socket structure */
-         bzero((char *) &serv_addr, sizeof(serv_addr));
-   
-         serv_addr.sin_family      = AF_INET;
-         serv_addr.sin_addr.s_addr = INADDR_ANY;
-         serv_addr.sin_port        = htons(port_no);
-   
-         /* Now bind the host address using bind() call.*/
-         if (bind(listen_socket, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-             close(listen_socket);
-             listen_socket = -1;
-             miniweb_log_error(MINIWEB_ERR_BIND);
-             return 0;
-         }
-         if(debug_level >= MINIWEB_DEBUG_ALL) {
-            fprintf(stderr, "Listening socket opened\n");
-         }
-         int fileflags;
-         if((fileflags = fcntl(listen_socket, F_GETFL, 0)) == -1) {
-             perror("fcntl F_GETFL");
-         }
-         if((fcntl(listen_socket, F_SETFL, fileflags | O_NONBLOCK)) == -1) {
-             perror("fcntl F_SETFL, O_NONBLOCK");
-         }
-         if(listen(listen_socket,100) == -1 ) {
-             close(listen_socket);
-             listen_socket = -1;
-             miniweb_log_error(MINIWEB_ERR_LISTEN);
+     if(first_listener == NULL) {
+         // Nothing added, so listen on all IPv4 addresses as miniweb always has
+         char address[24];
+         sprintf(address, "0.0.0.0:%i", port_no);
+         if(!miniweb_add_listener(address))
              return 0;
-         }
      }
- 
+     // Any that fail are left for now, so the others can still be served
+     for(l = first_listener; l != NULL; l = l->next) {
+         if(l->fd < 0 && l->retry_time <= now)
+             listener_open(l, now);
+     }
+
      fd_set rfds, wfds, efds;
      struct timeval tv;
      int retval;
@@ -1345,54 +6824,83 @@ int miniweb_run(int timeout_ms) {
      FD_ZERO(&rfds);
      FD_ZERO(&wfds);
      FD_ZERO(&efds);
-     if(listen_socket >= 0 && session_count < max_sessions) {
-         FD_SET(listen_socket, &rfds);
-         FD_SET(listen_socket, &efds);
-         max_fd = listen_socket+1;
+     // Keep accepting when all sessions are in use, to turn the extra connections away
+     for(l = first_listener; l != NULL; l = l->next) {
+         if(l->fd >= 0) {
+             FD_SET(l->fd, &rfds);
+             FD_SET(l->fd, &efds);
+             if(l->fd >= max_fd)
+                 max_fd = l->fd+1;
+         }
      }
 
      // Remove the head of the list, if it is stale
+#ifndef MINIWEB_STATIC
      if(first_session != NULL) {
-         if(first_session->last_action + free_timeout_secs < now) {
+         if(first_session->socket == -1 && first_session->last_action + free_timeout_secs < now) {
              struct miniweb_session *next = first_session->next;
              session_empty(first_session);
-             free(first_session);
+             mem_free(first_session);
              session_count--;
              first_session = next;
          }
      }
+#endif
 
      struct miniweb_session *s = first_session;
+     int pending_input = 0;
      while(s != NULL) {
          if(s->socket >= 0) {
              switch(s->io_state) { 
+                 case io_handshake:
                  case io_reading:
-                    FD_SET(s->socket, &rfds);
+                    // Input already decrypted by TLS won't wake select()
+                    if(s->io_state == io_reading && s->transport->pending(s))
+                       pending_input = 1;
+                    if(s->io_want == want_write)
+                       FD_SET(s->socket, &wfds);
+                    else
+                       FD_SET(s->socket, &rfds);
                     break;
                  case io_writing_headers:
                  case io_writing_data:
                  case io_writing_shared_data:
                     FD_SET(s->socket, &wfds);
+                    if(s->io_want == want_read)
+                       FD_SET(s->socket, &rfds);
+                    break;
+                 case io_streaming:
+                    if(s->transport->pending(s))
+                       pending_input = 1;
+                    FD_SET(s->socket, &rfds);
+                    if(s->outq_head != NULL || s->io_want == want_write)
+                       FD_SET(s->socket, &wfds);
                     break;
              };
              if(max_fd < s->socket+1) 
                 max_fd = s->socket+1;
          }
+#ifndef MINIWEB_STATIC
          // Remove and free any stale sessions at the end of the list
          if(s->next != NULL && s->next->next == NULL) {
              struct miniweb_session *tail = s->next;
-             if(tail->last_action + free_timeout_secs < now) {
+             if(tail->socket == -1 && tail->last_action + free_timeout_secs < now) {
                 session_empty(tail);
-                free(tail);
+                mem_free(tail);
                 session_count--;
                 s->next = NULL;
              }
          }
+#endif
 
          s = s->next;
      } 
      tv.tv_sec  = (timeout_ms/1000);
      tv.tv_usec = (timeout_ms%1000)*1000;
+     if(pending_input) {
+         tv.tv_sec  = 0;
+         tv.tv_usec = 0;
+     }
 
      retval = select(max_fd, &rfds, &wfds, &efds, &tv);
      if (retval == -1) {
@@ -1400,21 +6908,45 @@ int miniweb_run(int timeout_ms) {
            miniweb_log_error(MINIWEB_ERR_SELECT);
          return 0;
      }
-     else if (!retval) {
-         // Nothing to do 
-         return 0;
+     else if (!retval && !pending_input) {
+         // Nothing to do, so a good time to write out the access log
+         if(access_ring != NULL)
+             miniweb_access_log_flush();
+         // Deadlines still have to be checked when all is quiet
+         if(last_now == now)
+             return 0;
      }
 
      // Process the session sockets first 
      s = first_session;
      while(s != NULL) {
-         if(s->socket >= 0 && FD_ISSET(s->socket, &rfds)) {
+         if(s->socket >= 0 && s->io_state == io_handshake &&
+            (FD_ISSET(s->socket, &rfds) || FD_ISSET(s->socket, &wfds))) {
+            int rtn = s->transport->handshake(s);
+            s->last_action = now;
+            if(rtn < 0) {
+               session_end(s);
+            } else if(rtn > 0) {
+               const char *protocol = s->transport->protocol(s);
+               s->io_state = io_reading;
+               if(protocol != NULL && strcmp(protocol, "h2") == 0 && !h2_start(s, H2_PREFACE))
+                  session_end(s);
+               // The request may have arrived along with the end of the handshake
+               session_read(s);
+            }
+         } else if(s->socket >= 0 && (FD_ISSET(s->socket, &rfds) || 
+                   ((s->io_state == io_reading || s->io_state == io_streaming) && s->transport->pending(s)))) {
             session_read(s);
             s->last_action = now;
          }
          if(s->socket >= 0 && FD_ISSET(s->socket, &wfds)) {
              switch(s->io_state) { 
+                 case io_handshake:
+                    break; 
                  case io_reading:
+                    // A TLS read that needed to write
+                    if(s->io_want == want_write)
+                       session_read(s);
                     break; 
                  case io_writing_headers:
                     write_more_headers(s);
@@ -1425,7 +6957,15 @@ int miniweb_run(int timeout_ms) {
                  case io_writing_shared_data:
                     write_more_shared_data(s);
                     break;
+                 case io_streaming:
+                    if(s->io_want == want_write)
+                       session_read(s);
+                    if(s->socket >= 0)
+                       stream_flush(s);
+                    break;
              };
+             s->last_action = now;
+             session_process(s);
          }
          if(s->socket >= 0 && FD_ISSET(s->socket, &efds)) {
             session_end(s);
@@ -1436,7 +6976,8 @@ int miniweb_run(int timeout_ms) {
      if(last_now != now) { 
          s = first_session;
          while(s != NULL) {
-             if(s->socket != -1 && s->last_action+timeout_secs < now) {
+             if(s->socket != -1 && session_deadline(s, now)) {
+                 phase_timeouts[(int)s->phase]++;
                  session_end(s);
                  sessions_timed_out++;
              }
@@ -1446,37 +6987,13 @@ int miniweb_run(int timeout_ms) {
      }
 
      // Accept any new connections
-     if(listen_socket >= 0 && FD_ISSET(listen_socket, &rfds)) {
-         int newsockfd; 
-         struct sockaddr_in cli_addr;
-         socklen_t clilen;
-
-         clilen = sizeof(cli_addr);
-     
-         /* Accept actual connection from the client */
-         newsockfd = accept(listen_socket, (struct sockaddr *)&cli_addr, &clilen);
-         if (newsockfd < 0) {
-             miniweb_log_error(MINIWEB_ERR_ACCEPT);
-             perror("Accept");
-             return 0;
-         }
-         if(debug_level >= MINIWEB_DEBUG_ALL) {
-             fprintf(stderr, "SOCKET ACCPTED\n");
-         }
-         int fileflags;
-         if((fileflags = fcntl(newsockfd, F_GETFL, 0)) == -1) {
-             perror("fcntl F_GETFL");
-         }
-         if((fcntl(newsockfd, F_SETFL, fileflags | O_NONBLOCK)) == -1) {
-             perror("fcntl F_SETFL, O_NONBLOCK");
-         }
-         
-         struct miniweb_session *session = session_new(newsockfd);
-         if(session == NULL) {
-            close(newsockfd);
-         }
-         session->last_action = now;
+     for(l = first_listener; l != NULL; l = l->next) {
+         if(l->fd >= 0 && FD_ISSET(l->fd, &rfds))
+             listener_accept(l, now);
      }
+     // Too busy to wait for a quiet moment, so write out the access log before it fills
+     if(access_ring != NULL && access_head - __atomic_load_n(&access_tail, __ATOMIC_ACQUIRE) >= access_size/2)
+         miniweb_access_log_flush();
      return 0;
 }
 /****************************************************************************************/
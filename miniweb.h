@@ -1,5 +1,6 @@
 #ifndef MINIWEB_H
 #define MINIWEB_H
+#include <time.h>
 
 /* Error codes */
 #define MINIWEB_ERR_NOMEM    (-1)
@@ -11,6 +12,9 @@
 #define MINIWEB_ERR_HDRTOBIG (-7)
 #define MINIWEB_ERR_SELECT   (-8)
 #define MINIWEB_ERR_WRITE    (-9)
+#define MINIWEB_ERR_TLS      (-10)
+#define MINIWEB_ERR_PARSE    (-11)
+#define MINIWEB_ERR_COUNT    (12)   /* One more than the number of error codes */
 
 /* Debug level settings */
 #define MINIWEB_DEBUG_NONE   (0)
@@ -18,31 +22,196 @@
 #define MINIWEB_DEBUG_DATA   (2)
 #define MINIWEB_DEBUG_ALL    (3)
 
-/* Opaque data type */
+/* Socket options */
+#define MINIWEB_SOCKOPT_REUSEADDR    (1)
+#define MINIWEB_SOCKOPT_BACKLOG      (2)
+#define MINIWEB_SOCKOPT_DEFER_ACCEPT (3)
+#define MINIWEB_SOCKOPT_FASTOPEN     (4)
+#define MINIWEB_SOCKOPT_NODELAY      (5)
+#define MINIWEB_SOCKOPT_CORK         (6)
+#define MINIWEB_SOCKOPT_SNDBUF       (7)
+#define MINIWEB_SOCKOPT_RCVBUF       (8)
+
+/* Request phases with their own deadline */
+#define MINIWEB_DEADLINE_HEADER (1)
+#define MINIWEB_DEADLINE_BODY   (2)
+#define MINIWEB_DEADLINE_WRITE  (3)
+#define MINIWEB_DEADLINE_IDLE   (4)
+
+/* WebSocket message types */
+#define MINIWEB_WS_TEXT    (1)
+#define MINIWEB_WS_BINARY  (2)
+
+/* What to do with Server-Sent Events subscribers that aren't keeping up */
+#define MINIWEB_SSE_DROP      (1)
+#define MINIWEB_SSE_COALESCE  (2)
+
+/* What miniweb's heap memory is used for, as counted by miniweb_memory_stats() */
+#define MINIWEB_MEM_SESSION    (0)   /* Session structures */
+#define MINIWEB_MEM_BUFFER     (1)   /* Pooled input, header and reply buffers, including cached ones */
+#define MINIWEB_MEM_HEADER     (2)   /* Request and reply header lists */
+#define MINIWEB_MEM_REQUEST    (3)   /* Copies of the method, URL, protocol and wildcard */
+#define MINIWEB_MEM_CONTENT    (4)   /* POST bodies */
+#define MINIWEB_MEM_CONFIG     (5)   /* Registered pages, listened for headers and SSE topics */
+#define MINIWEB_MEM_STREAM     (6)   /* HTTP/2, WebSocket and SSE state, and queued output */
+#define MINIWEB_MEM_COMPRESS   (7)   /* Deflate streams */
+#define MINIWEB_MEM_OTHER      (8)   /* Blobs, statistics, traces and the access log */
+#define MINIWEB_MEM_CATEGORIES (9)
+
+/* Template rendering flags */
+#define MINIWEB_TEMPLATE_SHARE_TAIL (1)   /* Send the closing literal from the template, without copying it */
+
+/* Opaque data types */
 struct miniweb_session;
+struct miniweb_blob;
+struct miniweb_template;
+
+/* A value for a template slot: text for "{{name}}" and "{{{name}}}", a number for "{{name:int}}" */
+union miniweb_template_value {
+   char      *text;
+   long long number;
+};
+
+/* Buffer pool statistics */
+struct miniweb_pool_stats {
+   unsigned hits;          /* Buffers reused from the pool */
+   unsigned misses;        /* Buffers that had to come from the heap */
+   unsigned resizes;       /* Buffers that had to move up a size class */
+   unsigned failures;      /* Allocations refused by the limit, or by the heap */
+   size_t   bytes_in_use;
+   size_t   bytes_cached;
+   size_t   bytes_peak;
+   size_t   limit;
+};
+
+/* Heap use. Bytes include a small header kept in front of each block. */
+struct miniweb_memory_stats {
+   size_t        bytes[MINIWEB_MEM_CATEGORIES];     /* In use now */
+   size_t        peak[MINIWEB_MEM_CATEGORIES];
+   unsigned long allocs[MINIWEB_MEM_CATEGORIES];
+   unsigned long frees[MINIWEB_MEM_CATEGORIES];
+   unsigned long failures[MINIWEB_MEM_CATEGORIES];
+   size_t        total_bytes;
+   size_t        total_peak;
+};
+
+/* Request latency, in microseconds */
+struct miniweb_latency {
+   unsigned count;         /* Requests timed */
+   unsigned p50;
+   unsigned p90;
+   unsigned p99;
+   unsigned p999;
+   unsigned max;
+};
+
+/* Access log record. Strings are truncated to fit. */
+struct miniweb_access_record {
+   time_t   when;
+   char     client[46];     /* IPv4 or IPv6 address */
+   unsigned short port;
+   char     method[16];
+   char     protocol[12];
+   char     url[256];
+   int      status;
+   unsigned long long bytes;
+   unsigned us_taken;
+   char     headers[256];   /* The listened for headers, as "Name: value" separated by tabs */
+};
 
 /* Setup functions */
 int    miniweb_set_port(int portno);
+int    miniweb_add_listener(char *address);
 int    miniweb_register_page(char *method, char *url, void (*callback)(struct miniweb_session *));
 int    miniweb_listen_header(char *header);
+int    miniweb_set_socket_option(int option, int value);
+int    miniweb_set_tls(char *cert_file, char *key_file);
+int    miniweb_set_http2(int max_streams);
+int    miniweb_set_websocket_limits(size_t max_message, size_t max_queue);
+int    miniweb_set_sse_limits(int max_queue, int slow_policy);
+int    miniweb_set_max_body(size_t bytes);
+int    miniweb_set_keepalive(int idle_secs, int max_requests);
+int    miniweb_set_deadline(int phase, int secs, int min_rate);
+int    miniweb_set_pool_limit(size_t bytes);
+int    miniweb_set_allocator(void *(*alloc)(size_t size), void (*release)(void *p));
+int    miniweb_set_compression(int level, size_t threshold);
+int    miniweb_page_compression(char *method, char *url, int enable);
+int    miniweb_set_client_limits(unsigned max_connections, unsigned requests_per_sec, unsigned burst);
+int    miniweb_set_max_in_flight(unsigned requests);
+int    miniweb_set_route_limit(char *method, char *url, unsigned max_active);
+int    miniweb_enable_metrics(char *url);
 
 /* Request processing functions */
 char  *miniweb_get_header(struct miniweb_session *session, char *header);
 int    miniweb_add_header(struct miniweb_session *session, char *header, char *value);
 size_t miniweb_write(struct miniweb_session *session, void *data, size_t len);
+size_t miniweb_printf(struct miniweb_session *session, char *format, ...) __attribute__((format(printf, 2, 3)));
 size_t miniweb_shared_data_buffer(struct miniweb_session *session, void *data, size_t len);
+size_t miniweb_shared_blob(struct miniweb_session *session, struct miniweb_blob *blob);
+size_t miniweb_shared_file(struct miniweb_session *session, char *filename);
 int    miniweb_response(struct miniweb_session *session, int response);
+int    miniweb_no_compression(struct miniweb_session *session);
 char  *miniweb_get_wildcard(struct miniweb_session *session);
 int    miniweb_content_length(struct miniweb_session *session);
 char  *miniweb_content(struct miniweb_session *session);
 
+/* WebSockets */
+int    miniweb_register_websocket(char *url, void (*on_open)(struct miniweb_session *),
+                                  void (*on_message)(struct miniweb_session *, int type, char *data, size_t len),
+                                  void (*on_close)(struct miniweb_session *));
+int    miniweb_ws_send(struct miniweb_session *session, int type, void *data, size_t len);
+size_t miniweb_ws_queued(struct miniweb_session *session);
+int    miniweb_ws_close(struct miniweb_session *session);
+
+/* Server-Sent Events */
+int    miniweb_register_sse(char *url, char *topic);
+int    miniweb_sse_publish(char *topic, char *data);
+int    miniweb_sse_subscribers(char *topic);
+
+/* JSON replies */
+int    miniweb_json_object_start(struct miniweb_session *session);
+int    miniweb_json_object_end(struct miniweb_session *session);
+int    miniweb_json_array_start(struct miniweb_session *session);
+int    miniweb_json_array_end(struct miniweb_session *session);
+int    miniweb_json_key(struct miniweb_session *session, char *key);
+int    miniweb_json_string(struct miniweb_session *session, char *value);
+int    miniweb_json_int(struct miniweb_session *session, long long value);
+int    miniweb_json_double(struct miniweb_session *session, double value);
+int    miniweb_json_bool(struct miniweb_session *session, int value);
+int    miniweb_json_null(struct miniweb_session *session);
+
+/* Templates */
+struct miniweb_template *miniweb_template_compile(char *text);
+struct miniweb_template *miniweb_template_load(char *filename);
+int    miniweb_template_slot(struct miniweb_template *t, char *name);
+int    miniweb_template_render(struct miniweb_session *session, struct miniweb_template *t,
+                               union miniweb_template_value *values, int flags);
+void   miniweb_template_free(struct miniweb_template *t);
+
+/* Shared, reference counted data */
+struct miniweb_blob *miniweb_blob_new(size_t len);
+struct miniweb_blob *miniweb_blob_wrap(void *data, size_t len, void (*release)(void *data));
+void  *miniweb_blob_data(struct miniweb_blob *blob);
+size_t miniweb_blob_size(struct miniweb_blob *blob);
+struct miniweb_blob *miniweb_blob_ref(struct miniweb_blob *blob);
+void   miniweb_blob_unref(struct miniweb_blob *blob);
+void   miniweb_blob_publish(struct miniweb_blob **slot, struct miniweb_blob *blob);
+struct miniweb_blob *miniweb_blob_acquire(struct miniweb_blob **slot);
+
 /* Process / admin */
 int   miniweb_run(int timeout_ms);
 void  miniweb_stats(void);
+int   miniweb_pool_stats(struct miniweb_pool_stats *stats);
+int   miniweb_memory_stats(struct miniweb_memory_stats *stats);
+int   miniweb_latency(char *method, char *url, struct miniweb_latency *latency, int reset);
+int   miniweb_set_trace(int sample_every, int records);
+int   miniweb_trace_dump(char *filename);
 void  miniweb_tidyup(void);
 
 /* Error and status functions */
 int   miniweb_set_debug_level(int level);
+int   miniweb_access_log(int records, char *filename, void (*callback)(struct miniweb_access_record *record));
+int   miniweb_access_log_flush(void);
 int   miniweb_log_callback(void (*callback)(char *url, int response_code, unsigned us_taken));
 int   miniweb_error_callback(void (*callback)(int error, char *text));
 char *miniweb_error_text(int error);
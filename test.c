@@ -0,0 +1,173 @@
+/////////////////////////////////////////////////////////////
+// test.c : Tests for miniweb's internals
+//
+// Includes miniweb.c directly, to check its static functions
+// against known answers - HPACK header decoding and Huffman
+// strings from the examples in RFC 7541 Appendix C, and the
+// numbers written by the JSON writer.
+//
+// Usage: miniweb_test
+//   Prints each failure, then a count, and exits non-zero if
+//   anything failed.
+/////////////////////////////////////////////////////////////
+#include "miniweb.c"
+
+static int tests, failures;
+
+/////////////////////////////////////////////////////////////
+static void check(int ok, const char *what) {
+    tests++;
+    if(!ok) {
+        failures++;
+        printf("FAIL: %s\n", what);
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// Turns "8286 8441" into bytes, ignoring the spaces
+static size_t from_hex(const char *hex, unsigned char *out) {
+    size_t n = 0;
+    unsigned v;
+    while(*hex) {
+        if(*hex == ' ') {
+            hex++;
+            continue;
+        }
+        sscanf(hex, "%2x", &v);
+        out[n++] = v;
+        hex += 2;
+    }
+    return n;
+}
+
+/////////////////////////////////////////////////////////////
+// RFC 7541 C.1 - integers, with the prefix each example uses
+/////////////////////////////////////////////////////////////
+static void test_integers(void) {
+    static const struct { const char *hex; int prefix; size_t value; } cases[] = {
+        {"0a",     5, 10},      // C.1.1
+        {"1f9a0a", 5, 1337},    // C.1.2
+        {"2a",     8, 42},      // C.1.3
+    };
+    unsigned char in[16], out[16];
+    char what[64];
+    for(size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        const unsigned char *p = in;
+        size_t len = from_hex(cases[i].hex, in), value = 0;
+        sprintf(what, "integer %zu decodes", cases[i].value);
+        check(h2_get_int(&p, in+len, cases[i].prefix, &value) && value == cases[i].value && p == in+len, what);
+        sprintf(what, "integer %zu encodes", cases[i].value);
+        check(h2_put_int(out, cases[i].value, cases[i].prefix, 0) == len && memcmp(out, in, len) == 0, what);
+    }
+}
+
+/////////////////////////////////////////////////////////////
+// RFC 7541 C.4 and C.6 - Huffman coded strings
+/////////////////////////////////////////////////////////////
+static void test_huffman(void) {
+    static const struct { const char *hex, *text; } cases[] = {
+        {"f1e3 c2e5 f23a 6ba0 ab90 f4ff",                             "www.example.com"},
+        {"a8eb 1064 9cbf",                                            "no-cache"},
+        {"25a8 49e9 5ba9 7d7f",                                       "custom-key"},
+        {"25a8 49e9 5bb8 e8b4 bf",                                    "custom-value"},
+        {"6402",                                                      "302"},
+        {"aec3 771a 4b",                                              "private"},
+        {"d07a be94 1054 d444 a820 0595 040b 8166 e082 a62d 1bff",    "Mon, 21 Oct 2013 20:13:21 GMT"},
+        {"9d29 ad17 1863 c78f 0b97 c8e9 ae82 ae43 d3",                "https://www.example.com"},
+    };
+    unsigned char in[64];
+    char out[128], what[80];
+    size_t in_len, out_len;
+    for(size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        in_len = from_hex(cases[i].hex, in);
+        sprintf(what, "Huffman \"%s\"", cases[i].text);
+        check(h2_huffman_decode(in, in_len, out, &out_len) && out_len == strlen(cases[i].text) &&
+              memcmp(out, cases[i].text, out_len) == 0, what);
+    }
+
+    // Padding must be the start of EOS - all ones, and less than a byte of it
+    in_len = from_hex("a8eb 1064 9cbe", in);
+    check(!h2_huffman_decode(in, in_len, out, &out_len), "Huffman padding with a zero is refused");
+    in_len = from_hex("a8eb 1064 9cbf ff", in);
+    check(!h2_huffman_decode(in, in_len, out, &out_len), "Huffman padding of a whole byte is refused");
+}
+
+/////////////////////////////////////////////////////////////
+// RFC 7541 C.3 and C.4 - three requests on one connection, whose
+// dynamic table must end up the same with or without Huffman coding
+/////////////////////////////////////////////////////////////
+static void test_header_blocks(const char *name, const char *blocks[3]) {
+    static const char *names[]  = {"custom-key",   "cache-control", ":authority"};
+    static const char *values[] = {"custom-value", "no-cache",      "www.example.com"};
+    static const size_t sizes[] = {57, 110, 164};
+    static struct h2_conn c;
+    unsigned char in[64];
+    char what[80];
+    size_t len;
+
+    memset(&c, 0, sizeof(c));
+    c.table_max = H2_TABLE_MAX;
+    for(int i = 0; i < 3; i++) {
+        len = from_hex(blocks[i], in);
+        sprintf(what, "%s request %i decodes", name, i+1);
+        check(h2_decode_headers(&c, NULL, in, len), what);
+        sprintf(what, "%s request %i leaves %zu bytes in the table", name, i+1, sizes[i]);
+        check(c.table_count == i+1 && c.table_size == sizes[i], what);
+        for(int j = 0; j <= i && j < c.table_count; j++) {
+            sprintf(what, "%s request %i table entry %i", name, i+1, j+1);
+            check(strcmp(c.table[j].name, names[2-i+j]) == 0 && strcmp(c.table[j].value, values[2-i+j]) == 0, what);
+        }
+    }
+    h2_table_evict(&c, 0);
+}
+
+/////////////////////////////////////////////////////////////
+// JSON numbers are the shortest text that reads back the same
+/////////////////////////////////////////////////////////////
+static void test_json_double(void) {
+    static const struct { double value; const char *text; } cases[] = {
+        {0.1,                 "0.1"},
+        {1e300,               "1e+300"},
+        {5e-324,              "5e-324"},
+        {1e-310,              "1e-310"},
+        {1.0/3,               "0.3333333333333333"},
+        {0.1+0.2,             "0.30000000000000004"},
+        {-2.5,                "-2.5"},
+        {123456789,           "123456789"},
+    };
+    struct miniweb_session s;
+    char what[80];
+    for(size_t i = 0; i < sizeof(cases)/sizeof(cases[0]); i++) {
+        session_init(&s, -1);
+        sprintf(what, "JSON %s", cases[i].text);
+        check(miniweb_json_double(&s, cases[i].value) && s.data_used == strlen(cases[i].text) &&
+              memcmp(s.data, cases[i].text, s.data_used) == 0 && strtod(cases[i].text, NULL) == cases[i].value, what);
+        session_empty(&s);
+    }
+}
+
+/////////////////////////////////////////////////////////////
+int main(void) {
+    static const char *plain[3] = {
+        "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d",
+        "8286 84be 5808 6e6f 2d63 6163 6865",
+        "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65",
+    };
+    static const char *huffman[3] = {
+        "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff",
+        "8286 84be 5886 a8eb 1064 9cbf",
+        "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf",
+    };
+
+#ifdef MINIWEB_STATIC
+    static_init();      // As miniweb_run() does first
+#endif
+    test_integers();
+    test_huffman();
+    test_header_blocks("C.3", plain);
+    test_header_blocks("C.4", huffman);
+    test_json_double();
+
+    printf("%i tests, %i failed\n", tests, failures);
+    return failures != 0;
+}